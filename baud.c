@@ -0,0 +1,132 @@
+/*
+ * CH341 Driver baud rate routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef CH341_USER_MODE
+#include "baud.h"
+#else
+#include "ch341.h"
+#endif
+
+/*
+ * The CH341 derives its bit clock from a 48 MHz reference:
+ *
+ *   BaudRate = 48000000 / (2^(12 - 3 * Prescaler - Factor) * Divisor)
+ *
+ * with Prescaler 0..3 and Factor 0..1 in register 0x12, and 0x100 - Divisor
+ * in register 0x13. The full clock (Factor = 1) needs Divisor 9..255, the
+ * halved one accepts 2..256. Every combination is tried and the one closest
+ * to the requested rate wins; on a tie the lower base clock is kept, as the
+ * receiver is more tolerant then.
+ *
+ * The table below holds the result of that search for the standard rates,
+ * tools/ch341baud.c checks that the two agree. Bit 7 of register 0x12 is
+ * not part of the divisor, CH341UsbSetLine adds it where the chip has it.
+ */
+
+typedef struct _BAUD_TABLE_ENTRY {
+    ULONG BaudRate;
+    BAUD_DIVISOR Divisor;
+} BAUD_TABLE_ENTRY;
+
+static const BAUD_TABLE_ENTRY BaudTable[] = {
+    {      50, { 0x00, 0x16,      50,   1602 } },
+    {      75, { 0x00, 0x64,      75,   1602 } },
+    {     110, { 0x04, 0x2b,     110,    320 } },
+    {     134, { 0x04, 0x51,     134,   -533 } },
+    {     150, { 0x00, 0xb2,     150,   1602 } },
+    {     300, { 0x00, 0xd9,     300,   1602 } },
+    {     600, { 0x01, 0x64,     601,   1602 } },
+    {    1200, { 0x01, 0xb2,    1202,   1602 } },
+    {    1800, { 0x01, 0xcc,    1803,   1602 } },
+    {    2400, { 0x01, 0xd9,    2404,   1602 } },
+    {    4800, { 0x02, 0x64,    4808,   1602 } },
+    {    7200, { 0x02, 0x98,    7212,   1602 } },
+    {    9600, { 0x02, 0xb2,    9615,   1602 } },
+    {   14400, { 0x02, 0xcc,   14423,   1602 } },
+    {   19200, { 0x02, 0xd9,   19231,   1602 } },
+    {   38400, { 0x03, 0x64,   38462,   1602 } },
+    {   57600, { 0x03, 0x98,   57692,   1602 } },
+    {  115200, { 0x03, 0xcc,  115385,   1602 } },
+    {  128000, { 0x03, 0xd1,  127660,  -2659 } },
+    {  230400, { 0x03, 0xe6,  230769,   1602 } },
+    {  256000, { 0x07, 0xd1,  255319,  -2659 } },
+    {  460800, { 0x03, 0xf3,  461538,   1602 } },
+    {  921600, { 0x07, 0xf3,  923077,   1602 } },
+    { 1500000, { 0x03, 0xfc, 1500000,      0 } },
+    { 2000000, { 0x03, 0xfd, 2000000,      0 } },
+    { 3000000, { 0x03, 0xfe, 3000000,      0 } },
+};
+
+#define CH341_CLOCK_DIVISOR(Prescaler, Factor) (1UL << (12 - 3 * (Prescaler) - (Factor)))
+
+NTSTATUS
+CH341ComputeBaudDivisor(
+    _In_ ULONG BaudRate,
+    _Out_ PBAUD_DIVISOR Divisor) {
+    ULONG i;
+    ULONG Prescaler;
+    ULONG Factor;
+    ULONG ClockDivisor;
+    ULONG Candidate;
+    ULONG First;
+    ULONGLONG Multiple;
+    ULONGLONG Error;
+    ULONGLONG BestMultiple = 0;
+    ULONGLONG BestError = 0;
+    LONGLONG Target;
+    for (i = 0; i < RTL_NUMBER_OF(BaudTable); i++) {
+        if (BaudTable[i].BaudRate == BaudRate) {
+            *Divisor = BaudTable[i].Divisor;
+            return STATUS_SUCCESS;
+        }
+    }
+    if (BaudRate < CH341_MIN_BAUD_RATE || BaudRate > CH341_MAX_BAUD_RATE)
+        return STATUS_INVALID_PARAMETER;
+    for (Prescaler = 4; Prescaler-- > 0;) {
+        for (Factor = 0; Factor < 2; Factor++) {
+            ClockDivisor = CH341_CLOCK_DIVISOR(Prescaler, Factor);
+            /* The best divisor is one of the two around the exact quotient */
+            First = (ULONG)(CH341_BAUD_CLOCK / ((ULONGLONG)ClockDivisor * BaudRate));
+            for (Candidate = First; Candidate <= First + 1; Candidate++) {
+                if (Candidate < (Factor ? 9 : 2) || Candidate > (Factor ? 255 : 256))
+                    continue;
+                Multiple = (ULONGLONG)ClockDivisor * Candidate;
+                Target = (LONGLONG)BaudRate * (LONGLONG)Multiple;
+                Error = (ULONGLONG)(CH341_BAUD_CLOCK > Target ? CH341_BAUD_CLOCK - Target :
+                                    Target - CH341_BAUD_CLOCK);
+                /* Error / Multiple < BestError / BestMultiple */
+                if (!BestMultiple || Error * BestMultiple < BestError * Multiple) {
+                    BestMultiple = Multiple;
+                    BestError = Error;
+                    Divisor->Prescaler = (UCHAR)(Factor << 2 | Prescaler);
+                    Divisor->Divisor = (UCHAR)(0x100 - Candidate);
+                }
+            }
+        }
+    }
+    if (!BestMultiple)
+        return STATUS_INVALID_PARAMETER;
+    Target = (LONGLONG)BaudRate * (LONGLONG)BestMultiple;
+    Divisor->ActualRate = (ULONG)((CH341_BAUD_CLOCK + BestMultiple / 2) / BestMultiple);
+    Divisor->ErrorPpm = (LONG)((CH341_BAUD_CLOCK - Target) * 1000000 / Target);
+    /* Compared before rounding, ErrorPpm alone lets errors just above the bound through */
+    if (BestError * 1000000 > (ULONGLONG)CH341_MAX_BAUD_ERROR_PPM * (ULONGLONG)Target)
+        return STATUS_INVALID_PARAMETER;
+    return STATUS_SUCCESS;
+}
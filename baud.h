@@ -0,0 +1,41 @@
+/*
+ * CH341 Driver baud rate generator declarations
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Kept apart from ch341.h so that tools/ch341baud.c can build baud.c in
+ * user mode.
+ */
+
+#pragma once
+
+#define CH341_BAUD_CLOCK                48000000
+/* 48 MHz / (4096 * 256) is 45.8 baud, the slowest the generator can do */
+#define CH341_MIN_BAUD_RATE             46
+#define CH341_MAX_BAUD_RATE             3000000
+#define CH341_MAX_BAUD_ERROR_PPM        30000
+
+typedef struct _BAUD_DIVISOR {
+    UCHAR Prescaler;
+    UCHAR Divisor;
+    ULONG ActualRate;
+    LONG ErrorPpm;
+} BAUD_DIVISOR, *PBAUD_DIVISOR;
+
+NTSTATUS CH341ComputeBaudDivisor(_In_ ULONG BaudRate,
+                                 _Out_ PBAUD_DIVISOR Divisor);
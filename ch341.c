@@ -35,6 +35,8 @@ __drv_dispatchType(IRP_MJ_READ)
 static DRIVER_DISPATCH CH341DispatchRead;
 __drv_dispatchType(IRP_MJ_WRITE)
 static DRIVER_DISPATCH CH341DispatchWrite;
+__drv_dispatchType(IRP_MJ_FLUSH_BUFFERS)
+static DRIVER_DISPATCH CH341DispatchFlush;
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
@@ -45,8 +47,12 @@ static DRIVER_DISPATCH CH341DispatchWrite;
 #pragma alloc_text(PAGE, CH341DispatchClose)
 #pragma alloc_text(PAGE, CH341DispatchRead)
 #pragma alloc_text(PAGE, CH341DispatchWrite)
+#pragma alloc_text(PAGE, CH341DispatchFlush)
 #endif /* defined ALLOC_PRAGMA */
 
+ULONG CH341TraceLevel = CH341_DEFAULT_TRACE_LEVEL;
+ULONG CH341TraceFlags = CH341_DEFAULT_TRACE_FLAGS;
+
 NTSTATUS
 NTAPI
 DriverEntry(
@@ -55,6 +61,7 @@ DriverEntry(
     PAGED_CODE();
     CH341Debug(         "%s. DriverObject=%p, RegistryPath='%wZ'\n",
                         __FUNCTION__, DriverObject,    RegistryPath);
+    CH341TraceInitialize();
     DriverObject->DriverUnload = CH341Unload;
     DriverObject->DriverExtension->AddDevice = CH341AddDevice;
     DriverObject->MajorFunction[IRP_MJ_PNP] = CH341DispatchPnp;
@@ -66,6 +73,7 @@ DriverEntry(
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = CH341DispatchClose;
     DriverObject->MajorFunction[IRP_MJ_READ] = CH341DispatchRead;
     DriverObject->MajorFunction[IRP_MJ_WRITE] = CH341DispatchWrite;
+    DriverObject->MajorFunction[IRP_MJ_FLUSH_BUFFERS] = CH341DispatchFlush;
     return STATUS_SUCCESS;
 }
 
@@ -182,7 +190,7 @@ CH341DispatchRead(
     NTSTATUS Status = STATUS_SUCCESS;
     PIO_STACK_LOCATION IoStack;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+    CH341Verbose(       "%s. DeviceObject=%p, Irp=%p\n",
                         __FUNCTION__, DeviceObject,    Irp);
     IoStack = IoGetCurrentIrpStackLocation(Irp);
     NT_ASSERT(IoStack->MajorFunction == IRP_MJ_READ);
@@ -192,9 +200,9 @@ CH341DispatchRead(
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
         return Status;
     }
-    Status = CH341UsbRead(DeviceObject, Irp);
+    Status = CH341Read(DeviceObject, Irp);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbRead failed with %08lx\n",
+        CH341Error(         "%s. CH341Read failed with %08lx\n",
                             __FUNCTION__, Status);
     }
     return Status;
@@ -209,7 +217,7 @@ CH341DispatchWrite(
     NTSTATUS Status = STATUS_SUCCESS;
     PIO_STACK_LOCATION IoStack;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+    CH341Verbose(       "%s. DeviceObject=%p, Irp=%p\n",
                         __FUNCTION__, DeviceObject,    Irp);
     IoStack = IoGetCurrentIrpStackLocation(Irp);
     NT_ASSERT(IoStack->MajorFunction == IRP_MJ_WRITE);
@@ -219,9 +227,30 @@ CH341DispatchWrite(
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
         return Status;
     }
-    Status = CH341UsbWrite(DeviceObject, Irp);
+    Status = CH341Write(DeviceObject, Irp);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341Write failed with %08lx\n",
+                            __FUNCTION__, Status);
+    }
+    return Status;
+}
+
+static
+NTSTATUS
+NTAPI
+CH341DispatchFlush(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_FLUSH_BUFFERS);
+    Status = CH341Flush(DeviceObject, Irp);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbWrite failed with %08lx\n",
+        CH341Error(         "%s. CH341Flush failed with %08lx\n",
                             __FUNCTION__, Status);
     }
     return Status;
@@ -26,6 +26,11 @@
 #include <usbdlib.h>
 #include <usbioctl.h>
 
+#include "ch341ioctl.h"
+#include "baud.h"
+#include "scan.h"
+#include "modem.h"
+
 /* Pool tags */
 #define CH341_TAG      '32LP'
 #define CH341_URB_TAG  'U2LP'
@@ -34,7 +39,89 @@
 #define CH341_VENDOR_READ_REQUEST  0x95
 #define CH341_VENDOR_WRITE_REQUEST 0x9A
 #define CH341_SET_LINE_REQUEST     0xA1
-#define CH341_SET_CONTROL_REQUEST  0x10
+#define CH341_MODEM_CTRL_REQUEST   0xA4
+#define CH341_GET_VERSION_REQUEST  0x5F
+
+/* CH341_MODEM_CTRL_REQUEST takes the inverted line states */
+#define CH341_MODEM_CTRL_DTR       0x20
+#define CH341_MODEM_CTRL_RTS       0x40
+
+/* Room for the whole configuration descriptor in a single request */
+#define CH341_CONFIG_DESCRIPTOR_CACHE_SIZE  256
+
+/* Read pump */
+#define CH341_READ_URB_SIZE             512
+#define CH341_DEFAULT_READ_URB_COUNT    4
+#define CH341_MAX_READ_URB_COUNT        16
+#define CH341_MAX_READ_ERRORS           8
+#define CH341_RX_BUFFER_SIZE            16384
+#define CH341_MAX_RX_BUFFER_SIZE        (1024 * 1024)
+
+/* How long a stopper waits for aborted transfers before aborting again */
+#define CH341_PIPE_DRAIN_TIMEOUT_MS     100
+#define CH341_PIPE_DRAIN_POLL_US        1000
+
+/* Write path */
+#define CH341_TX_BUFFER_SIZE            4096
+#define CH341_MAX_TX_QUEUE_SIZE         (1024 * 1024)
+#define CH341_DEFAULT_WRITE_URB_COUNT   4
+#define CH341_MAX_WRITE_URB_COUNT       16
+#define CH341_DEFAULT_BULK_OUT_PACKET   32
+#define CH341_DEFAULT_COALESCE_DEADLINE 500     /* microseconds */
+#define CH341_MAX_COALESCE_DEADLINE     100000  /* microseconds */
+#define CH341_MIN_DIRECT_IO_THRESHOLD   512
+
+/* Keeps each processor's counters on their own cache lines */
+#define CH341_STATS_SLOT_SIZE           192
+
+/* Trace ring, in records */
+#define CH341_DEFAULT_TRACE_RING_SIZE   2048
+#define CH341_MAX_TRACE_RING_SIZE       65536
+
+/*
+ * Chips newer than version 0x27 hold received data back until a full
+ * bulk packet is ready, unless bit 7 of the prescaler register is set.
+ */
+#define CH341_PRESCALER_NO_WAIT         0x80
+#define CH341_PRESCALER_NO_WAIT_VERSION 0x28
+
+/* Registers */
+#define CH341_REG_PRESCALER             0x12
+#define CH341_REG_DIVISOR               0x13
+#define CH341_REG_LCR                   0x18
+#define CH341_REG_LCR2                  0x25
+#define CH341_REG_BREAK                 0x05
+
+/* Break register */
+#define CH341_BREAK_OFF                 0x01
+#define CH341_MAX_BREAK_STALL           50      /* microseconds */
+
+/* Line control register */
+#define CH341_LCR_ENABLE_RX             0x80
+#define CH341_LCR_ENABLE_TX             0x40
+#define CH341_LCR_MARK_SPACE            0x20
+#define CH341_LCR_PAR_EVEN              0x10
+#define CH341_LCR_ENABLE_PAR            0x08
+#define CH341_LCR_STOP_BITS_2           0x04
+#define CH341_LCR_CS8                   0x03
+#define CH341_LCR_CS7                   0x02
+#define CH341_LCR_CS6                   0x01
+#define CH341_LCR_CS5                   0x00
+
+/* Modem status */
+#define CH341_STATUS_REGISTER           0x0706
+#define CH341_MAX_STATUS_ERRORS         8
+
+/* URB pool */
+#define CH341_URB_POOL_CONTROL_COUNT    4
+#define CH341_URB_POOL_BULK_COUNT       CH341_MAX_WRITE_URB_COUNT
+
+/* Arrival time of a read or write IRP, valid while the driver owns it */
+#define CH341IrpArrivalTime(Irp) (*(volatile LONGLONG *)&(Irp)->Tail.Overlay.DriverContext[0])
+/* Total timeout of a write IRP in 100ns units, 0 for none. Writes never enter a CSQ */
+#define CH341IrpWriteTimeout(Irp) (*(ULONGLONG *)&(Irp)->Tail.Overlay.DriverContext[2])
+
+#define CH341_MS_TO_100NS(Ms)       ((ULONGLONG)(Ms) * 10000)
 
 /* Misc defines */
 #if defined(_MSC_VER) && !defined(inline)
@@ -46,6 +133,11 @@
 #endif
 
 /* Types */
+typedef union _STATS_SLOT {
+    CH341_STATS Stats;
+    UCHAR Padding[CH341_STATS_SLOT_SIZE];
+} STATS_SLOT, *PSTATS_SLOT;
+
 typedef enum _DEVICE_PNP_STATE {
     NotStarted,
     Started,
@@ -62,6 +154,65 @@ typedef struct _QUEUE {
     KSPIN_LOCK QueueSpinLock;
 } QUEUE, *PQUEUE;
 
+typedef enum _URB_POOL_TYPE {
+    UrbPoolControl,
+    UrbPoolBulk,
+    UrbPoolMaximum
+} URB_POOL_TYPE;
+
+typedef struct _URB_POOL {
+    SLIST_HEADER FreeList[UrbPoolMaximum];
+    PVOID Memory;
+    SIZE_T MemorySize;
+} URB_POOL, *PURB_POOL;
+
+typedef enum _LINE_REGISTER {
+    LineRegisterPrescaler,
+    LineRegisterDivisor,
+    LineRegisterLcr,
+    LineRegisterLcr2,
+    LineRegisterMaximum
+} LINE_REGISTER;
+
+typedef struct _RING_BUFFER {
+    PUCHAR Buffer;
+    ULONG Size;
+    ULONG Head;
+    ULONG Tail;
+} RING_BUFFER, *PRING_BUFFER;
+
+typedef struct _READ_CONTEXT {
+    PDEVICE_OBJECT DeviceObject;
+    PIRP Irp;
+    ULONG Errors;
+    LONGLONG SubmitTime;
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER Urb;
+    UCHAR Buffer[CH341_READ_URB_SIZE];
+} READ_CONTEXT, *PREAD_CONTEXT;
+
+typedef struct _STATUS_CONTEXT {
+    PDEVICE_OBJECT DeviceObject;
+    PIRP Irp;
+    ULONG Errors;
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER Urb;
+    UCHAR Buffer[CH341_STATUS_PACKET_SIZE];
+} STATUS_CONTEXT, *PSTATUS_CONTEXT;
+
+typedef struct _WRITE_CONTEXT {
+    LIST_ENTRY ListEntry;
+    PDEVICE_OBJECT DeviceObject;
+    PIRP Irp;
+    PURB Urb;
+    LIST_ENTRY CompleteList;
+    PIRP PartialIrp;
+    NTSTATUS Status;
+    BOOLEAN Done;
+    ULONG Length;
+    PMDL Mdl;
+    LONGLONG SubmitTime;
+    UCHAR Buffer[CH341_TX_BUFFER_SIZE];
+} WRITE_CONTEXT, *PWRITE_CONTEXT;
+
 typedef struct _DEVICE_EXTENSION {
     PDEVICE_OBJECT LowerDevice;
     DEVICE_PNP_STATE PnpState;
@@ -72,6 +223,7 @@ typedef struct _DEVICE_EXTENSION {
     USBD_PIPE_HANDLE BulkInPipe;
     USBD_PIPE_HANDLE BulkOutPipe;
     USBD_PIPE_HANDLE InterruptInPipe;
+    USHORT BulkOutPacketSize;
     FAST_MUTEX LineStateMutex;
     ULONG BaudRate;
     UCHAR StopBits;
@@ -79,58 +231,213 @@ typedef struct _DEVICE_EXTENSION {
     UCHAR DataBits;
     SERIAL_CHARS Chars;
     SERIAL_HANDFLOW HandFlow;
+    UCHAR EscapeChar;
     USHORT DtrRts;
+    USHORT DtrRtsStaged;
+    BOOLEAN DtrRtsPending;
+    ULONG ControlCoalesceDeadline;
+    PEX_TIMER ControlTimer;
+    UCHAR ChipVersion;
+    BOOLEAN BreakOn;
+    BOOLEAN BreakTimed;
+    UCHAR BreakRegister;
+    BOOLEAN BreakRegisterValid;
+    UCHAR LineRegisters[LineRegisterMaximum];
+    BOOLEAN LineRegistersValid;
+    KSPIN_LOCK RxLock;
+    RING_BUFFER RxBuffer;
+    QUEUE ReadQueue;
+    ULONG RxBytesDropped;
+    volatile LONG RxQueuedBytes;
+    volatile LONG CommErrors;
+    BOOLEAN RxXoffSent;
+    BOOLEAN RxLinesDropped;
+    volatile LONG RxFlowKick;
+    PIO_WORKITEM FlowWorkItem;
+    volatile LONG FlowWorkState;
+    KEVENT FlowWorkIdleEvent;
+    ULONG ReadUrbCount;
+    PREAD_CONTEXT ReadContexts;
+    FAST_MUTEX ReadPumpMutex;
+    volatile LONG ReadPumpRunning;
+    volatile LONG ReadsOutstanding;
+    volatile LONG ReadsSubmitting;
+    KEVENT ReadPumpIdleEvent;
+    SERIAL_TIMEOUTS Timeouts;
+    PIRP ReadCurrent;
+    ULONG ReadFlags;
+    ULONGLONG ReadInterval;
+    ULONGLONG ReadTotalDeadline;
+    ULONGLONG ReadIntervalDeadline;
+    PEX_TIMER ReadTimer;
+    PSTATUS_CONTEXT StatusContext;
+    volatile LONG StatusPipeRunning;
+    volatile LONG StatusSubmitting;
+    KEVENT StatusIdleEvent;
+    volatile LONG ModemStatus;
+    KSPIN_LOCK EventLock;
+    ULONG WaitMask;
+    ULONG HistoryMask;
+    PIRP WaitIrp;
+    URB_POOL UrbPool;
+    PIRP ControlIrp;
+    KEVENT ControlEvent;
+    FAST_MUTEX ControlMutex;
+    LARGE_INTEGER PerformanceFrequency;
+    ULONG ControlRequests;
+    ULONGLONG ControlTicksTotal;
+    ULONGLONG ControlTicksMax;
+    ULONG InitMicroseconds;
+    PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor;
+    USHORT CachedVendorId;
+    USHORT CachedProductId;
+    USHORT CachedBcdDevice;
+    PSTATS_SLOT Stats;
+    ULONG StatsSlots;
+    KSPIN_LOCK StatsLock;
+    CH341_STATS StatsBaseline;
+    volatile LONG Latency[CH341_LATENCY_HISTOGRAMS][CH341_LATENCY_BUCKETS];
+    ULONG TraceLevel;
+    ULONG TraceFlags;
+    LIST_ENTRY TraceListEntry;
+    PCH341_TRACE_RECORD TraceRing;
+    ULONG TraceCapacity;
+    volatile LONG TraceNext;
+    ULONGLONG TraceIdKey[2];
+    ULONG DirectIoThreshold;
+    BOOLEAN WriteCoalescing;
+    ULONG WriteCoalesceDeadline;
+    KSPIN_LOCK TxLock;
+    LIST_ENTRY TxQueue;
+    LIST_ENTRY TxFlushList;
+    volatile ULONG TxQueuedBytes;
+    volatile ULONG TxInFlightBytes;
+    ULONG TxQueueSize;
+    volatile ULONG HoldReasons;
+    UCHAR TxFlowChar;
+    BOOLEAN TxFlowCharPending;
+    UCHAR TxImmediateChar;
+    BOOLEAN TxImmediateCharPending;
+    ULONG TxHeadOffset;
+    ULONG WriteUrbCount;
+    PWRITE_CONTEXT WriteContexts;
+    LIST_ENTRY TxFreeList;
+    LIST_ENTRY TxInFlightList;
+    BOOLEAN TxRunning;
+    BOOLEAN TxSubmitting;
+    BOOLEAN TxFlushPending;
+    BOOLEAN TxTimerArmed;
+    PEX_TIMER TxTimer;
+    PIRP TxTimeoutIrp;
+    ULONGLONG TxTimeoutDeadline;
+    PEX_TIMER TxTimeoutTimer;
+    KEVENT TxIdleEvent;
+    ULONG TxUrbs;
+    ULONGLONG TxBytes;
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
-/* Debugging functions */
-static
-inline
-VOID
-CH341Debug(
-    _In_ PCSTR Format,
-    ...) {
-    va_list Arguments;
-    va_start(Arguments, Format);
-    (VOID)vDbgPrintExWithPrefix("CH341: ",
-                                DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_TRACE_LEVEL,
-                                Format,
-                                Arguments);
-    va_end(Arguments);
-}
+/*
+ * Tracing. Every trace point belongs to a subsystem (the CH341_TRACE_SUBSYSTEM
+ * of the file it is in) and a level. Points above CH341_TRACE_MAX_LEVEL are
+ * compiled out, including the evaluation of their arguments; the remaining
+ * ones are checked against CH341TraceLevel/CH341TraceFlags before anything
+ * is formatted. Each device keeps its own TraceLevel/TraceFlags registry
+ * values; as trace points are not tied to a device, the globals hold the
+ * highest level and all flags any present device asks for.
+ */
+#define CH341_TRACE_LEVEL_NONE      0
+#define CH341_TRACE_LEVEL_ERROR     1
+#define CH341_TRACE_LEVEL_WARNING   2
+#define CH341_TRACE_LEVEL_DEBUG     3
+#define CH341_TRACE_LEVEL_VERBOSE   4
 
-static
-inline
-VOID
-CH341Warn(
-    _In_ PCSTR Format,
-    ...) {
-    va_list Arguments;
-    va_start(Arguments, Format);
-    (VOID)vDbgPrintExWithPrefix("CH341: ",
-                                DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_WARNING_LEVEL,
-                                Format,
-                                Arguments);
-    va_end(Arguments);
-}
+#define CH341_TRACE_DRIVER          0x00000001
+#define CH341_TRACE_PNP             0x00000002
+#define CH341_TRACE_IOCTL           0x00000004
+#define CH341_TRACE_READ            0x00000008
+#define CH341_TRACE_WRITE           0x00000010
+#define CH341_TRACE_USB             0x00000020
+#define CH341_TRACE_STATUS          0x00000040
+#define CH341_TRACE_FLOW            0x00000080
+#define CH341_TRACE_ALL             0xFFFFFFFF
+
+#ifndef CH341_TRACE_MAX_LEVEL
+#if DBG
+#define CH341_TRACE_MAX_LEVEL       CH341_TRACE_LEVEL_VERBOSE
+#else
+#define CH341_TRACE_MAX_LEVEL       CH341_TRACE_LEVEL_WARNING
+#endif
+#endif /* !defined CH341_TRACE_MAX_LEVEL */
+
+#ifndef CH341_TRACE_SUBSYSTEM
+#define CH341_TRACE_SUBSYSTEM       CH341_TRACE_DRIVER
+#endif
+
+#define CH341_DEFAULT_TRACE_LEVEL   CH341_TRACE_LEVEL_DEBUG
+#define CH341_DEFAULT_TRACE_FLAGS   CH341_TRACE_ALL
+
+extern ULONG CH341TraceLevel;
+extern ULONG CH341TraceFlags;
 
 static
 inline
 VOID
-CH341Error(
+CH341TracePrint(
+    _In_ ULONG Level,
     _In_ PCSTR Format,
     ...) {
     va_list Arguments;
     va_start(Arguments, Format);
     (VOID)vDbgPrintExWithPrefix("CH341: ",
                                 DPFLTR_IHVDRIVER_ID,
-                                DPFLTR_ERROR_LEVEL,
+                                Level == CH341_TRACE_LEVEL_ERROR ? DPFLTR_ERROR_LEVEL :
+                                Level == CH341_TRACE_LEVEL_WARNING ? DPFLTR_WARNING_LEVEL :
+                                Level == CH341_TRACE_LEVEL_DEBUG ? DPFLTR_TRACE_LEVEL :
+                                DPFLTR_INFO_LEVEL,
                                 Format,
                                 Arguments);
     va_end(Arguments);
 }
 
+#define CH341TraceEnabled(Flags, Level)                                 \
+    ((Level) <= CH341_TRACE_MAX_LEVEL &&                                \
+     (Level) <= CH341TraceLevel &&                                      \
+     ((Flags) & CH341TraceFlags) != 0)
+
+#define CH341Trace(Flags, Level, ...)                                   \
+    do {                                                                \
+        if (CH341TraceEnabled(Flags, Level))                            \
+            CH341TracePrint(Level, __VA_ARGS__);                        \
+    } while (0)
+
+/* Debugging functions */
+#define CH341Error(...)     CH341Trace(CH341_TRACE_SUBSYSTEM, CH341_TRACE_LEVEL_ERROR, __VA_ARGS__)
+#define CH341Warn(...)      CH341Trace(CH341_TRACE_SUBSYSTEM, CH341_TRACE_LEVEL_WARNING, __VA_ARGS__)
+#define CH341Debug(...)     CH341Trace(CH341_TRACE_SUBSYSTEM, CH341_TRACE_LEVEL_DEBUG, __VA_ARGS__)
+/* For per-IRP and per-URB paths; off unless TraceLevel asks for it */
+#define CH341Verbose(...)   CH341Trace(CH341_TRACE_SUBSYSTEM, CH341_TRACE_LEVEL_VERBOSE, __VA_ARGS__)
+
+/* flow.c */
+_Requires_lock_held_(DeviceExtension->RxLock)
+VOID CH341FlowCheckReceive(_In_ PDEVICE_EXTENSION DeviceExtension);
+NTSTATUS CH341FlowAllocate(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341FlowFree(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341FlowKick(_In_ PDEVICE_EXTENSION DeviceExtension);
+VOID CH341FlowUpdateHolds(_In_ PDEVICE_EXTENSION DeviceExtension);
+NTSTATUS CH341FlowSetLines(_In_ PDEVICE_OBJECT DeviceObject,
+                           _In_ USHORT Set,
+                           _In_ USHORT Clear,
+                           _In_ BOOLEAN Defer);
+NTSTATUS CH341FlowSetHandFlow(_In_ PDEVICE_OBJECT DeviceObject,
+                              _In_ const SERIAL_HANDFLOW *HandFlow);
+NTSTATUS CH341FlowSetChars(_In_ PDEVICE_OBJECT DeviceObject,
+                           _In_ const SERIAL_CHARS *Chars);
+NTSTATUS CH341FlowSendBreak(_In_ PDEVICE_OBJECT DeviceObject,
+                             _In_ ULONG BreakMicroseconds,
+                             _In_ ULONG MarkMicroseconds);
+NTSTATUS CH341FlowSetEscapeChar(_In_ PDEVICE_OBJECT DeviceObject,
+                                _In_ UCHAR EscapeChar);
+
 /* ioctl.c */
 __drv_dispatchType(IRP_MJ_DEVICE_CONTROL)
 __drv_dispatchType(IRP_MJ_INTERNAL_DEVICE_CONTROL)
@@ -142,9 +449,168 @@ DRIVER_ADD_DEVICE CH341AddDevice;
 __drv_dispatchType(IRP_MJ_PNP)
 DRIVER_DISPATCH CH341DispatchPnp;
 
+/* pool.c */
+NTSTATUS CH341UrbPoolInitialize(_Out_ PURB_POOL Pool);
+VOID CH341UrbPoolFree(_Inout_ PURB_POOL Pool);
+PURB CH341UrbAllocate(_In_ PDEVICE_OBJECT DeviceObject,
+                      _In_ URB_POOL_TYPE Type);
+VOID CH341UrbFree(_In_ PDEVICE_OBJECT DeviceObject,
+                  _In_ PURB Urb);
+
+/* queue.c */
+NTSTATUS CH341InitializeQueue(_In_ PQUEUE Queue);
+NTSTATUS CH341QueueIrp(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+
+/* read.c */
+NTSTATUS CH341StartReadPump(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341StopReadPump(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341CancelPendingReads(_In_ PDEVICE_OBJECT DeviceObject,
+                             _In_ NTSTATUS Status);
+NTSTATUS CH341Read(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+NTSTATUS CH341AllocateReadTimer(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341FreeReadTimer(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341ReadGetTimeouts(_In_ PDEVICE_OBJECT DeviceObject,
+                          _Out_ PSERIAL_TIMEOUTS Timeouts);
+VOID CH341ReadSetTimeouts(_In_ PDEVICE_OBJECT DeviceObject,
+                          _In_ const SERIAL_TIMEOUTS *Timeouts);
+NTSTATUS CH341ReadSetQueueSize(_In_ PDEVICE_OBJECT DeviceObject,
+                               _In_ ULONG Size);
+VOID CH341ReadPurge(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341ReadInsertModemStatus(_In_ PDEVICE_OBJECT DeviceObject,
+                                _In_ UCHAR ModemStatus);
+
+/*
+ * Data buffer of a read or write IRP. With direct I/O the system mapping is
+ * created on first use and cached in the MDL, CH341Read and CH341Write make
+ * that first call so later ones cannot fail.
+ */
+static
+inline
+PUCHAR
+CH341IrpBuffer(
+    _In_ PIRP Irp) {
+    if (!Irp->MdlAddress)
+        return Irp->AssociatedIrp.SystemBuffer;
+    return MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                        NormalPagePriority | MdlMappingNoExecute);
+}
+
+/* ring.c */
+NTSTATUS CH341RingInitialize(_Out_ PRING_BUFFER Ring,
+                             _In_ ULONG Size);
+VOID CH341RingFree(_Inout_ PRING_BUFFER Ring);
+ULONG CH341RingWrite(_Inout_ PRING_BUFFER Ring,
+                     _In_reads_bytes_(Length) const UCHAR *Data,
+                     _In_ ULONG Length);
+ULONG CH341RingRead(_Inout_ PRING_BUFFER Ring,
+                    _Out_writes_bytes_(Length) PUCHAR Data,
+                    _In_ ULONG Length);
+VOID CH341RingMove(_Inout_ PRING_BUFFER Target,
+                   _Inout_ PRING_BUFFER Source);
+
+static
+inline
+ULONG
+CH341RingCount(
+    _In_ const RING_BUFFER *Ring) {
+    return Ring->Head - Ring->Tail;
+}
+
+static
+inline
+VOID
+CH341RingClear(
+    _Inout_ PRING_BUFFER Ring) {
+    Ring->Tail = Ring->Head;
+}
+
+/* stats.c */
+NTSTATUS CH341StatsAllocate(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341StatsFree(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341StatsQuery(_In_ PDEVICE_OBJECT DeviceObject,
+                     _Out_ PCH341_STATS Stats);
+VOID CH341StatsClear(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341LatencyAdd(_In_ PDEVICE_EXTENSION DeviceExtension,
+                     _In_ ULONG Histogram,
+                     _In_ ULONGLONG Ticks);
+VOID CH341LatencyQuery(_In_ PDEVICE_OBJECT DeviceObject,
+                       _Out_ PCH341_LATENCY Latency);
+
+static
+inline
+VOID
+CH341StatsAddCounter(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG Offset,
+    _In_ ULONGLONG Value) {
+    ULONG Processor;
+    if (!DeviceExtension->Stats)
+        return;
+    Processor = KeGetCurrentProcessorNumberEx(NULL);
+    /* We may have been rescheduled since, the interlocked add keeps that safe */
+    if (Processor >= DeviceExtension->StatsSlots)
+        Processor = 0;
+    (VOID)InterlockedExchangeAddNoFence64((volatile LONG64 *)((PUCHAR)&DeviceExtension->Stats[Processor].Stats + Offset),
+                                          (LONG64)Value);
+}
+
+#define CH341StatsAdd(DeviceExtension, Counter, Value) \
+    CH341StatsAddCounter(DeviceExtension, FIELD_OFFSET(CH341_STATS, Counter), Value)
+
+static
+inline
+VOID
+CH341LatencySince(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG Histogram,
+    _In_ LONGLONG StartTime) {
+    LONGLONG Now = KeQueryPerformanceCounter(NULL).QuadPart;
+    CH341LatencyAdd(DeviceExtension,
+                    Histogram,
+                    Now > StartTime ? (ULONGLONG)(Now - StartTime) : 0);
+}
+
+/* status.c */
+NTSTATUS CH341StartStatusPipe(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341StopStatusPipe(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341SignalEvents(_In_ PDEVICE_OBJECT DeviceObject,
+                       _In_ ULONG Events);
+ULONG CH341GetWaitMask(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS CH341SetWaitMask(_In_ PDEVICE_OBJECT DeviceObject,
+                          _In_ ULONG WaitMask);
+NTSTATUS CH341WaitOnMask(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+VOID CH341CancelWait(_In_ PDEVICE_OBJECT DeviceObject,
+                     _In_ NTSTATUS Status);
+
+/* trace.c */
+VOID CH341TraceInitialize(VOID);
+VOID CH341TraceAddDevice(_In_ PDEVICE_OBJECT DeviceObject,
+                         _In_ ULONG Level,
+                         _In_ ULONG Flags);
+VOID CH341TraceRemoveDevice(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS CH341TraceAllocate(_In_ PDEVICE_OBJECT DeviceObject,
+                            _In_ ULONG Capacity);
+VOID CH341TraceFree(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341TraceEvent(_In_ PDEVICE_EXTENSION DeviceExtension,
+                     _In_ USHORT Event,
+                     _In_ PVOID Id,
+                     _In_ ULONG Length,
+                     _In_ NTSTATUS Status);
+VOID CH341TraceCompleteIrp(_In_ PDEVICE_EXTENSION DeviceExtension,
+                           _In_ PIRP Irp);
+NTSTATUS CH341TraceExport(_In_ PDEVICE_OBJECT DeviceObject,
+                          _Out_writes_bytes_(BufferLength) PVOID Buffer,
+                          _In_ ULONG BufferLength,
+                          _Out_ PULONG_PTR Information);
+
 /* usb.c */
 NTSTATUS CH341UsbStart(_In_ PDEVICE_OBJECT DeviceObject);
 NTSTATUS CH341UsbStop(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS CH341UsbAllocateControlIrp(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341UsbFreeControlIrp(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341UsbFreeDescriptorCache(_In_ PDEVICE_OBJECT DeviceObject);
+NTSTATUS CH341UsbAbortPipe(_In_ PDEVICE_OBJECT DeviceObject,
+                           _In_ USBD_PIPE_HANDLE PipeHandle);
 NTSTATUS CH341UsbSetLine(_In_ PDEVICE_OBJECT DeviceObject,
                          _In_ ULONG BaudRate,
                          _In_ UCHAR StopBits,
@@ -152,5 +618,25 @@ NTSTATUS CH341UsbSetLine(_In_ PDEVICE_OBJECT DeviceObject,
                          _In_ UCHAR DataBits);
 NTSTATUS CH341UsbSetControlLines(_In_ PDEVICE_OBJECT DeviceObject,
                                  _In_ USHORT DtrRts);
-NTSTATUS CH341UsbRead(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
-NTSTATUS CH341UsbWrite(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+NTSTATUS CH341UsbSetBreak(_In_ PDEVICE_OBJECT DeviceObject,
+                          _In_ BOOLEAN On);
+NTSTATUS CH341UsbGetModemStatus(_In_ PDEVICE_OBJECT DeviceObject,
+                                _Out_ PUCHAR Lines);
+
+/* write.c */
+NTSTATUS CH341StartWriteEngine(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341StopWriteEngine(_In_ PDEVICE_OBJECT DeviceObject,
+                          _In_ NTSTATUS Status);
+NTSTATUS CH341Write(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+NTSTATUS CH341Flush(_In_ PDEVICE_OBJECT DeviceObject, _In_ PIRP Irp);
+VOID CH341WritePurge(_In_ PDEVICE_OBJECT DeviceObject);
+VOID CH341WriteQueueFlowChar(_In_ PDEVICE_EXTENSION DeviceExtension,
+                             _In_ UCHAR Char,
+                             _In_ ULONG HoldSet,
+                             _In_ ULONG HoldClear);
+NTSTATUS CH341WriteImmediateChar(_In_ PDEVICE_OBJECT DeviceObject,
+                                 _In_ UCHAR Char);
+VOID CH341WriteSetHold(_In_ PDEVICE_EXTENSION DeviceExtension,
+                       _In_ ULONG HoldSet,
+                       _In_ ULONG HoldClear);
+VOID CH341WriteKick(_In_ PDEVICE_EXTENSION DeviceExtension);
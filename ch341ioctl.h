@@ -0,0 +1,145 @@
+/*
+ * CH341 USB-Serial Driver private IOCTL interface
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Shared between the driver and user mode tools. User mode callers need to
+ * include <windows.h> and <winioctl.h> first.
+ */
+
+#pragma once
+
+/* Function codes 0x800 and up are reserved for vendors */
+#define IOCTL_CH341_GET_TRACE \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CH341_GET_STATS \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CH341_GET_LATENCY \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CH341_SET_CONTROL_LINES \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CH341_SEND_BREAK \
+    CTL_CODE(FILE_DEVICE_SERIAL_PORT, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/* Trace ring events */
+#define CH341_TRACE_EVENT_READ_IRP          1   /* Id = IRP, Length = requested */
+#define CH341_TRACE_EVENT_WRITE_IRP         2   /* Id = IRP, Length = requested */
+#define CH341_TRACE_EVENT_IRP_COMPLETE      3   /* Id = IRP, Length = Information */
+#define CH341_TRACE_EVENT_BULK_IN_SUBMIT    4   /* Id = transfer, Length = buffer size */
+#define CH341_TRACE_EVENT_BULK_IN_COMPLETE  5   /* Id = transfer, Length = received */
+#define CH341_TRACE_EVENT_BULK_OUT_SUBMIT   6   /* Id = transfer, Length = bytes */
+#define CH341_TRACE_EVENT_BULK_OUT_COMPLETE 7   /* Id = transfer, Length = sent */
+
+#define CH341_TRACE_VERSION                 1
+
+typedef struct _CH341_TRACE_RECORD {
+    ULONGLONG Timestamp;        /* Performance counter ticks */
+    ULONGLONG Id;               /* Opaque, equal for events of the same IRP or transfer */
+    ULONG Sequence;
+    USHORT Event;
+    USHORT Processor;
+    ULONG Length;
+    LONG Status;
+} CH341_TRACE_RECORD, *PCH341_TRACE_RECORD;
+
+/* Output of IOCTL_CH341_GET_TRACE, followed by RecordCount records, oldest first */
+typedef struct _CH341_TRACE_HEADER {
+    ULONG Version;
+    ULONG RecordSize;
+    ULONG RecordCount;
+    ULONG Capacity;
+    ULONG NextSequence;
+    ULONG Reserved;
+    LONGLONG Frequency;
+} CH341_TRACE_HEADER, *PCH341_TRACE_HEADER;
+
+/*
+ * Output of IOCTL_CH341_GET_STATS. Counts since the port was added or since
+ * the last IOCTL_SERIAL_CLEAR_STATS.
+ */
+typedef struct _CH341_STATS {
+    ULONGLONG BytesReceived;
+    ULONGLONG BytesTransmitted;
+    ULONGLONG BulkInTransfers;
+    ULONGLONG BulkOutTransfers;
+    ULONGLONG BulkInErrors;
+    ULONGLONG BulkOutErrors;
+    ULONGLONG BufferOverruns;   /* Bytes dropped because the receive buffer was full */
+    ULONGLONG ReadTimeouts;
+    ULONGLONG ControlTransfers;
+    ULONGLONG ControlErrors;
+    ULONGLONG LineWritesIssued;     /* Line register pairs written to the chip */
+    ULONGLONG LineWritesSkipped;    /* Pairs left alone because they were unchanged */
+    ULONGLONG DescriptorFetchesSaved;   /* Descriptor requests served from the cache */
+    ULONGLONG ControlUrbPoolHits;   /* URBs taken from the preallocated pool */
+    ULONGLONG ControlUrbPoolMisses; /* URBs allocated because the pool was empty */
+    ULONGLONG BulkUrbPoolHits;
+    ULONGLONG BulkUrbPoolMisses;
+} CH341_STATS, *PCH341_STATS;
+
+/* Latency histograms */
+#define CH341_LATENCY_WRITE_DISPATCH        0   /* Write IRP arrival to its first bytes being sent */
+#define CH341_LATENCY_BULK_IN               1   /* URB submit to completion */
+#define CH341_LATENCY_BULK_OUT              2
+#define CH341_LATENCY_CONTROL               3
+#define CH341_LATENCY_READ_IRP              4   /* IRP arrival to completion */
+#define CH341_LATENCY_WRITE_IRP             5
+#define CH341_LATENCY_HISTOGRAMS            6
+
+/*
+ * Buckets are in microseconds with four per power of two. Buckets 0 to 3
+ * hold 0 to 3 us, after that bucket b covers
+ * [(4 + b % 4) << (b / 4 - 1), (5 + b % 4) << (b / 4 - 1)). The last bucket
+ * also takes everything beyond it.
+ */
+#define CH341_LATENCY_BUCKETS               96
+
+/* Output of IOCTL_CH341_GET_LATENCY */
+typedef struct _CH341_LATENCY {
+    ULONG Histograms;
+    ULONG Buckets;
+    ULONG Counts[CH341_LATENCY_HISTOGRAMS][CH341_LATENCY_BUCKETS];
+} CH341_LATENCY, *PCH341_LATENCY;
+
+/* Control lines */
+#define CH341_LINE_DTR                      0x1
+#define CH341_LINE_RTS                      0x2
+#define CH341_LINE_BREAK                    0x4
+
+/*
+ * Input of IOCTL_CH341_SET_CONTROL_LINES. The lines in Mask take their state
+ * from Lines, all in one request; DTR and RTS change in the same transfer.
+ */
+typedef struct _CH341_CONTROL_LINES {
+    ULONG Mask;
+    ULONG Lines;
+} CH341_CONTROL_LINES, *PCH341_CONTROL_LINES;
+
+#define CH341_MAX_BREAK_MICROSECONDS        1000000
+
+/*
+ * Input of IOCTL_CH341_SEND_BREAK: break, then mark for MarkMicroseconds.
+ * Data written while the request runs is held and goes out as soon as the
+ * mark after break is over, so a LIN or DMX512 frame can be written
+ * right behind the request without waiting for it. Until it completes,
+ * break changes through other requests fail with STATUS_DEVICE_BUSY.
+ */
+typedef struct _CH341_BREAK {
+    ULONG BreakMicroseconds;
+    ULONG MarkMicroseconds;
+} CH341_BREAK, *PCH341_BREAK;
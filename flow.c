@@ -0,0 +1,560 @@
+/*
+ * CH341 Driver flow control routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_FLOW
+#include "ch341.h"
+
+/*
+ * Flow control, following serial.sys:
+ *
+ * With SERIAL_AUTO_RECEIVE, XOFF is sent once no more than XoffLimit bytes
+ * of RxBuffer are free, and XON once the fill level is back at XonLimit or
+ * below. Unless SERIAL_XOFF_CONTINUE is set, our own transmitter holds
+ * while the peer is stopped. With SERIAL_RTS_HANDSHAKE or
+ * SERIAL_DTR_HANDSHAKE the same two limits drop and raise RTS or DTR. The
+ * gap between them is the hysteresis that keeps the control transfers
+ * down to one per crossing.
+ *
+ * With SERIAL_AUTO_TRANSMIT, XON and XOFF from the peer are removed from
+ * the received data and start or stop our transmitter. With the CTS, DSR
+ * or DCD handshake, the transmitter holds while the line is low, as
+ * decoded from the interrupt pipe. This costs no bus traffic at all.
+ *
+ * HandFlow and Chars are written with both LineStateMutex and RxLock held,
+ * so the receive path can use them under RxLock alone. Flow characters are
+ * queued for the write engine under RxLock, and sent by CH341FlowKick once
+ * the lock is dropped. Line changes need a control transfer, so
+ * CH341FlowKick hands them to a work item; DtrRts and the lines themselves
+ * are only changed under LineStateMutex.
+ *
+ * With ControlCoalesceDeadline set, the standard DTR and RTS requests only
+ * stage their change in DtrRtsStaged and complete. The staged lines go out
+ * in a single transfer once the deadline passes, through the same work
+ * item, or earlier with any other line change. IOCTL_CH341_SET_CONTROL_LINES
+ * never waits.
+ */
+
+#define CH341_FLOW_KICK_TX      0x1
+#define CH341_FLOW_KICK_LINES   0x2
+
+#define CH341_FLOW_WORK_IDLE    0
+#define CH341_FLOW_WORK_RUNNING 1
+#define CH341_FLOW_WORK_QUEUED  2
+
+/* CH341FlowSetLines takes both */
+C_ASSERT(CH341_LINE_DTR == SERIAL_DTR_STATE && CH341_LINE_RTS == SERIAL_RTS_STATE);
+
+#define CH341_FLOW_HANDSHAKE_HOLDS (SERIAL_TX_WAITING_FOR_CTS | \
+                                    SERIAL_TX_WAITING_FOR_DSR | \
+                                    SERIAL_TX_WAITING_FOR_DCD)
+
+static IO_WORKITEM_ROUTINE CH341FlowLinesWork;
+static EXT_CALLBACK CH341FlowControlDeadline;
+static EXT_CALLBACK CH341FlowDelayExpired;
+static VOID CH341FlowDelay(_In_ ULONG Microseconds);
+static USHORT CH341FlowDrivenLines(_In_ PDEVICE_EXTENSION DeviceExtension);
+static NTSTATUS CH341FlowApplyLines(_In_ PDEVICE_OBJECT DeviceObject,
+                                    _In_ USHORT Lines,
+                                    _In_ BOOLEAN Force);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341FlowAllocate)
+#pragma alloc_text(PAGE, CH341FlowFree)
+#pragma alloc_text(PAGE, CH341FlowLinesWork)
+#pragma alloc_text(PAGE, CH341FlowApplyLines)
+#pragma alloc_text(PAGE, CH341FlowSetLines)
+#pragma alloc_text(PAGE, CH341FlowDelay)
+#pragma alloc_text(PAGE, CH341FlowSendBreak)
+#endif /* defined ALLOC_PRAGMA */
+
+/* The handshake lines the receive path drives itself */
+static
+USHORT
+CH341FlowDrivenLines(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    USHORT Lines = 0;
+    if ((DeviceExtension->HandFlow.ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_HANDSHAKE)
+        Lines |= SERIAL_DTR_STATE;
+    if ((DeviceExtension->HandFlow.FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_HANDSHAKE)
+        Lines |= SERIAL_RTS_STATE;
+    return Lines;
+}
+
+_Requires_lock_held_(DeviceExtension->RxLock)
+VOID
+CH341FlowCheckReceive(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    ULONG Count;
+    ULONG Free;
+    LONG Kick = 0;
+    Count = CH341RingCount(&DeviceExtension->RxBuffer);
+    Free = DeviceExtension->RxBuffer.Size - Count;
+    if (DeviceExtension->HandFlow.FlowReplace & SERIAL_AUTO_RECEIVE) {
+        if (!DeviceExtension->RxXoffSent &&
+                Free <= (ULONG)DeviceExtension->HandFlow.XoffLimit) {
+            DeviceExtension->RxXoffSent = TRUE;
+            CH341WriteQueueFlowChar(DeviceExtension,
+                                    DeviceExtension->Chars.XoffChar,
+                                    DeviceExtension->HandFlow.FlowReplace & SERIAL_XOFF_CONTINUE ?
+                                    0 : SERIAL_TX_WAITING_XOFF_SENT,
+                                    0);
+            Kick |= CH341_FLOW_KICK_TX;
+        } else if (DeviceExtension->RxXoffSent &&
+                   Count <= (ULONG)DeviceExtension->HandFlow.XonLimit) {
+            DeviceExtension->RxXoffSent = FALSE;
+            CH341WriteQueueFlowChar(DeviceExtension,
+                                    DeviceExtension->Chars.XonChar,
+                                    0,
+                                    SERIAL_TX_WAITING_XOFF_SENT);
+            Kick |= CH341_FLOW_KICK_TX;
+        }
+    }
+    if (CH341FlowDrivenLines(DeviceExtension)) {
+        if (!DeviceExtension->RxLinesDropped &&
+                Free <= (ULONG)DeviceExtension->HandFlow.XoffLimit) {
+            DeviceExtension->RxLinesDropped = TRUE;
+            Kick |= CH341_FLOW_KICK_LINES;
+        } else if (DeviceExtension->RxLinesDropped &&
+                   Count <= (ULONG)DeviceExtension->HandFlow.XonLimit) {
+            DeviceExtension->RxLinesDropped = FALSE;
+            Kick |= CH341_FLOW_KICK_LINES;
+        }
+    }
+    if (Kick) {
+        CH341Verbose(       "%s. Flow change %lx at %lu bytes\n",
+                            __FUNCTION__, Kick, Count);
+        InterlockedOr(&DeviceExtension->RxFlowKick, Kick);
+    }
+}
+
+static
+VOID
+CH341FlowLinesWork(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_opt_ PVOID Context) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    NTSTATUS Status;
+    UNREFERENCED_PARAMETER(Context);
+    PAGED_CODE();
+    /* A kick while we run makes us go around once more */
+    do {
+        InterlockedExchange(&DeviceExtension->FlowWorkState, CH341_FLOW_WORK_RUNNING);
+        Status = CH341FlowSetLines(DeviceObject, 0, 0, FALSE);
+        if (!NT_SUCCESS(Status)) {
+            CH341Warn(         "%s. CH341FlowSetLines failed with %08lx\n",
+                               __FUNCTION__, Status);
+        }
+    } while (InterlockedCompareExchange(&DeviceExtension->FlowWorkState,
+                                        CH341_FLOW_WORK_IDLE,
+                                        CH341_FLOW_WORK_RUNNING) != CH341_FLOW_WORK_RUNNING);
+    KeSetEvent(&DeviceExtension->FlowWorkIdleEvent, IO_NO_INCREMENT, FALSE);
+}
+
+static
+VOID
+NTAPI
+CH341FlowControlDeadline(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context) {
+    PDEVICE_OBJECT DeviceObject = Context;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    UNREFERENCED_PARAMETER(Timer);
+    /* The work item sends the staged lines */
+    InterlockedOr(&DeviceExtension->RxFlowKick, CH341_FLOW_KICK_LINES);
+    CH341FlowKick(DeviceExtension);
+}
+
+NTSTATUS
+CH341FlowAllocate(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    NT_ASSERT(!DeviceExtension->FlowWorkItem);
+    DeviceExtension->FlowWorkItem = IoAllocateWorkItem(DeviceObject);
+    if (!DeviceExtension->FlowWorkItem) {
+        CH341Error(         "%s. Allocating work item failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    DeviceExtension->ControlTimer = ExAllocateTimer(CH341FlowControlDeadline,
+                                    DeviceObject,
+                                    EX_TIMER_HIGH_RESOLUTION);
+    if (!DeviceExtension->ControlTimer) {
+        CH341Error(         "%s. Allocating control line timer failed\n",
+                            __FUNCTION__);
+        IoFreeWorkItem(DeviceExtension->FlowWorkItem);
+        DeviceExtension->FlowWorkItem = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341FlowFree(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    if (!DeviceExtension->FlowWorkItem)
+        return;
+    /* The timer may queue the work item, which may still be on its way to the device */
+    (VOID)ExDeleteTimer(DeviceExtension->ControlTimer, TRUE, TRUE, NULL);
+    DeviceExtension->ControlTimer = NULL;
+    (VOID)KeWaitForSingleObject(&DeviceExtension->FlowWorkIdleEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+    IoFreeWorkItem(DeviceExtension->FlowWorkItem);
+    DeviceExtension->FlowWorkItem = NULL;
+}
+
+VOID
+CH341FlowKick(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    LONG Kick;
+    if (!DeviceExtension->RxFlowKick)
+        return;
+    Kick = InterlockedExchange(&DeviceExtension->RxFlowKick, 0);
+    if (Kick & CH341_FLOW_KICK_TX)
+        CH341WriteKick(DeviceExtension);
+    if (Kick & CH341_FLOW_KICK_LINES &&
+            InterlockedExchange(&DeviceExtension->FlowWorkState,
+                                CH341_FLOW_WORK_QUEUED) == CH341_FLOW_WORK_IDLE) {
+        KeClearEvent(&DeviceExtension->FlowWorkIdleEvent);
+        IoQueueWorkItem(DeviceExtension->FlowWorkItem,
+                        CH341FlowLinesWork,
+                        DelayedWorkQueue,
+                        NULL);
+    }
+}
+
+VOID
+CH341FlowUpdateHolds(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    ULONG ModemStatus = (ULONG)ReadNoFence(&DeviceExtension->ModemStatus);
+    ULONG ControlHandShake = DeviceExtension->HandFlow.ControlHandShake;
+    ULONG HoldSet = 0;
+    if (ControlHandShake & SERIAL_CTS_HANDSHAKE && !(ModemStatus & SERIAL_MSR_CTS))
+        HoldSet |= SERIAL_TX_WAITING_FOR_CTS;
+    if (ControlHandShake & SERIAL_DSR_HANDSHAKE && !(ModemStatus & SERIAL_MSR_DSR))
+        HoldSet |= SERIAL_TX_WAITING_FOR_DSR;
+    if (ControlHandShake & SERIAL_DCD_HANDSHAKE && !(ModemStatus & SERIAL_MSR_DCD))
+        HoldSet |= SERIAL_TX_WAITING_FOR_DCD;
+    if ((DeviceExtension->HoldReasons & CH341_FLOW_HANDSHAKE_HOLDS) == HoldSet)
+        return;
+    CH341Debug(         "%s. ModemStatus=0x%02lx, HoldSet=0x%lx\n",
+                        __FUNCTION__, ModemStatus, HoldSet);
+    CH341WriteSetHold(DeviceExtension, HoldSet, CH341_FLOW_HANDSHAKE_HOLDS & ~HoldSet);
+}
+
+/*
+ * Sends Lines to the device, with the handshake lines as the receive path
+ * wants them. The caller holds LineStateMutex.
+ */
+static
+NTSTATUS
+CH341FlowApplyLines(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ USHORT Lines,
+    _In_ BOOLEAN Force) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    USHORT Driven = CH341FlowDrivenLines(DeviceExtension);
+    NTSTATUS Status;
+    PAGED_CODE();
+    /* Anything staged is replaced */
+    DeviceExtension->DtrRtsPending = FALSE;
+    Lines = (Lines & ~Driven) | (DeviceExtension->RxLinesDropped ? 0 : Driven);
+    if (Lines == DeviceExtension->DtrRts && !Force)
+        return STATUS_SUCCESS;
+    Status = CH341UsbSetControlLines(DeviceObject, Lines);
+    if (NT_SUCCESS(Status))
+        DeviceExtension->DtrRts = Lines;
+    return Status;
+}
+
+/*
+ * Changes DTR, RTS and break, as CH341_LINE_* bits. Lines under handshake
+ * control belong to the receive path and cannot be changed here. DTR and
+ * RTS named in Set or Clear are always sent, together with anything staged
+ * before; otherwise the device is only asked if something moved. With
+ * Defer, a DTR or RTS change may be staged instead.
+ */
+NTSTATUS
+CH341FlowSetLines(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ USHORT Set,
+    _In_ USHORT Clear,
+    _In_ BOOLEAN Defer) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    USHORT Lines;
+    BOOLEAN Force;
+    PAGED_CODE();
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    if ((Set | Clear) & CH341FlowDrivenLines(DeviceExtension)) {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    if ((Set | Clear) & CH341_LINE_BREAK && DeviceExtension->BreakTimed) {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_DEVICE_BUSY;
+    }
+    Lines = DeviceExtension->DtrRtsPending ? DeviceExtension->DtrRtsStaged : DeviceExtension->DtrRts;
+    Lines = ((Lines & ~Clear) | Set) & (SERIAL_DTR_STATE | SERIAL_RTS_STATE);
+    if (Defer && DeviceExtension->ControlCoalesceDeadline &&
+            !((Set | Clear) & CH341_LINE_BREAK)) {
+        if (!DeviceExtension->DtrRtsPending) {
+            DeviceExtension->DtrRtsPending = TRUE;
+            (VOID)ExSetTimer(DeviceExtension->ControlTimer,
+                             -(LONGLONG)DeviceExtension->ControlCoalesceDeadline * 10,
+                             0,
+                             NULL);
+        }
+        DeviceExtension->DtrRtsStaged = Lines;
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_SUCCESS;
+    }
+    Force = DeviceExtension->DtrRtsPending ||
+            ((Set | Clear) & (SERIAL_DTR_STATE | SERIAL_RTS_STATE)) != 0;
+    Status = CH341FlowApplyLines(DeviceObject, Lines, Force);
+    if (NT_SUCCESS(Status) && (Set | Clear) & CH341_LINE_BREAK) {
+        Status = CH341UsbSetBreak(DeviceObject, (Set & CH341_LINE_BREAK) != 0);
+        /* Data sent during a break would be lost */
+        if (NT_SUCCESS(Status)) {
+            CH341WriteSetHold(DeviceExtension,
+                              DeviceExtension->BreakOn ? SERIAL_TX_WAITING_ON_BREAK : 0,
+                              DeviceExtension->BreakOn ? 0 : SERIAL_TX_WAITING_ON_BREAK);
+        }
+    }
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Status;
+}
+
+static
+VOID
+NTAPI
+CH341FlowDelayExpired(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context) {
+    UNREFERENCED_PARAMETER(Timer);
+    KeSetEvent(Context, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * Waits for at least Microseconds. Short waits spin; longer ones use a high
+ * resolution timer, which is far closer to the request than the system
+ * clock tick KeDelayExecutionThread works with.
+ */
+static
+VOID
+CH341FlowDelay(
+    _In_ ULONG Microseconds) {
+    KEVENT Event;
+    PEX_TIMER Timer;
+    LARGE_INTEGER Interval;
+    PAGED_CODE();
+    if (Microseconds <= CH341_MAX_BREAK_STALL) {
+        KeStallExecutionProcessor(Microseconds);
+        return;
+    }
+    Interval.QuadPart = -(LONGLONG)Microseconds * 10;
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+    Timer = ExAllocateTimer(CH341FlowDelayExpired, &Event, EX_TIMER_HIGH_RESOLUTION);
+    if (!Timer) {
+        CH341Warn(         "%s. Allocating delay timer failed, falling back to the clock tick\n",
+                           __FUNCTION__);
+        (VOID)KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+        return;
+    }
+    (VOID)ExSetTimer(Timer, Interval.QuadPart, 0, NULL);
+    (VOID)KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
+    /* Waiting for the callback is only allowed at PASSIVE_LEVEL; it has set Event already */
+    (VOID)ExDeleteTimer(Timer, TRUE, FALSE, NULL);
+}
+
+/*
+ * Holds break for BreakMicroseconds and mark for MarkMicroseconds, timed
+ * from the completion of the transfers that start them. The transmitter is
+ * held throughout, so a frame written meanwhile is submitted from here the
+ * moment the mark after break ends. LineStateMutex is dropped during both
+ * waits, so other line requests are not held up by them; BreakTimed keeps
+ * everyone else away from the break state meanwhile.
+ */
+NTSTATUS
+CH341FlowSendBreak(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG BreakMicroseconds,
+    _In_ ULONG MarkMicroseconds) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LARGE_INTEGER Start;
+    LARGE_INTEGER End;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, BreakMicroseconds=%lu, MarkMicroseconds=%lu\n",
+                        __FUNCTION__, DeviceObject,    BreakMicroseconds, MarkMicroseconds);
+    if (BreakMicroseconds > CH341_MAX_BREAK_MICROSECONDS ||
+            MarkMicroseconds > CH341_MAX_BREAK_MICROSECONDS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    if (DeviceExtension->BreakOn || DeviceExtension->BreakTimed) {
+        /* Held through IOCTL_SERIAL_SET_BREAK_ON, or by another timed break */
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    CH341WriteSetHold(DeviceExtension, SERIAL_TX_WAITING_ON_BREAK, 0);
+    Status = CH341UsbSetBreak(DeviceObject, TRUE);
+    if (NT_SUCCESS(Status)) {
+        DeviceExtension->BreakTimed = TRUE;
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        Start = KeQueryPerformanceCounter(NULL);
+        CH341FlowDelay(BreakMicroseconds);
+        ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+        Status = CH341UsbSetBreak(DeviceObject, FALSE);
+        End = KeQueryPerformanceCounter(NULL);
+        if (NT_SUCCESS(Status)) {
+            ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+            CH341FlowDelay(MarkMicroseconds);
+            ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+            CH341Debug(         "%s. Break held for %I64u us\n",
+                                __FUNCTION__, (ULONGLONG)(End.QuadPart - Start.QuadPart) * 1000000 /
+                                (ULONGLONG)DeviceExtension->PerformanceFrequency.QuadPart);
+        }
+        DeviceExtension->BreakTimed = FALSE;
+    }
+    if (NT_SUCCESS(Status) || !DeviceExtension->BreakOn)
+        CH341WriteSetHold(DeviceExtension, 0, SERIAL_TX_WAITING_ON_BREAK);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Status;
+}
+
+NTSTATUS
+CH341FlowSetHandFlow(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ const SERIAL_HANDFLOW *HandFlow) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG HoldClear = 0;
+    USHORT Lines = 0;
+    NTSTATUS Status;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, ControlHandShake=%lx, FlowReplace=%lx, XonLimit=%ld, XoffLimit=%ld\n",
+                        __FUNCTION__, DeviceObject,    HandFlow->ControlHandShake, HandFlow->FlowReplace,
+                        HandFlow->XonLimit, HandFlow->XoffLimit);
+    if (HandFlow->ControlHandShake & SERIAL_CONTROL_INVALID ||
+            HandFlow->FlowReplace & SERIAL_FLOW_INVALID ||
+            (HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_MASK ||
+            (HandFlow->FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_MASK ||
+            HandFlow->XonLimit < 0 ||
+            HandFlow->XoffLimit < 0 ||
+            (ULONG)HandFlow->XonLimit > DeviceExtension->RxBuffer.Size ||
+            (ULONG)HandFlow->XoffLimit > DeviceExtension->RxBuffer.Size) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    if (HandFlow->FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE) &&
+            DeviceExtension->Chars.XonChar == DeviceExtension->Chars.XoffChar) {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    DeviceExtension->HandFlow = *HandFlow;
+    if (!(HandFlow->FlowReplace & SERIAL_AUTO_RECEIVE) && DeviceExtension->RxXoffSent) {
+        /* The peer would wait for an XON forever */
+        DeviceExtension->RxXoffSent = FALSE;
+        CH341WriteQueueFlowChar(DeviceExtension,
+                                DeviceExtension->Chars.XonChar,
+                                0,
+                                SERIAL_TX_WAITING_XOFF_SENT);
+        InterlockedOr(&DeviceExtension->RxFlowKick, CH341_FLOW_KICK_TX);
+    }
+    if (!CH341FlowDrivenLines(DeviceExtension))
+        DeviceExtension->RxLinesDropped = FALSE;
+    /* The new limits may already be crossed */
+    CH341FlowCheckReceive(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    /* The handshake lines are filled in from RxLinesDropped */
+    if ((HandFlow->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_CONTROL)
+        Lines |= SERIAL_DTR_STATE;
+    if ((HandFlow->FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_CONTROL)
+        Lines |= SERIAL_RTS_STATE;
+    Status = CH341FlowApplyLines(DeviceObject, Lines, FALSE);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    if (!NT_SUCCESS(Status)) {
+        CH341Warn(         "%s. CH341FlowApplyLines failed with %08lx\n",
+                           __FUNCTION__, Status);
+    }
+    CH341FlowUpdateHolds(DeviceExtension);
+    if (!(HandFlow->FlowReplace & SERIAL_AUTO_TRANSMIT))
+        HoldClear |= SERIAL_TX_WAITING_FOR_XON;
+    if (HandFlow->FlowReplace & SERIAL_XOFF_CONTINUE)
+        HoldClear |= SERIAL_TX_WAITING_XOFF_SENT;
+    if (HoldClear)
+        CH341WriteSetHold(DeviceExtension, 0, HoldClear);
+    CH341FlowKick(DeviceExtension);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+CH341FlowSetChars(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ const SERIAL_CHARS *Chars) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, XonChar=%02x, XoffChar=%02x\n",
+                        __FUNCTION__, DeviceObject,    Chars->XonChar, Chars->XoffChar);
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    if (DeviceExtension->HandFlow.FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE) &&
+            (Chars->XonChar == Chars->XoffChar ||
+             (DeviceExtension->EscapeChar &&
+              (Chars->XonChar == DeviceExtension->EscapeChar ||
+               Chars->XoffChar == DeviceExtension->EscapeChar)))) {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    DeviceExtension->Chars = *Chars;
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return STATUS_SUCCESS;
+}
+
+/* Zero turns LSR/MST insertion off */
+NTSTATUS
+CH341FlowSetEscapeChar(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR EscapeChar) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, EscapeChar=%02x\n",
+                        __FUNCTION__, DeviceObject,    EscapeChar);
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    /* Flow control would swallow the escape character */
+    if (EscapeChar &&
+            DeviceExtension->HandFlow.FlowReplace & (SERIAL_AUTO_TRANSMIT | SERIAL_AUTO_RECEIVE) &&
+            (EscapeChar == DeviceExtension->Chars.XonChar ||
+             EscapeChar == DeviceExtension->Chars.XoffChar)) {
+        ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+        return STATUS_INVALID_PARAMETER;
+    }
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    DeviceExtension->EscapeChar = EscapeChar;
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return STATUS_SUCCESS;
+}
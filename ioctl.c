@@ -17,34 +17,70 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_IOCTL
 #include "ch341.h"
 
 static NTSTATUS CH341GetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
 static NTSTATUS CH341SetBaudRate(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
 static NTSTATUS CH341GetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
 static NTSTATUS CH341SetLineControl(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetTimeouts(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341SetTimeouts(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetModemStatus(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetTrace(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetStats(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetExtendedStats(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetLatency(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341SetControlLines(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341SendBreak(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341SetQueueSize(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetProperties(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341GetCommStatus(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341Purge(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341IoctlGetWaitMask(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+static NTSTATUS CH341IoctlSetWaitMask(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, CH341GetBaudRate)
 #pragma alloc_text(PAGE, CH341SetBaudRate)
 #pragma alloc_text(PAGE, CH341GetLineControl)
 #pragma alloc_text(PAGE, CH341SetLineControl)
+#pragma alloc_text(PAGE, CH341GetTimeouts)
+#pragma alloc_text(PAGE, CH341SetTimeouts)
+#pragma alloc_text(PAGE, CH341GetModemStatus)
+#pragma alloc_text(PAGE, CH341GetTrace)
+#pragma alloc_text(PAGE, CH341GetStats)
+#pragma alloc_text(PAGE, CH341GetExtendedStats)
+#pragma alloc_text(PAGE, CH341GetLatency)
+#pragma alloc_text(PAGE, CH341SetControlLines)
+#pragma alloc_text(PAGE, CH341SendBreak)
+#pragma alloc_text(PAGE, CH341SetQueueSize)
+#pragma alloc_text(PAGE, CH341GetProperties)
+#pragma alloc_text(PAGE, CH341GetCommStatus)
+#pragma alloc_text(PAGE, CH341Purge)
+#pragma alloc_text(PAGE, CH341IoctlGetWaitMask)
+#pragma alloc_text(PAGE, CH341IoctlSetWaitMask)
 #pragma alloc_text(PAGE, CH341DispatchDeviceControl)
 #endif /* defined ALLOC_PRAGMA */
 
 NTSTATUS
 CH341SetLine(
     _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status;
     PDEVICE_EXTENSION DeviceExtension;
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p\n",
                         __FUNCTION__, DeviceObject);
     DeviceExtension = DeviceObject->DeviceExtension;
-    return CH341UsbSetLine(DeviceObject,
-                           DeviceExtension->BaudRate,
-                           DeviceExtension->StopBits,
-                           DeviceExtension->Parity,
-                           DeviceExtension->DataBits);
+    /* Also guards the register cache in CH341UsbSetLine */
+    ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
+    Status = CH341UsbSetLine(DeviceObject,
+                             DeviceExtension->BaudRate,
+                             DeviceExtension->StopBits,
+                             DeviceExtension->Parity,
+                             DeviceExtension->DataBits);
+    ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
+    return Status;
 }
 
 static
@@ -79,6 +115,7 @@ CH341SetBaudRate(
     PIO_STACK_LOCATION IoStack;
     PDEVICE_EXTENSION DeviceExtension;
     const SERIAL_BAUD_RATE *BaudRate;
+    BAUD_DIVISOR Divisor;
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
                         __FUNCTION__, DeviceObject,    Irp);
@@ -88,6 +125,9 @@ CH341SetBaudRate(
         return STATUS_BUFFER_TOO_SMALL;
     }
     BaudRate = Irp->AssociatedIrp.SystemBuffer;
+    if (!NT_SUCCESS(CH341ComputeBaudDivisor(BaudRate->BaudRate, &Divisor))) {
+        return STATUS_INVALID_PARAMETER;
+    }
     ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
     DeviceExtension->BaudRate = BaudRate->BaudRate;
     ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
@@ -145,6 +185,383 @@ CH341SetLineControl(
     return CH341SetLine(DeviceObject);
 }
 
+static
+NTSTATUS
+CH341GetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PSERIAL_TIMEOUTS Timeouts;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Timeouts)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Timeouts = Irp->AssociatedIrp.SystemBuffer;
+    CH341ReadGetTimeouts(DeviceObject, Timeouts);
+    Irp->IoStatus.Information = sizeof(*Timeouts);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341SetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    const SERIAL_TIMEOUTS *Timeouts;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*Timeouts)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Timeouts = Irp->AssociatedIrp.SystemBuffer;
+    /* Same as serial.sys: "return on any" with an infinite timeout is meaningless */
+    if (Timeouts->ReadIntervalTimeout == MAXULONG &&
+            Timeouts->ReadTotalTimeoutMultiplier == MAXULONG &&
+            Timeouts->ReadTotalTimeoutConstant == MAXULONG) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    CH341Debug(         "%s. Interval=%lu, Multiplier=%lu, Constant=%lu\n",
+                        __FUNCTION__, Timeouts->ReadIntervalTimeout,
+                        Timeouts->ReadTotalTimeoutMultiplier, Timeouts->ReadTotalTimeoutConstant);
+    CH341ReadSetTimeouts(DeviceObject, Timeouts);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    /* Kept current by the interrupt pipe, no need to ask the device */
+    *(PULONG)Irp->AssociatedIrp.SystemBuffer = (ULONG)DeviceExtension->ModemStatus;
+    Irp->IoStatus.Information = sizeof(ULONG);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetTrace(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    return CH341TraceExport(DeviceObject,
+                            Irp->AssociatedIrp.SystemBuffer,
+                            IoStack->Parameters.DeviceIoControl.OutputBufferLength,
+                            &Irp->IoStatus.Information);
+}
+
+static
+NTSTATUS
+CH341GetStats(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PSERIALPERF_STATS PerfStats;
+    CH341_STATS Stats;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*PerfStats)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    CH341StatsQuery(DeviceObject, &Stats);
+    PerfStats = Irp->AssociatedIrp.SystemBuffer;
+    PerfStats->ReceivedCount = (ULONG)Stats.BytesReceived;
+    PerfStats->TransmittedCount = (ULONG)Stats.BytesTransmitted;
+    /* The CH341 does not report line errors */
+    PerfStats->FrameErrorCount = 0;
+    PerfStats->SerialOverrunErrorCount = 0;
+    PerfStats->BufferOverrunErrorCount = (ULONG)Stats.BufferOverruns;
+    PerfStats->ParityErrorCount = 0;
+    Irp->IoStatus.Information = sizeof(*PerfStats);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetExtendedStats(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(CH341_STATS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    CH341StatsQuery(DeviceObject, Irp->AssociatedIrp.SystemBuffer);
+    Irp->IoStatus.Information = sizeof(CH341_STATS);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetLatency(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(CH341_LATENCY)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    CH341LatencyQuery(DeviceObject, Irp->AssociatedIrp.SystemBuffer);
+    Irp->IoStatus.Information = sizeof(CH341_LATENCY);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341SetControlLines(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PCH341_CONTROL_LINES Control;
+    PAGED_CODE();
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(CH341_CONTROL_LINES)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Control = Irp->AssociatedIrp.SystemBuffer;
+    CH341Debug(         "%s. DeviceObject=%p, Mask=%lx, Lines=%lx\n",
+                        __FUNCTION__, DeviceObject,    Control->Mask, Control->Lines);
+    if (Control->Mask & ~(CH341_LINE_DTR | CH341_LINE_RTS | CH341_LINE_BREAK)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return CH341FlowSetLines(DeviceObject,
+                             (USHORT)(Control->Mask & Control->Lines),
+                             (USHORT)(Control->Mask & ~Control->Lines),
+                             FALSE);
+}
+
+static
+NTSTATUS
+CH341SendBreak(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PCH341_BREAK Break;
+    PAGED_CODE();
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(CH341_BREAK)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Break = Irp->AssociatedIrp.SystemBuffer;
+    return CH341FlowSendBreak(DeviceObject, Break->BreakMicroseconds, Break->MarkMicroseconds);
+}
+
+static
+NTSTATUS
+CH341SetQueueSize(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    NTSTATUS Status;
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_QUEUE_SIZE QueueSize;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*QueueSize)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    QueueSize = Irp->AssociatedIrp.SystemBuffer;
+    if (QueueSize->OutSize > CH341_MAX_TX_QUEUE_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    Status = CH341ReadSetQueueSize(DeviceObject, QueueSize->InSize);
+    if (!NT_SUCCESS(Status))
+        return Status;
+    /* Writes are queued as IRPs, so this only bounds what is reported */
+    DeviceExtension->TxQueueSize = max(QueueSize->OutSize, CH341_TX_BUFFER_SIZE);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetProperties(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_COMMPROP Properties;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*Properties)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Properties = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(Properties, sizeof(*Properties));
+    Properties->PacketLength = sizeof(*Properties);
+    Properties->PacketVersion = 2;
+    Properties->ServiceMask = SERIAL_SP_SERIALCOMM;
+    Properties->MaxTxQueue = CH341_MAX_TX_QUEUE_SIZE;
+    Properties->MaxRxQueue = CH341_MAX_RX_BUFFER_SIZE;
+    Properties->MaxBaud = SERIAL_BAUD_USER;
+    Properties->ProvSubType = SERIAL_SP_RS232;
+    Properties->ProvCapabilities = SERIAL_PCF_DTRDSR |
+                                   SERIAL_PCF_RTSCTS |
+                                   SERIAL_PCF_CD |
+                                   SERIAL_PCF_XONXOFF |
+                                   SERIAL_PCF_SETXCHAR |
+                                   SERIAL_PCF_SPECIALCHARS |
+                                   SERIAL_PCF_TOTALTIMEOUTS |
+                                   SERIAL_PCF_INTTIMEOUTS;
+    Properties->SettableParams = SERIAL_SP_PARITY |
+                                 SERIAL_SP_BAUD |
+                                 SERIAL_SP_DATABITS |
+                                 SERIAL_SP_STOPBITS |
+                                 SERIAL_SP_HANDSHAKING;
+    Properties->SettableBaud = SERIAL_BAUD_075 | SERIAL_BAUD_110 | SERIAL_BAUD_150 |
+                               SERIAL_BAUD_300 | SERIAL_BAUD_600 | SERIAL_BAUD_1200 |
+                               SERIAL_BAUD_1800 | SERIAL_BAUD_2400 | SERIAL_BAUD_4800 |
+                               SERIAL_BAUD_7200 | SERIAL_BAUD_9600 | SERIAL_BAUD_14400 |
+                               SERIAL_BAUD_19200 | SERIAL_BAUD_38400 | SERIAL_BAUD_57600 |
+                               SERIAL_BAUD_115200 | SERIAL_BAUD_128K | SERIAL_BAUD_USER;
+    Properties->SettableData = SERIAL_DATABITS_5 |
+                               SERIAL_DATABITS_6 |
+                               SERIAL_DATABITS_7 |
+                               SERIAL_DATABITS_8;
+    Properties->SettableStopParity = SERIAL_STOPBITS_10 |
+                                     SERIAL_STOPBITS_20 |
+                                     SERIAL_PARITY_NONE |
+                                     SERIAL_PARITY_ODD |
+                                     SERIAL_PARITY_EVEN |
+                                     SERIAL_PARITY_MARK |
+                                     SERIAL_PARITY_SPACE;
+    Properties->CurrentTxQueue = DeviceExtension->TxQueueSize;
+    Properties->CurrentRxQueue = DeviceExtension->RxBuffer.Size;
+    Irp->IoStatus.Information = sizeof(*Properties);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341GetCommStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PDEVICE_EXTENSION DeviceExtension;
+    PSERIAL_STATUS SerialStatus;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    DeviceExtension = DeviceObject->DeviceExtension;
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*SerialStatus)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    SerialStatus = Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(SerialStatus, sizeof(*SerialStatus));
+    /*
+     * Libraries poll this in a tight loop, so it is answered from counters
+     * the data paths keep current, without locks or USB traffic. Errors are
+     * reported once, as serial.sys does.
+     */
+    SerialStatus->Errors = (ULONG)InterlockedExchange(&DeviceExtension->CommErrors, 0);
+    SerialStatus->AmountInInQueue = (ULONG)ReadNoFence(&DeviceExtension->RxQueuedBytes);
+    /* Bytes handed to bulk OUT transfers are still on their way out */
+    SerialStatus->AmountInOutQueue = DeviceExtension->TxQueuedBytes +
+                                     DeviceExtension->TxInFlightBytes;
+    SerialStatus->HoldReasons = DeviceExtension->HoldReasons;
+    Irp->IoStatus.Information = sizeof(*SerialStatus);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341Purge(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    ULONG Mask;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    Mask = *(PULONG)Irp->AssociatedIrp.SystemBuffer;
+    if (!Mask || Mask & ~(SERIAL_PURGE_TXABORT |
+                          SERIAL_PURGE_RXABORT |
+                          SERIAL_PURGE_TXCLEAR |
+                          SERIAL_PURGE_RXCLEAR)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (Mask & SERIAL_PURGE_TXABORT)
+        CH341WritePurge(DeviceObject);
+    if (Mask & SERIAL_PURGE_RXABORT)
+        CH341CancelPendingReads(DeviceObject, STATUS_CANCELLED);
+    /* Write data only ever lives in its IRP, so TXCLEAR has nothing to drop */
+    if (Mask & SERIAL_PURGE_RXCLEAR)
+        CH341ReadPurge(DeviceObject);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341IoctlGetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    *(PULONG)Irp->AssociatedIrp.SystemBuffer = CH341GetWaitMask(DeviceObject);
+    Irp->IoStatus.Information = sizeof(ULONG);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+CH341IoctlSetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp) {
+    PIO_STACK_LOCATION IoStack;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(ULONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    return CH341SetWaitMask(DeviceObject, *(PULONG)Irp->AssociatedIrp.SystemBuffer);
+}
+
 static
 NTSTATUS
 CH341GetChars(
@@ -165,7 +582,7 @@ CH341GetChars(
     ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
     RtlCopyMemory(Chars,
                   &DeviceExtension->Chars,
-                  sizeof(Chars));
+                  sizeof(*Chars));
     ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
     Irp->IoStatus.Information = sizeof(*Chars);
     return STATUS_SUCCESS;
@@ -191,7 +608,7 @@ CH341GetHandFlow(
     ExAcquireFastMutex(&DeviceExtension->LineStateMutex);
     RtlCopyMemory(HandFlow,
                   &DeviceExtension->HandFlow,
-                  sizeof(HandFlow));
+                  sizeof(*HandFlow));
     ExReleaseFastMutex(&DeviceExtension->LineStateMutex);
     Irp->IoStatus.Information = sizeof(*HandFlow);
     return STATUS_SUCCESS;
@@ -319,6 +736,12 @@ CH341DispatchDeviceControl(
     case IOCTL_SERIAL_SET_LINE_CONTROL:
         Status = CH341SetLineControl(DeviceObject, Irp);
         break;
+    case IOCTL_SERIAL_GET_TIMEOUTS:
+        Status = CH341GetTimeouts(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_SET_TIMEOUTS:
+        Status = CH341SetTimeouts(DeviceObject, Irp);
+        break;
     case IOCTL_SERIAL_GET_CHARS:
         Status = CH341GetChars(DeviceObject, Irp);
         break;
@@ -326,11 +749,8 @@ CH341DispatchDeviceControl(
         if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SERIAL_CHARS)) {
             Status = STATUS_BUFFER_TOO_SMALL;
         } else {
-            RtlCopyMemory(&DeviceExtension->Chars,
-                          Irp->AssociatedIrp.SystemBuffer,
-                          sizeof(SERIAL_CHARS));
+            Status = CH341FlowSetChars(DeviceObject, Irp->AssociatedIrp.SystemBuffer);
         }
-        Status = STATUS_SUCCESS;
         break;
     case IOCTL_SERIAL_GET_HANDFLOW:
         Status = CH341GetHandFlow(DeviceObject, Irp);
@@ -339,35 +759,102 @@ CH341DispatchDeviceControl(
         if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SERIAL_HANDFLOW)) {
             Status = STATUS_BUFFER_TOO_SMALL;
         } else {
-            RtlCopyMemory(&DeviceExtension->HandFlow,
-                          Irp->AssociatedIrp.SystemBuffer,
-                          sizeof(SERIAL_HANDFLOW));
+            Status = CH341FlowSetHandFlow(DeviceObject, Irp->AssociatedIrp.SystemBuffer);
         }
+        break;
+    case IOCTL_SERIAL_SET_XOFF:
+        /* As if the peer had sent XOFF */
+        CH341WriteSetHold(DeviceExtension, SERIAL_TX_WAITING_FOR_XON, 0);
         Status = STATUS_SUCCESS;
         break;
+    case IOCTL_SERIAL_SET_XON:
+        CH341WriteSetHold(DeviceExtension, 0, SERIAL_TX_WAITING_FOR_XON);
+        Status = STATUS_SUCCESS;
+        break;
+    case IOCTL_SERIAL_LSRMST_INSERT:
+        if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(UCHAR)) {
+            Status = STATUS_BUFFER_TOO_SMALL;
+        } else {
+            Status = CH341FlowSetEscapeChar(DeviceObject, *(PUCHAR)Irp->AssociatedIrp.SystemBuffer);
+        }
+        break;
+    case IOCTL_SERIAL_IMMEDIATE_CHAR:
+        if (IoStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(UCHAR)) {
+            Status = STATUS_BUFFER_TOO_SMALL;
+        } else {
+            Status = CH341WriteImmediateChar(DeviceObject, *(PUCHAR)Irp->AssociatedIrp.SystemBuffer);
+        }
+        break;
     case IOCTL_SERIAL_CLR_DTR:
-        DeviceExtension->DtrRts &= ~SERIAL_DTR_STATE;
-        Status = CH341UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
+        Status = CH341FlowSetLines(DeviceObject, 0, SERIAL_DTR_STATE, TRUE);
         break;
     case IOCTL_SERIAL_SET_DTR:
-        DeviceExtension->DtrRts |= SERIAL_DTR_STATE;
-        Status = CH341UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
+        Status = CH341FlowSetLines(DeviceObject, SERIAL_DTR_STATE, 0, TRUE);
         break;
     case IOCTL_SERIAL_CLR_RTS:
-        DeviceExtension->DtrRts &= ~SERIAL_RTS_STATE;
-        Status = CH341UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
+        Status = CH341FlowSetLines(DeviceObject, 0, SERIAL_RTS_STATE, TRUE);
         break;
     case IOCTL_SERIAL_SET_RTS:
-        DeviceExtension->DtrRts |= SERIAL_RTS_STATE;
-        Status = CH341UsbSetControlLines(DeviceObject, DeviceExtension->DtrRts);
+        Status = CH341FlowSetLines(DeviceObject, SERIAL_RTS_STATE, 0, TRUE);
+        break;
+    case IOCTL_SERIAL_SET_BREAK_ON:
+        Status = CH341FlowSetLines(DeviceObject, CH341_LINE_BREAK, 0, FALSE);
+        break;
+    case IOCTL_SERIAL_SET_BREAK_OFF:
+        Status = CH341FlowSetLines(DeviceObject, 0, CH341_LINE_BREAK, FALSE);
+        break;
+    case IOCTL_SERIAL_GET_MODEMSTATUS:
+        Status = CH341GetModemStatus(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_GET_WAIT_MASK:
+        Status = CH341IoctlGetWaitMask(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_SET_WAIT_MASK:
+        Status = CH341IoctlSetWaitMask(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_SET_QUEUE_SIZE:
+        Status = CH341SetQueueSize(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_GET_PROPERTIES:
+        Status = CH341GetProperties(DeviceObject, Irp);
         break;
+    case IOCTL_SERIAL_GET_COMMSTATUS:
+        Status = CH341GetCommStatus(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_PURGE:
+        Status = CH341Purge(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_GET_STATS:
+        Status = CH341GetStats(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_CLEAR_STATS:
+        CH341StatsClear(DeviceObject);
+        Status = STATUS_SUCCESS;
+        break;
+    case IOCTL_CH341_GET_STATS:
+        Status = CH341GetExtendedStats(DeviceObject, Irp);
+        break;
+    case IOCTL_CH341_GET_LATENCY:
+        Status = CH341GetLatency(DeviceObject, Irp);
+        break;
+    case IOCTL_CH341_SEND_BREAK:
+        Status = CH341SendBreak(DeviceObject, Irp);
+        break;
+    case IOCTL_CH341_SET_CONTROL_LINES:
+        Status = CH341SetControlLines(DeviceObject, Irp);
+        break;
+    case IOCTL_CH341_GET_TRACE:
+        Status = CH341GetTrace(DeviceObject, Irp);
+        break;
+    case IOCTL_SERIAL_WAIT_ON_MASK:
+        /* Completes or pends the IRP itself */
+        return CH341WaitOnMask(DeviceObject, Irp);
     case IOCTL_SERIAL_GET_DTRRTS:
         if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG)) {
             Status = STATUS_BUFFER_TOO_SMALL;
         } else {
             *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->DtrRts;
         }
-    case IOCTL_SERIAL_CLEAR_STATS:
     default:
         CH341Debug(         "%s. DeviceControl %x, code %s (%08lx)\n",
                             __FUNCTION__, IoStack->MajorFunction, SerialGetIoctlName(IoControlCode), IoControlCode);
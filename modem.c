@@ -0,0 +1,90 @@
+/*
+ * CH341 Driver modem status decoding
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef CH341_USER_MODE
+#include "modem.h"
+#else
+#include "ch341.h"
+#endif
+
+/*
+ * The CH341 sends a status packet on the interrupt IN pipe on every modem
+ * line change; its third byte carries the inverted CTS/DSR/RI/DCD bits.
+ * These routines turn packets into SERIAL_MSR_* lines and line changes
+ * into events, without touching the device extension, so that
+ * tools/ch341modem.c can replay recorded packets through them.
+ */
+
+ULONG
+CH341DecodeModemStatus(
+    _In_ UCHAR Lines) {
+    ULONG ModemStatus = 0;
+    if (Lines & CH341_STATUS_CTS)
+        ModemStatus |= SERIAL_MSR_CTS;
+    if (Lines & CH341_STATUS_DSR)
+        ModemStatus |= SERIAL_MSR_DSR;
+    if (Lines & CH341_STATUS_RI)
+        ModemStatus |= SERIAL_MSR_RI;
+    if (Lines & CH341_STATUS_DCD)
+        ModemStatus |= SERIAL_MSR_DCD;
+    return ModemStatus;
+}
+
+/* Returns FALSE for packets too short to carry the lines */
+BOOLEAN
+CH341DecodeStatusPacket(
+    _In_reads_bytes_(Length) const UCHAR *Packet,
+    _In_ ULONG Length,
+    _Out_ PULONG ModemStatus) {
+    *ModemStatus = 0;
+    if (Length < CH341_STATUS_PACKET_MIN)
+        return FALSE;
+    *ModemStatus = CH341DecodeModemStatus(~Packet[2] & CH341_STATUS_MASK);
+    return TRUE;
+}
+
+ULONG
+CH341ModemStatusEvents(
+    _In_ ULONG Old,
+    _In_ ULONG New) {
+    ULONG Changed = Old ^ New;
+    ULONG Events = 0;
+    if (Changed & SERIAL_MSR_CTS)
+        Events |= SERIAL_EV_CTS;
+    if (Changed & SERIAL_MSR_DSR)
+        Events |= SERIAL_EV_DSR;
+    if (Changed & SERIAL_MSR_DCD)
+        Events |= SERIAL_EV_RLSD;
+    if (Changed & SERIAL_MSR_RI)
+        Events |= SERIAL_EV_RING;
+    return Events;
+}
+
+/* The lines with their delta bits, as inserted into the receive data */
+UCHAR
+CH341ModemStatusRegister(
+    _In_ ULONG Old,
+    _In_ ULONG New) {
+    ULONG Delta;
+    /* The delta bits sit four below the lines; TERI is the trailing edge only */
+    Delta = (Old ^ New) >> 4;
+    if (New & SERIAL_MSR_RI)
+        Delta &= ~SERIAL_MSR_TERI;
+    return (UCHAR)(New | Delta);
+}
@@ -0,0 +1,54 @@
+/*
+ * CH341 Driver modem status declarations
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Kept apart from ch341.h so that tools/ch341modem.c can build modem.c in
+ * user mode.
+ */
+
+#pragma once
+
+#define CH341_STATUS_PACKET_SIZE        8
+#define CH341_STATUS_PACKET_MIN         4
+#define CH341_STATUS_CTS                0x01
+#define CH341_STATUS_DSR                0x02
+#define CH341_STATUS_RI                 0x04
+#define CH341_STATUS_DCD                0x08
+#define CH341_STATUS_MASK               0x0f
+
+/* Modem status register bits, as returned by IOCTL_SERIAL_GET_MODEMSTATUS */
+#ifndef SERIAL_MSR_CTS
+#define SERIAL_MSR_DCTS                 0x01
+#define SERIAL_MSR_DDSR                 0x02
+#define SERIAL_MSR_TERI                 0x04
+#define SERIAL_MSR_DDCD                 0x08
+#define SERIAL_MSR_CTS                  0x10
+#define SERIAL_MSR_DSR                  0x20
+#define SERIAL_MSR_RI                   0x40
+#define SERIAL_MSR_DCD                  0x80
+#endif
+
+ULONG CH341DecodeModemStatus(_In_ UCHAR Lines);
+BOOLEAN CH341DecodeStatusPacket(_In_reads_bytes_(Length) const UCHAR *Packet,
+                                _In_ ULONG Length,
+                                _Out_ PULONG ModemStatus);
+ULONG CH341ModemStatusEvents(_In_ ULONG Old,
+                             _In_ ULONG New);
+UCHAR CH341ModemStatusRegister(_In_ ULONG Old,
+                               _In_ ULONG New);
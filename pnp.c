@@ -17,8 +17,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_PNP
 #include "ch341.h"
 
+static ULONG CH341GetRegistryParameter(_In_ HANDLE KeyHandle,
+                                       _In_ PCWSTR Name,
+                                       _In_ ULONG DefaultValue);
 static NTSTATUS CH341InitializeDevice(_In_ PDEVICE_OBJECT DeviceObject,
                                       _In_ PDEVICE_OBJECT PhysicalDeviceObject);
 static NTSTATUS CH341DestroyDevice(_In_ PDEVICE_OBJECT DeviceObject);
@@ -26,6 +30,7 @@ static NTSTATUS CH341StartDevice(_In_ PDEVICE_OBJECT DeviceObject);
 static NTSTATUS CH341StopDevice(_In_ PDEVICE_OBJECT DeviceObject);
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341GetRegistryParameter)
 #pragma alloc_text(PAGE, CH341InitializeDevice)
 #pragma alloc_text(PAGE, CH341DestroyDevice)
 #pragma alloc_text(PAGE, CH341StartDevice)
@@ -34,6 +39,37 @@ static NTSTATUS CH341StopDevice(_In_ PDEVICE_OBJECT DeviceObject);
 #pragma alloc_text(PAGE, CH341DispatchPnp)
 #endif /* defined ALLOC_PRAGMA */
 
+static
+ULONG
+CH341GetRegistryParameter(
+    _In_ HANDLE KeyHandle,
+    _In_ PCWSTR Name,
+    _In_ ULONG DefaultValue) {
+    NTSTATUS Status;
+    UNICODE_STRING ValueName;
+    union {
+        KEY_VALUE_PARTIAL_INFORMATION Information;
+        UCHAR Buffer[FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data[sizeof(ULONG)])];
+    } Value;
+    ULONG ValueLength;
+    PAGED_CODE();
+    RtlInitUnicodeString(&ValueName, Name);
+    Status = ZwQueryValueKey(KeyHandle,
+                             &ValueName,
+                             KeyValuePartialInformation,
+                             &Value,
+                             sizeof(Value),
+                             &ValueLength);
+    if (!NT_SUCCESS(Status) ||
+            Value.Information.Type != REG_DWORD ||
+            Value.Information.DataLength != sizeof(ULONG)) {
+        return DefaultValue;
+    }
+    CH341Debug(         "%s. %ws=%lu\n",
+                        __FUNCTION__, Name, *(const ULONG *)Value.Information.Data);
+    return *(const ULONG *)Value.Information.Data;
+}
+
 static
 NTSTATUS
 CH341InitializeDevice(
@@ -46,6 +82,9 @@ CH341InitializeDevice(
     PKEY_VALUE_PARTIAL_INFORMATION ValueInformation;
     ULONG ValueInformationLength;
     ULONG SkipExternalNaming;
+    ULONG TraceRingSize;
+    ULONG TraceLevel;
+    ULONG TraceFlags;
     USHORT ComPortNameLength;
     PWCHAR ComPortNameBuffer = NULL;
     const UNICODE_STRING DosDevices = RTL_CONSTANT_STRING(L"\\DosDevices\\");
@@ -54,6 +93,27 @@ CH341InitializeDevice(
     CH341Debug(         "%s. DeviceObject=%p, PhysicalDeviceObject=%p\n",
                         __FUNCTION__, DeviceObject,    PhysicalDeviceObject);
     ExInitializeFastMutex(&DeviceExtension->LineStateMutex);
+    KeInitializeSpinLock(&DeviceExtension->RxLock);
+    KeInitializeEvent(&DeviceExtension->ReadPumpIdleEvent, NotificationEvent, TRUE);
+    ExInitializeFastMutex(&DeviceExtension->ReadPumpMutex);
+    KeInitializeEvent(&DeviceExtension->FlowWorkIdleEvent, NotificationEvent, TRUE);
+    KeInitializeEvent(&DeviceExtension->ControlEvent, NotificationEvent, FALSE);
+    ExInitializeFastMutex(&DeviceExtension->ControlMutex);
+    KeInitializeSpinLock(&DeviceExtension->TxLock);
+    InitializeListHead(&DeviceExtension->TxQueue);
+    InitializeListHead(&DeviceExtension->TxFlushList);
+    InitializeListHead(&DeviceExtension->TxFreeList);
+    InitializeListHead(&DeviceExtension->TxInFlightList);
+    KeInitializeEvent(&DeviceExtension->TxIdleEvent, NotificationEvent, TRUE);
+    DeviceExtension->TxQueueSize = CH341_TX_BUFFER_SIZE;
+    KeInitializeEvent(&DeviceExtension->StatusIdleEvent, NotificationEvent, TRUE);
+    KeInitializeSpinLock(&DeviceExtension->EventLock);
+    Status = CH341InitializeQueue(&DeviceExtension->ReadQueue);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341InitializeQueue failed with %08lx\n",
+                            __FUNCTION__, Status);
+        return Status;
+    }
     Status = IoRegisterDeviceInterface(PhysicalDeviceObject,
                                        &GUID_DEVINTERFACE_COMPORT,
                                        NULL,
@@ -100,6 +160,74 @@ CH341InitializeDevice(
         SkipExternalNaming = 0;
     }
     ExFreePoolWithTag(ValueInformation, CH341_TAG);
+    TraceLevel = CH341GetRegistryParameter(KeyHandle,
+                                           L"TraceLevel",
+                                           CH341_DEFAULT_TRACE_LEVEL);
+    TraceFlags = CH341GetRegistryParameter(KeyHandle,
+                                           L"TraceFlags",
+                                           CH341_DEFAULT_TRACE_FLAGS);
+    DeviceExtension->ReadUrbCount = CH341GetRegistryParameter(KeyHandle,
+                                    L"ReadUrbCount",
+                                    CH341_DEFAULT_READ_URB_COUNT);
+    if (DeviceExtension->ReadUrbCount == 0 ||
+            DeviceExtension->ReadUrbCount > CH341_MAX_READ_URB_COUNT) {
+        CH341Warn(         "%s. Invalid ReadUrbCount %lu, using default\n",
+                           __FUNCTION__, DeviceExtension->ReadUrbCount);
+        DeviceExtension->ReadUrbCount = CH341_DEFAULT_READ_URB_COUNT;
+    }
+    DeviceExtension->WriteUrbCount = CH341GetRegistryParameter(KeyHandle,
+                                     L"WriteUrbCount",
+                                     CH341_DEFAULT_WRITE_URB_COUNT);
+    if (DeviceExtension->WriteUrbCount == 0 ||
+            DeviceExtension->WriteUrbCount > CH341_MAX_WRITE_URB_COUNT) {
+        CH341Warn(         "%s. Invalid WriteUrbCount %lu, using default\n",
+                           __FUNCTION__, DeviceExtension->WriteUrbCount);
+        DeviceExtension->WriteUrbCount = CH341_DEFAULT_WRITE_URB_COUNT;
+    }
+    DeviceExtension->WriteCoalescing = CH341GetRegistryParameter(KeyHandle,
+                                       L"WriteCoalescing",
+                                       0) != 0;
+    DeviceExtension->WriteCoalesceDeadline = CH341GetRegistryParameter(KeyHandle,
+            L"WriteCoalesceDeadline",
+            CH341_DEFAULT_COALESCE_DEADLINE);
+    if (DeviceExtension->WriteCoalesceDeadline == 0 ||
+            DeviceExtension->WriteCoalesceDeadline > CH341_MAX_COALESCE_DEADLINE) {
+        CH341Warn(         "%s. Invalid WriteCoalesceDeadline %lu, using default\n",
+                           __FUNCTION__, DeviceExtension->WriteCoalesceDeadline);
+        DeviceExtension->WriteCoalesceDeadline = CH341_DEFAULT_COALESCE_DEADLINE;
+    }
+    DeviceExtension->ControlCoalesceDeadline = CH341GetRegistryParameter(KeyHandle,
+            L"ControlCoalesceDeadline",
+            0);
+    if (DeviceExtension->ControlCoalesceDeadline > CH341_MAX_COALESCE_DEADLINE) {
+        CH341Warn(         "%s. Invalid ControlCoalesceDeadline %lu, using %lu\n",
+                           __FUNCTION__, DeviceExtension->ControlCoalesceDeadline,
+                           CH341_MAX_COALESCE_DEADLINE);
+        DeviceExtension->ControlCoalesceDeadline = CH341_MAX_COALESCE_DEADLINE;
+    }
+    DeviceExtension->DirectIoThreshold = CH341GetRegistryParameter(KeyHandle,
+                                         L"DirectIoThreshold",
+                                         0);
+    if (DeviceExtension->DirectIoThreshold) {
+        if (DeviceExtension->DirectIoThreshold < CH341_MIN_DIRECT_IO_THRESHOLD) {
+            CH341Warn(         "%s. Invalid DirectIoThreshold %lu, using %lu\n",
+                               __FUNCTION__, DeviceExtension->DirectIoThreshold,
+                               CH341_MIN_DIRECT_IO_THRESHOLD);
+            DeviceExtension->DirectIoThreshold = CH341_MIN_DIRECT_IO_THRESHOLD;
+        }
+        /* Large writes go out straight from the caller's pages */
+        DeviceObject->Flags &= ~DO_BUFFERED_IO;
+        DeviceObject->Flags |= DO_DIRECT_IO;
+    }
+    TraceRingSize = CH341GetRegistryParameter(KeyHandle,
+                    L"TraceRingSize",
+                    CH341_DEFAULT_TRACE_RING_SIZE);
+    if (TraceRingSize > CH341_MAX_TRACE_RING_SIZE ||
+            (TraceRingSize & (TraceRingSize - 1)) != 0) {
+        CH341Warn(         "%s. Invalid TraceRingSize %lu, using default\n",
+                           __FUNCTION__, TraceRingSize);
+        TraceRingSize = CH341_DEFAULT_TRACE_RING_SIZE;
+    }
     if (!SkipExternalNaming) {
         RtlInitUnicodeString(&ValueName, L"PortName");
         Status = ZwQueryValueKey(KeyHandle,
@@ -170,6 +298,12 @@ CH341InitializeDevice(
     NT_ASSERT(DeviceExtension->ComPortName.Buffer == ComPortNameBuffer);
     CH341Debug(         "%s. COM Port name is is '%wZ'\n",
                         __FUNCTION__, &DeviceExtension->ComPortName);
+    CH341TraceAddDevice(DeviceObject, TraceLevel, TraceFlags);
+    /* Zero disables the ring; failing to allocate it is not fatal either */
+    if (TraceRingSize)
+        (VOID)CH341TraceAllocate(DeviceObject, TraceRingSize);
+    /* Without them the counters just stay at zero */
+    (VOID)CH341StatsAllocate(DeviceObject);
     ConfigInfo = IoGetConfigurationInformation();
     ConfigInfo->SerialCount++;
     CH341Debug(         "%s. New serial port count: %lu\n",
@@ -192,6 +326,15 @@ CH341DestroyDevice(
                         __FUNCTION__, ConfigInfo->SerialCount);
     if (DeviceExtension->ComPortName.Buffer)
         ExFreePoolWithTag(DeviceExtension->ComPortName.Buffer, CH341_TAG);
+    CH341RingFree(&DeviceExtension->RxBuffer);
+    CH341UrbPoolFree(&DeviceExtension->UrbPool);
+    CH341UsbFreeControlIrp(DeviceObject);
+    CH341UsbFreeDescriptorCache(DeviceObject);
+    CH341TraceFree(DeviceObject);
+    CH341TraceRemoveDevice(DeviceObject);
+    CH341StatsFree(DeviceObject);
+    CH341FreeReadTimer(DeviceObject);
+    CH341FlowFree(DeviceObject);
     RtlFreeUnicodeString(&DeviceExtension->InterfaceLinkName);
     ExFreePoolWithTag(DeviceExtension->DeviceName.Buffer, CH341_TAG);
     return STATUS_SUCCESS;
@@ -206,6 +349,38 @@ CH341StartDevice(
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p\n",
                         __FUNCTION__, DeviceObject);
+    if (!DeviceExtension->UrbPool.Memory) {
+        Status = CH341UrbPoolInitialize(&DeviceExtension->UrbPool);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341UrbPoolInitialize failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    }
+    if (!DeviceExtension->ControlIrp) {
+        Status = CH341UsbAllocateControlIrp(DeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341UsbAllocateControlIrp failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    }
+    if (!DeviceExtension->ReadTimer) {
+        Status = CH341AllocateReadTimer(DeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341AllocateReadTimer failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    }
+    if (!DeviceExtension->FlowWorkItem) {
+        Status = CH341FlowAllocate(DeviceObject);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341FlowAllocate failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    }
     Status = CH341UsbStart(DeviceObject);
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbStart failed with %08lx\n",
@@ -215,23 +390,61 @@ CH341StartDevice(
     DeviceExtension->BaudRate = 115200;
     DeviceExtension->StopBits = 0;
     DeviceExtension->Parity = 0;
-    DeviceExtension->DataBits = 0;
+    DeviceExtension->DataBits = 8;
     DeviceExtension->Chars.XonChar = 0x11;
     DeviceExtension->Chars.XoffChar = 0x13;
     DeviceExtension->HandFlow.ControlHandShake = SERIAL_DTR_CONTROL;
     DeviceExtension->HandFlow.FlowReplace = SERIAL_RTS_CONTROL;
     DeviceExtension->HandFlow.XonLimit = 2048;
     DeviceExtension->HandFlow.XoffLimit = 512;
+    DeviceExtension->RxXoffSent = FALSE;
+    DeviceExtension->RxLinesDropped = FALSE;
+    DeviceExtension->EscapeChar = 0;
+    DeviceExtension->DtrRtsPending = FALSE;
+    /* Seeded again by CH341StartStatusPipe */
+    InterlockedExchange(&DeviceExtension->ModemStatus, 0);
     Status = CH341SetLine(DeviceObject);
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSetLine failed with %08lx\n",
                             __FUNCTION__, Status);
     }
+    if (!DeviceExtension->RxBuffer.Buffer) {
+        Status = CH341RingInitialize(&DeviceExtension->RxBuffer, CH341_RX_BUFFER_SIZE);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341RingInitialize failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    }
+    Status = CH341StartReadPump(DeviceObject);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341StartReadPump failed with %08lx\n",
+                            __FUNCTION__, Status);
+        return Status;
+    }
+    Status = CH341StartStatusPipe(DeviceObject);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341StartStatusPipe failed with %08lx\n",
+                            __FUNCTION__, Status);
+        CH341StopReadPump(DeviceObject);
+        return Status;
+    }
+    Status = CH341StartWriteEngine(DeviceObject);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341StartWriteEngine failed with %08lx\n",
+                            __FUNCTION__, Status);
+        CH341StopStatusPipe(DeviceObject);
+        CH341StopReadPump(DeviceObject);
+        return Status;
+    }
     Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
                                        TRUE);
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. IoSetDeviceInterfaceState failed with %08lx\n",
                             __FUNCTION__, Status);
+        CH341StopWriteEngine(DeviceObject, STATUS_CANCELLED);
+        CH341StopStatusPipe(DeviceObject);
+        CH341StopReadPump(DeviceObject);
         return Status;
     }
     if (DeviceExtension->ComPortName.Buffer) {
@@ -242,6 +455,9 @@ CH341StartDevice(
                                 __FUNCTION__, Status);
             (VOID)IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
                                             FALSE);
+            CH341StopWriteEngine(DeviceObject, STATUS_CANCELLED);
+            CH341StopStatusPipe(DeviceObject);
+            CH341StopReadPump(DeviceObject);
             return Status;
         }
         /* FIXME */
@@ -265,6 +481,11 @@ CH341StopDevice(
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p\n",
                         __FUNCTION__, DeviceObject);
+    CH341StopWriteEngine(DeviceObject, STATUS_NO_SUCH_DEVICE);
+    CH341StopStatusPipe(DeviceObject);
+    CH341CancelWait(DeviceObject, STATUS_NO_SUCH_DEVICE);
+    CH341StopReadPump(DeviceObject);
+    CH341CancelPendingReads(DeviceObject, STATUS_NO_SUCH_DEVICE);
     if (DeviceExtension->ComPortName.Buffer)
         (VOID)IoDeleteSymbolicLink(&DeviceExtension->ComPortName);
     Status = IoSetDeviceInterfaceState(&DeviceExtension->InterfaceLinkName,
@@ -453,6 +674,9 @@ CH341DispatchPnp(
         break;
     case IRP_MN_STOP_DEVICE:
         DeviceExtension->PnpState = Stopped;
+        CH341StopWriteEngine(DeviceObject, STATUS_CANCELLED);
+        CH341StopStatusPipe(DeviceObject);
+        CH341StopReadPump(DeviceObject);
         (VOID)CH341UsbStop(DeviceObject);
         break;
     case IRP_MN_SURPRISE_REMOVAL:
@@ -0,0 +1,152 @@
+/*
+ * CH341 Driver URB pool routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_USB
+#include "ch341.h"
+
+/*
+ * Every URB handed out by the pool is preceded by a URB_POOL_ENTRY header.
+ * Preallocated entries live in one block and go back onto their free list;
+ * entries allocated on a pool miss are returned to nonpaged pool.
+ */
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _URB_POOL_ENTRY {
+    SLIST_ENTRY ListEntry;
+    URB_POOL_TYPE Type;
+    BOOLEAN Pooled;
+} URB_POOL_ENTRY, *PURB_POOL_ENTRY;
+
+typedef union _CONTROL_URB {
+    struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST VendorClassRequest;
+    struct _URB_CONTROL_DESCRIPTOR_REQUEST DescriptorRequest;
+    struct _URB_SELECT_CONFIGURATION SelectConfiguration;
+    struct _URB_PIPE_REQUEST PipeRequest;
+} CONTROL_URB;
+
+static const ULONG UrbPoolEntryCount[UrbPoolMaximum] = {
+    CH341_URB_POOL_CONTROL_COUNT,
+    CH341_URB_POOL_BULK_COUNT,
+};
+
+static const ULONG UrbPoolUrbSize[UrbPoolMaximum] = {
+    sizeof(CONTROL_URB),
+    sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
+};
+
+#define URB_POOL_ENTRY_SIZE(Type) \
+    ((ULONG)ALIGN_UP_BY(sizeof(URB_POOL_ENTRY) + UrbPoolUrbSize[Type], MEMORY_ALLOCATION_ALIGNMENT))
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341UrbPoolInitialize)
+#pragma alloc_text(PAGE, CH341UrbPoolFree)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+CH341UrbPoolInitialize(
+    _Out_ PURB_POOL Pool) {
+    ULONG Type;
+    ULONG i;
+    SIZE_T Size = 0;
+    PUCHAR Memory;
+    PURB_POOL_ENTRY Entry;
+    PAGED_CODE();
+    for (Type = 0; Type < UrbPoolMaximum; Type++)
+        Size += (SIZE_T)UrbPoolEntryCount[Type] * URB_POOL_ENTRY_SIZE(Type);
+    Memory = ExAllocatePoolWithTag(NonPagedPool, Size, CH341_URB_TAG);
+    if (!Memory) {
+        CH341Error(         "%s. Allocating URB pool of size %lu failed\n",
+                            __FUNCTION__, (ULONG)Size);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Memory, Size);
+    Pool->Memory = Memory;
+    Pool->MemorySize = Size;
+    for (Type = 0; Type < UrbPoolMaximum; Type++) {
+        InitializeSListHead(&Pool->FreeList[Type]);
+        for (i = 0; i < UrbPoolEntryCount[Type]; i++) {
+            Entry = (PURB_POOL_ENTRY)Memory;
+            Entry->Type = (URB_POOL_TYPE)Type;
+            Entry->Pooled = TRUE;
+            InterlockedPushEntrySList(&Pool->FreeList[Type], &Entry->ListEntry);
+            Memory += URB_POOL_ENTRY_SIZE(Type);
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341UrbPoolFree(
+    _Inout_ PURB_POOL Pool) {
+    ULONG Type;
+    PAGED_CODE();
+    if (!Pool->Memory)
+        return;
+    for (Type = 0; Type < UrbPoolMaximum; Type++)
+        NT_ASSERT(QueryDepthSList(&Pool->FreeList[Type]) == UrbPoolEntryCount[Type]);
+    ExFreePoolWithTag(Pool->Memory, CH341_URB_TAG);
+    Pool->Memory = NULL;
+    Pool->MemorySize = 0;
+}
+
+PURB
+CH341UrbAllocate(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ URB_POOL_TYPE Type) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PURB_POOL Pool = &DeviceExtension->UrbPool;
+    PSLIST_ENTRY ListEntry;
+    PURB_POOL_ENTRY Entry;
+    NT_ASSERT(Type < UrbPoolMaximum);
+    ListEntry = Pool->Memory ? InterlockedPopEntrySList(&Pool->FreeList[Type]) : NULL;
+    if (ListEntry) {
+        if (Type == UrbPoolControl)
+            CH341StatsAdd(DeviceExtension, ControlUrbPoolHits, 1);
+        else
+            CH341StatsAdd(DeviceExtension, BulkUrbPoolHits, 1);
+        Entry = CONTAINING_RECORD(ListEntry, URB_POOL_ENTRY, ListEntry);
+    } else {
+        if (Type == UrbPoolControl)
+            CH341StatsAdd(DeviceExtension, ControlUrbPoolMisses, 1);
+        else
+            CH341StatsAdd(DeviceExtension, BulkUrbPoolMisses, 1);
+        Entry = ExAllocatePoolWithTag(NonPagedPool,
+                                      URB_POOL_ENTRY_SIZE(Type),
+                                      CH341_URB_TAG);
+        if (!Entry)
+            return NULL;
+        Entry->Type = Type;
+        Entry->Pooled = FALSE;
+    }
+    RtlZeroMemory(Entry + 1, UrbPoolUrbSize[Type]);
+    return (PURB)(Entry + 1);
+}
+
+VOID
+CH341UrbFree(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ __drv_freesMem(Mem) PURB Urb) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PURB_POOL_ENTRY Entry = (PURB_POOL_ENTRY)Urb - 1;
+    if (Entry->Pooled) {
+        InterlockedPushEntrySList(&DeviceExtension->UrbPool.FreeList[Entry->Type],
+                                  &Entry->ListEntry);
+    } else {
+        ExFreePoolWithTag(Entry, CH341_URB_TAG);
+    }
+}
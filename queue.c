@@ -52,8 +52,6 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 static VOID NTAPI CH341QueueCompleteCanceledIrp(_In_ PIO_CSQ Csq,
         _In_ PIRP Irp);
 
-NTSTATUS CH341InitializeQueue(_In_ PQUEUE Queue);
-
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, CH341InitializeQueue)
 #endif /* defined ALLOC_PRAGMA */
@@ -82,9 +80,15 @@ NTSTATUS
 CH341QueueIrp(
     _In_ PDEVICE_OBJECT DeviceObject,
     _In_ PIRP Irp) {
-    DBG_UNREFERENCED_PARAMETER(DeviceObject);
-    DBG_UNREFERENCED_PARAMETER(Irp);
-    return STATUS_NOT_IMPLEMENTED;
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    Status = IoCsqInsertIrpEx(&DeviceExtension->ReadQueue.Csq,
+                              Irp,
+                              NULL,
+                              NULL);
+    if (!NT_SUCCESS(Status))
+        return Status;
+    return STATUS_PENDING;
 }
 
 _Function_class_(IO_CSQ_INSERT_IRP_EX)
@@ -181,9 +185,10 @@ NTAPI
 CH341QueueCompleteCanceledIrp(
     _In_ PIO_CSQ Csq,
     _In_ PIRP Irp) {
-    UNREFERENCED_PARAMETER(Csq);
+    /* The read queue is the only one */
+    PDEVICE_EXTENSION DeviceExtension = CONTAINING_RECORD(Csq, DEVICE_EXTENSION, ReadQueue.Csq);
     ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    /* Queued reads carry no data, Information is left as the read path set it */
     Irp->IoStatus.Status = STATUS_CANCELLED;
-    Irp->IoStatus.Information = 0;
-    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    CH341TraceCompleteIrp(DeviceExtension, Irp);
 }
@@ -0,0 +1,864 @@
+/*
+ * CH341 Driver read routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_READ
+#include "ch341.h"
+
+/*
+ * The read pump keeps ReadUrbCount bulk IN transfers posted at all times, so
+ * that the device FIFO is drained even while no read IRP is outstanding.
+ * Received data is collected in RxBuffer, from which read IRPs are satisfied.
+ * Read IRPs that cannot be satisfied right away wait in the cancel-safe
+ * ReadQueue. The lock order is RxLock, then the queue lock.
+ *
+ * The oldest read is taken off the queue as ReadCurrent and filled as data
+ * arrives, following the SERIAL_TIMEOUTS rules: it completes once its buffer
+ * is full, when the total timeout (multiplier * length + constant) runs out,
+ * or when no byte arrived for ReadIntervalTimeout after the first one. Both
+ * deadlines are kept in interrupt time and share one high resolution timer.
+ *
+ * On the way into RxBuffer, received data is scanned for the special
+ * characters: XON and XOFF under SERIAL_AUTO_TRANSMIT, the EventChar while
+ * SERIAL_EV_RXFLAG is watched, and the EscapeChar set through
+ * IOCTL_SERIAL_LSRMST_INSERT, which is then doubled as EscapeChar,
+ * SERIAL_LSRMST_ESCAPE. Modem status changes are inserted the same way.
+ * The CH341 does not report line errors per byte, so there is no LSR data
+ * to insert and the ErrorChar is never used.
+ */
+
+#define CH341_READ_IMMEDIATE        0x1
+#define CH341_READ_RETURN_ON_ANY    0x2
+
+static VOID CH341SubmitRead(_In_ PREAD_CONTEXT Context);
+static VOID CH341ReadAbort(_In_ PDEVICE_OBJECT DeviceObject);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI CH341ReadCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+        _In_ PIRP Irp,
+        _In_reads_(sizeof(READ_CONTEXT)) PVOID Context);
+static VOID CH341ReadReceive(_In_ PDEVICE_OBJECT DeviceObject,
+                             _In_reads_bytes_(Length) const UCHAR *Data,
+                             _In_ ULONG Length);
+_Requires_lock_held_(DeviceExtension->RxLock)
+static VOID CH341ReadProcess(_In_ PDEVICE_EXTENSION DeviceExtension,
+                             _Inout_ PLIST_ENTRY CompleteList);
+static VOID CH341ReadCompleteList(_In_ PDEVICE_EXTENSION DeviceExtension,
+                                  _Inout_ PLIST_ENTRY CompleteList);
+static DRIVER_CANCEL CH341ReadCancel;
+static EXT_CALLBACK CH341ReadTimeout;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341StartReadPump)
+#pragma alloc_text(PAGE, CH341StopReadPump)
+#pragma alloc_text(PAGE, CH341ReadAbort)
+#pragma alloc_text(PAGE, CH341AllocateReadTimer)
+#pragma alloc_text(PAGE, CH341FreeReadTimer)
+#endif /* defined ALLOC_PRAGMA */
+
+/*
+ * RxQueuedBytes mirrors the ring fill level for GET_COMMSTATUS, which reads
+ * it without taking RxLock. Every change of the fill level is also checked
+ * against the XON/XOFF limits.
+ */
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+inline
+VOID
+CH341ReadPublishCount(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    InterlockedExchange(&DeviceExtension->RxQueuedBytes,
+                        (LONG)CH341RingCount(&DeviceExtension->RxBuffer));
+    CH341FlowCheckReceive(DeviceExtension);
+}
+
+static
+VOID
+CH341SubmitRead(
+    _In_ PREAD_CONTEXT Context) {
+    PDEVICE_EXTENSION DeviceExtension = Context->DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    IoReuseIrp(Context->Irp, STATUS_SUCCESS);
+    UsbBuildInterruptOrBulkTransferRequest((PURB)&Context->Urb,
+                                           sizeof(Context->Urb),
+                                           DeviceExtension->BulkInPipe,
+                                           Context->Buffer,
+                                           NULL,
+                                           sizeof(Context->Buffer),
+                                           USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+                                           NULL);
+    IoStack = IoGetNextIrpStackLocation(Context->Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    IoStack->Parameters.Others.Argument1 = &Context->Urb;
+    IoSetCompletionRoutine(Context->Irp,
+                           CH341ReadCompletion,
+                           Context,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_BULK_IN_SUBMIT,
+                    Context,
+                    sizeof(Context->Buffer),
+                    STATUS_SUCCESS);
+    Context->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Context->Irp);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+CH341ReadCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(READ_CONTEXT)) PVOID Context) {
+    PREAD_CONTEXT ReadContext = Context;
+    PDEVICE_EXTENSION DeviceExtension = ReadContext->DeviceObject->DeviceExtension;
+    NTSTATUS Status = Irp->IoStatus.Status;
+    BOOLEAN Resubmit;
+    /* We allocated the IRP ourselves, so there is no stack location for us */
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_BULK_IN_COMPLETE,
+                    ReadContext,
+                    ReadContext->Urb.TransferBufferLength,
+                    NT_SUCCESS(Status) ? ReadContext->Urb.Hdr.Status : Status);
+    CH341LatencySince(DeviceExtension, CH341_LATENCY_BULK_IN, ReadContext->SubmitTime);
+    if (NT_SUCCESS(Status) && USBD_SUCCESS(ReadContext->Urb.Hdr.Status)) {
+        ReadContext->Errors = 0;
+        CH341StatsAdd(DeviceExtension, BulkInTransfers, 1);
+        CH341StatsAdd(DeviceExtension, BytesReceived, ReadContext->Urb.TransferBufferLength);
+        CH341ReadReceive(ReadContext->DeviceObject,
+                         ReadContext->Buffer,
+                         ReadContext->Urb.TransferBufferLength);
+        Resubmit = TRUE;
+    } else {
+        CH341Warn(         "%s. Read failed with %08lx, %08lx\n",
+                           __FUNCTION__, Status, ReadContext->Urb.Hdr.Status);
+        CH341StatsAdd(DeviceExtension, BulkInErrors, 1);
+        Resubmit = Status != STATUS_CANCELLED &&
+                   Status != STATUS_NO_SUCH_DEVICE &&
+                   Status != STATUS_DEVICE_NOT_CONNECTED &&
+                   ++ReadContext->Errors < CH341_MAX_READ_ERRORS;
+    }
+    /*
+     * ReadsSubmitting is raised before ReadPumpRunning is sampled, so once a
+     * stopper has cleared ReadPumpRunning and seen ReadsSubmitting drop to
+     * zero, every resubmission it raced with has reached the lower driver
+     * and the next abort catches it.
+     */
+    InterlockedIncrement(&DeviceExtension->ReadsSubmitting);
+    if (Resubmit && DeviceExtension->ReadPumpRunning) {
+        CH341SubmitRead(ReadContext);
+        InterlockedDecrement(&DeviceExtension->ReadsSubmitting);
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    }
+    InterlockedDecrement(&DeviceExtension->ReadsSubmitting);
+    if (InterlockedDecrement(&DeviceExtension->ReadsOutstanding) == 0)
+        KeSetEvent(&DeviceExtension->ReadPumpIdleEvent, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS
+CH341StartReadPump(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PREAD_CONTEXT Contexts;
+    ULONG i;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, ReadUrbCount=%lu\n",
+                        __FUNCTION__, DeviceObject,    DeviceExtension->ReadUrbCount);
+    NT_ASSERT(DeviceExtension->ReadUrbCount != 0);
+    Contexts = ExAllocatePoolWithTag(NonPagedPool,
+                                     DeviceExtension->ReadUrbCount * sizeof(*Contexts),
+                                     CH341_URB_TAG);
+    if (!Contexts) {
+        CH341Error(         "%s. Allocating read contexts failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Contexts, DeviceExtension->ReadUrbCount * sizeof(*Contexts));
+    for (i = 0; i < DeviceExtension->ReadUrbCount; i++) {
+        Contexts[i].DeviceObject = DeviceObject;
+        Contexts[i].Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+        if (!Contexts[i].Irp) {
+            CH341Error(         "%s. Allocating read IRP %lu failed\n",
+                                __FUNCTION__, i);
+            while (i--)
+                IoFreeIrp(Contexts[i].Irp);
+            ExFreePoolWithTag(Contexts, CH341_URB_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    ExAcquireFastMutex(&DeviceExtension->ReadPumpMutex);
+    NT_ASSERT(!DeviceExtension->ReadContexts);
+    DeviceExtension->ReadContexts = Contexts;
+    KeClearEvent(&DeviceExtension->ReadPumpIdleEvent);
+    DeviceExtension->ReadsOutstanding = DeviceExtension->ReadUrbCount;
+    InterlockedExchange(&DeviceExtension->ReadPumpRunning, TRUE);
+    for (i = 0; i < DeviceExtension->ReadUrbCount; i++)
+        CH341SubmitRead(&Contexts[i]);
+    ExReleaseFastMutex(&DeviceExtension->ReadPumpMutex);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Retires all posted transfers. Called with ReadPumpMutex held.
+ * A completion that sampled ReadPumpRunning before it was cleared may post
+ * its IRP again after the abort went down, so the pipe is aborted and the
+ * IRPs cancelled again until every transfer has come back.
+ */
+static
+VOID
+CH341ReadAbort(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LARGE_INTEGER Timeout;
+    LARGE_INTEGER Poll;
+    ULONG i;
+    PAGED_CODE();
+    Timeout.QuadPart = -(LONGLONG)CH341_MS_TO_100NS(CH341_PIPE_DRAIN_TIMEOUT_MS);
+    Poll.QuadPart = -(LONGLONG)CH341_PIPE_DRAIN_POLL_US * 10;
+    InterlockedExchange(&DeviceExtension->ReadPumpRunning, FALSE);
+    for (;;) {
+        while (DeviceExtension->ReadsSubmitting)
+            (VOID)KeDelayExecutionThread(KernelMode, FALSE, &Poll);
+        Status = CH341UsbAbortPipe(DeviceObject, DeviceExtension->BulkInPipe);
+        if (!NT_SUCCESS(Status)) {
+            CH341Warn(         "%s. CH341UsbAbortPipe failed with %08lx\n",
+                               __FUNCTION__, Status);
+        }
+        for (i = 0; i < DeviceExtension->ReadUrbCount; i++)
+            (VOID)IoCancelIrp(DeviceExtension->ReadContexts[i].Irp);
+        Status = KeWaitForSingleObject(&DeviceExtension->ReadPumpIdleEvent,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       &Timeout);
+        if (Status == STATUS_SUCCESS)
+            break;
+        CH341Warn(         "%s. %ld transfers still outstanding, aborting again\n",
+                           __FUNCTION__, DeviceExtension->ReadsOutstanding);
+    }
+}
+
+VOID
+CH341StopReadPump(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG i;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    ExAcquireFastMutex(&DeviceExtension->ReadPumpMutex);
+    if (!DeviceExtension->ReadContexts) {
+        ExReleaseFastMutex(&DeviceExtension->ReadPumpMutex);
+        return;
+    }
+    CH341ReadAbort(DeviceObject);
+    for (i = 0; i < DeviceExtension->ReadUrbCount; i++)
+        IoFreeIrp(DeviceExtension->ReadContexts[i].Irp);
+    ExFreePoolWithTag(DeviceExtension->ReadContexts, CH341_URB_TAG);
+    DeviceExtension->ReadContexts = NULL;
+    ExReleaseFastMutex(&DeviceExtension->ReadPumpMutex);
+}
+
+/*
+ * Discards everything received so far, including what is still in flight:
+ * the posted transfers are aborted, the ring is emptied and the same
+ * transfers are posted again. The pump's IRPs and buffers are reused.
+ */
+VOID
+CH341ReadPurge(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LARGE_INTEGER StartTime;
+    LARGE_INTEGER EndTime;
+    KIRQL OldIrql;
+    ULONG i;
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    StartTime = KeQueryPerformanceCounter(NULL);
+    ExAcquireFastMutex(&DeviceExtension->ReadPumpMutex);
+    if (DeviceExtension->ReadContexts)
+        CH341ReadAbort(DeviceObject);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    CH341RingClear(&DeviceExtension->RxBuffer);
+    CH341ReadPublishCount(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    CH341FlowKick(DeviceExtension);
+    if (DeviceExtension->ReadContexts) {
+        KeClearEvent(&DeviceExtension->ReadPumpIdleEvent);
+        DeviceExtension->ReadsOutstanding = DeviceExtension->ReadUrbCount;
+        InterlockedExchange(&DeviceExtension->ReadPumpRunning, TRUE);
+        for (i = 0; i < DeviceExtension->ReadUrbCount; i++) {
+            DeviceExtension->ReadContexts[i].Errors = 0;
+            CH341SubmitRead(&DeviceExtension->ReadContexts[i]);
+        }
+    }
+    ExReleaseFastMutex(&DeviceExtension->ReadPumpMutex);
+    EndTime = KeQueryPerformanceCounter(NULL);
+    CH341Debug(         "%s. Read pump ready again after %I64u us\n",
+                        __FUNCTION__, (ULONGLONG)(EndTime.QuadPart - StartTime.QuadPart) * 1000000 /
+                        (ULONGLONG)DeviceExtension->PerformanceFrequency.QuadPart);
+}
+
+/* Escape sequences go into RxBuffer whole or not at all */
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+inline
+ULONG
+CH341ReadInsert(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length) {
+    if (DeviceExtension->RxBuffer.Size - CH341RingCount(&DeviceExtension->RxBuffer) < Length)
+        return 0;
+    return CH341RingWrite(&DeviceExtension->RxBuffer, Data, Length);
+}
+
+static
+VOID
+CH341ReadReceive(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    KIRQL OldIrql;
+    ULONG Written = 0;
+    ULONG Expected = Length;
+    ULONG Chunk;
+    ULONG Events = SERIAL_EV_RXCHAR;
+    BOOLEAN AutoTransmit;
+    BOOLEAN FlowSeen = FALSE;
+    BOOLEAN XoffSeen = FALSE;
+    UCHAR EventChar;
+    UCHAR Xon;
+    UCHAR Xoff;
+    UCHAR Escape[2];
+    if (!Length)
+        return;
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    /* Unlocked peek, as in CH341SignalEvents */
+    if (DeviceExtension->WaitMask & SERIAL_EV_RXFLAG) {
+        EventChar = DeviceExtension->Chars.EventChar;
+        if (CH341FlowScan(Data, Length, EventChar, EventChar, EventChar) < Length)
+            Events |= SERIAL_EV_RXFLAG;
+    }
+    AutoTransmit = (DeviceExtension->HandFlow.FlowReplace & SERIAL_AUTO_TRANSMIT) != 0;
+    Escape[0] = DeviceExtension->EscapeChar;
+    Escape[1] = SERIAL_LSRMST_ESCAPE;
+    if (AutoTransmit || Escape[0]) {
+        /* Characters we do not need stand in for one we do */
+        Xon = AutoTransmit ? DeviceExtension->Chars.XonChar : Escape[0];
+        Xoff = AutoTransmit ? DeviceExtension->Chars.XoffChar : Escape[0];
+        while ((Chunk = CH341FlowScan(Data,
+                                      Length,
+                                      Xon,
+                                      Xoff,
+                                      Escape[0] ? Escape[0] : Xon)) < Length) {
+            Written += CH341RingWrite(&DeviceExtension->RxBuffer, Data, Chunk);
+            if (AutoTransmit && (Data[Chunk] == Xon || Data[Chunk] == Xoff)) {
+                /* The peer's XON and XOFF steer our transmitter and are not data */
+                FlowSeen = TRUE;
+                XoffSeen = Data[Chunk] == Xoff;
+                Expected--;
+            } else {
+                Written += CH341ReadInsert(DeviceExtension, Escape, sizeof(Escape));
+                Expected++;
+            }
+            Data += Chunk + 1;
+            Length -= Chunk + 1;
+        }
+    }
+    Written += CH341RingWrite(&DeviceExtension->RxBuffer, Data, Length);
+    if (Written < Expected) {
+        DeviceExtension->RxBytesDropped += Expected - Written;
+        CH341StatsAdd(DeviceExtension, BufferOverruns, Expected - Written);
+        InterlockedOr(&DeviceExtension->CommErrors, SERIAL_ERROR_QUEUEOVERRUN);
+    }
+    CH341ReadProcess(DeviceExtension, &CompleteList);
+    CH341ReadPublishCount(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    if (Written < Expected) {
+        CH341Warn(         "%s. Receive buffer overrun, dropped %lu bytes\n",
+                           __FUNCTION__, Expected - Written);
+    }
+    if (FlowSeen) {
+        /* Only the last one counts */
+        CH341WriteSetHold(DeviceExtension,
+                          XoffSeen ? SERIAL_TX_WAITING_FOR_XON : 0,
+                          XoffSeen ? 0 : SERIAL_TX_WAITING_FOR_XON);
+    }
+    CH341ReadCompleteList(DeviceExtension, &CompleteList);
+    CH341SignalEvents(DeviceObject, Events);
+}
+
+/* Inserts EscapeChar, SERIAL_LSRMST_MST, ModemStatus if LSRMST insertion is on */
+VOID
+CH341ReadInsertModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR ModemStatus) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    KIRQL OldIrql;
+    UCHAR Insert[3];
+    /* Unlocked peek, insertion is rarely on */
+    if (!DeviceExtension->EscapeChar)
+        return;
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    Insert[0] = DeviceExtension->EscapeChar;
+    Insert[1] = SERIAL_LSRMST_MST;
+    Insert[2] = ModemStatus;
+    if (!Insert[0]) {
+        KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+        return;
+    }
+    if (!CH341ReadInsert(DeviceExtension, Insert, sizeof(Insert))) {
+        DeviceExtension->RxBytesDropped += sizeof(Insert);
+        CH341StatsAdd(DeviceExtension, BufferOverruns, sizeof(Insert));
+        InterlockedOr(&DeviceExtension->CommErrors, SERIAL_ERROR_QUEUEOVERRUN);
+    }
+    CH341ReadProcess(DeviceExtension, &CompleteList);
+    CH341ReadPublishCount(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    CH341ReadCompleteList(DeviceExtension, &CompleteList);
+}
+
+static
+inline
+ULONGLONG
+CH341ReadNow(VOID) {
+    ULONG64 QpcTimeStamp;
+    return KeQueryInterruptTimePrecise(&QpcTimeStamp);
+}
+
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+VOID
+CH341ReadStart(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp,
+    _In_ ULONGLONG Now) {
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    const SERIAL_TIMEOUTS *Timeouts = &DeviceExtension->Timeouts;
+    ULONGLONG Total;
+    DeviceExtension->ReadFlags = 0;
+    DeviceExtension->ReadInterval = 0;
+    DeviceExtension->ReadTotalDeadline = 0;
+    DeviceExtension->ReadIntervalDeadline = 0;
+    if (Timeouts->ReadIntervalTimeout == MAXULONG &&
+            !Timeouts->ReadTotalTimeoutMultiplier &&
+            !Timeouts->ReadTotalTimeoutConstant) {
+        /* Return immediately with whatever is buffered */
+        DeviceExtension->ReadFlags = CH341_READ_IMMEDIATE;
+        return;
+    }
+    if (Timeouts->ReadIntervalTimeout == MAXULONG &&
+            Timeouts->ReadTotalTimeoutMultiplier == MAXULONG) {
+        /* Return as soon as anything is there, or time out after the constant */
+        DeviceExtension->ReadFlags = CH341_READ_RETURN_ON_ANY;
+        DeviceExtension->ReadTotalDeadline = Now + CH341_MS_TO_100NS(Timeouts->ReadTotalTimeoutConstant);
+        return;
+    }
+    Total = (ULONGLONG)Timeouts->ReadTotalTimeoutMultiplier * IoStack->Parameters.Read.Length +
+            Timeouts->ReadTotalTimeoutConstant;
+    if (Total)
+        DeviceExtension->ReadTotalDeadline = Now + CH341_MS_TO_100NS(Total);
+    DeviceExtension->ReadInterval = CH341_MS_TO_100NS(Timeouts->ReadIntervalTimeout);
+    /* The interval timer runs from the last byte received, if any */
+    if (Irp->IoStatus.Information && DeviceExtension->ReadInterval)
+        DeviceExtension->ReadIntervalDeadline = Now + DeviceExtension->ReadInterval;
+}
+
+/* Returns TRUE once Irp is done, with its final status set */
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+BOOLEAN
+CH341ReadService(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PIRP Irp,
+    _In_ ULONGLONG Now) {
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Length = IoStack->Parameters.Read.Length;
+    ULONG Received;
+    Received = CH341RingRead(&DeviceExtension->RxBuffer,
+                             CH341IrpBuffer(Irp) + Irp->IoStatus.Information,
+                             Length - (ULONG)Irp->IoStatus.Information);
+    Irp->IoStatus.Information += Received;
+    if (Received)
+        CH341ReadPublishCount(DeviceExtension);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    if (Irp->IoStatus.Information == Length ||
+            DeviceExtension->ReadFlags & CH341_READ_IMMEDIATE)
+        return TRUE;
+    if (Irp->IoStatus.Information &&
+            DeviceExtension->ReadFlags & CH341_READ_RETURN_ON_ANY)
+        return TRUE;
+    if (Received && DeviceExtension->ReadInterval)
+        DeviceExtension->ReadIntervalDeadline = Now + DeviceExtension->ReadInterval;
+    if ((DeviceExtension->ReadTotalDeadline && Now >= DeviceExtension->ReadTotalDeadline) ||
+            (DeviceExtension->ReadIntervalDeadline && Now >= DeviceExtension->ReadIntervalDeadline)) {
+        Irp->IoStatus.Status = STATUS_TIMEOUT;
+        CH341StatsAdd(DeviceExtension, ReadTimeouts, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+VOID
+CH341ReadArmTimer(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONGLONG Now) {
+    ULONGLONG DueTime = 0;
+    if (!DeviceExtension->ReadTimer)
+        return;
+    if (DeviceExtension->ReadCurrent) {
+        DueTime = DeviceExtension->ReadTotalDeadline;
+        if (DeviceExtension->ReadIntervalDeadline &&
+                (!DueTime || DeviceExtension->ReadIntervalDeadline < DueTime))
+            DueTime = DeviceExtension->ReadIntervalDeadline;
+    }
+    if (!DueTime) {
+        (VOID)ExCancelTimer(DeviceExtension->ReadTimer, NULL);
+        return;
+    }
+    /* CH341ReadService has completed the read if a deadline had passed */
+    NT_ASSERT(DueTime > Now);
+    (VOID)ExSetTimer(DeviceExtension->ReadTimer,
+                     -(LONGLONG)(DueTime - Now),
+                     0,
+                     NULL);
+}
+
+/*
+ * Makes Irp the current read. Returns FALSE if it was canceled meanwhile,
+ * in which case it is on CompleteList with whatever it already received.
+ */
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+BOOLEAN
+CH341ReadSetCurrent(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    NT_ASSERT(!DeviceExtension->ReadCurrent);
+    DeviceExtension->ReadCurrent = Irp;
+    (VOID)IoSetCancelRoutine(Irp, CH341ReadCancel);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL)) {
+        DeviceExtension->ReadCurrent = NULL;
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        InsertTailList(CompleteList, &Irp->Tail.Overlay.ListEntry);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+_Requires_lock_held_(DeviceExtension->RxLock)
+static
+VOID
+CH341ReadProcess(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    PIRP Irp;
+    ULONGLONG Now = CH341ReadNow();
+    for (;;) {
+        Irp = DeviceExtension->ReadCurrent;
+        if (!Irp) {
+            Irp = IoCsqRemoveNextIrp(&DeviceExtension->ReadQueue.Csq, NULL);
+            if (!Irp)
+                break;
+            CH341ReadStart(DeviceExtension, Irp, Now);
+            if (!CH341ReadSetCurrent(DeviceExtension, Irp, CompleteList))
+                continue;
+        }
+        if (!CH341ReadService(DeviceExtension, Irp, Now))
+            break;
+        DeviceExtension->ReadCurrent = NULL;
+        /* Otherwise CH341ReadCancel owns the IRP and will complete it */
+        if (IoSetCancelRoutine(Irp, NULL))
+            InsertTailList(CompleteList, &Irp->Tail.Overlay.ListEntry);
+    }
+    CH341ReadArmTimer(DeviceExtension, Now);
+}
+
+static
+VOID
+CH341ReadCompleteList(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    /* Sends the XON or XOFF the fill level called for while RxLock was held */
+    CH341FlowKick(DeviceExtension);
+    while (!IsListEmpty(CompleteList)) {
+        ListEntry = RemoveHeadList(CompleteList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+    }
+}
+
+static
+VOID
+NTAPI
+CH341ReadCancel(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    KIRQL OldIrql;
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    if (DeviceExtension->ReadCurrent == Irp) {
+        DeviceExtension->ReadCurrent = NULL;
+        CH341ReadProcess(DeviceExtension, &CompleteList);
+    }
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    /* Data already copied to the IRP is handed back with it */
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    CH341TraceCompleteIrp(DeviceExtension, Irp);
+    CH341ReadCompleteList(DeviceExtension, &CompleteList);
+}
+
+static
+VOID
+NTAPI
+CH341ReadTimeout(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context) {
+    PDEVICE_OBJECT DeviceObject = Context;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    KIRQL OldIrql;
+    UNREFERENCED_PARAMETER(Timer);
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    CH341ReadProcess(DeviceExtension, &CompleteList);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    CH341ReadCompleteList(DeviceExtension, &CompleteList);
+}
+
+NTSTATUS
+CH341AllocateReadTimer(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    NT_ASSERT(!DeviceExtension->ReadTimer);
+    DeviceExtension->ReadTimer = ExAllocateTimer(CH341ReadTimeout,
+                                 DeviceObject,
+                                 EX_TIMER_HIGH_RESOLUTION);
+    if (!DeviceExtension->ReadTimer) {
+        CH341Error(         "%s. Allocating read timeout timer failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341FreeReadTimer(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    if (!DeviceExtension->ReadTimer)
+        return;
+    NT_ASSERT(!DeviceExtension->ReadCurrent);
+    (VOID)ExDeleteTimer(DeviceExtension->ReadTimer, TRUE, TRUE, NULL);
+    DeviceExtension->ReadTimer = NULL;
+}
+
+VOID
+CH341ReadGetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PSERIAL_TIMEOUTS Timeouts) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    *Timeouts = DeviceExtension->Timeouts;
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+}
+
+VOID
+CH341ReadSetTimeouts(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ const SERIAL_TIMEOUTS *Timeouts) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    /* Reads already in progress keep the timeouts they were started with */
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    DeviceExtension->Timeouts = *Timeouts;
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+}
+
+NTSTATUS
+CH341ReadSetQueueSize(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Size) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    RING_BUFFER Ring;
+    RING_BUFFER Old;
+    ULONG RingSize;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, Size=%lu\n",
+                        __FUNCTION__, DeviceObject,    Size);
+    if (Size > CH341_MAX_RX_BUFFER_SIZE)
+        return STATUS_INVALID_PARAMETER;
+    RingSize = CH341_RX_BUFFER_SIZE;
+    while (RingSize < Size)
+        RingSize <<= 1;
+    /* Like serial.sys, the buffer only ever grows */
+    if (RingSize <= DeviceExtension->RxBuffer.Size)
+        return STATUS_SUCCESS;
+    Status = CH341RingInitialize(&Ring, RingSize);
+    if (!NT_SUCCESS(Status))
+        return Status;
+    /*
+     * The new ring takes over whatever has been received so far. The read
+     * pump only ever sees one ring or the other, so nothing is allocated or
+     * freed on the data path.
+     */
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    if (Ring.Size > DeviceExtension->RxBuffer.Size) {
+        CH341RingMove(&Ring, &DeviceExtension->RxBuffer);
+        Old = DeviceExtension->RxBuffer;
+        DeviceExtension->RxBuffer = Ring;
+        Ring = Old;
+    }
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    CH341RingFree(&Ring);
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341CancelPendingReads(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    PLIST_ENTRY ListEntry;
+    KIRQL OldIrql;
+    PIRP Irp;
+    CH341Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                        __FUNCTION__, DeviceObject,    Status);
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    Irp = DeviceExtension->ReadCurrent;
+    DeviceExtension->ReadCurrent = NULL;
+    if (Irp && IoSetCancelRoutine(Irp, NULL))
+        InsertTailList(&CompleteList, &Irp->Tail.Overlay.ListEntry);
+    /* Only the current read may hold data, queued ones have Information 0 */
+    while ((Irp = IoCsqRemoveNextIrp(&DeviceExtension->ReadQueue.Csq, NULL)) != NULL) {
+        NT_ASSERT(Irp->IoStatus.Information == 0);
+        InsertTailList(&CompleteList, &Irp->Tail.Overlay.ListEntry);
+    }
+    if (DeviceExtension->ReadTimer)
+        (VOID)ExCancelTimer(DeviceExtension->ReadTimer, NULL);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    while (!IsListEmpty(&CompleteList)) {
+        ListEntry = RemoveHeadList(&CompleteList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        /* Data already copied to the current read is handed back with it */
+        Irp->IoStatus.Status = Status;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+    }
+}
+
+NTSTATUS
+CH341Read(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    KIRQL OldIrql;
+    ULONGLONG Now;
+    CH341Verbose(       "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_READ_IRP,
+                    Irp,
+                    IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.Length,
+                    STATUS_SUCCESS);
+    CH341IrpArrivalTime(Irp) = KeQueryPerformanceCounter(NULL).QuadPart;
+    Irp->IoStatus.Information = 0;
+    if (!CH341IrpBuffer(Irp)) {
+        CH341Error(         "%s. Mapping the read buffer failed\n",
+                            __FUNCTION__);
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Status = Status;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return Status;
+    }
+    KeAcquireSpinLock(&DeviceExtension->RxLock, &OldIrql);
+    /*
+     * Reads are only ever queued under RxLock, so the queue cannot become
+     * non-empty behind our back. A concurrent cancellation may empty it,
+     * which merely sends us down the queued path below.
+     */
+    if (!DeviceExtension->ReadCurrent &&
+            IsListEmpty(&DeviceExtension->ReadQueue.QueueHead)) {
+        /* Nothing ahead of us, the buffered data may already be enough */
+        Now = CH341ReadNow();
+        CH341ReadStart(DeviceExtension, Irp, Now);
+        if (CH341ReadService(DeviceExtension, Irp, Now)) {
+            KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+            CH341FlowKick(DeviceExtension);
+            Status = Irp->IoStatus.Status;
+            CH341TraceCompleteIrp(DeviceExtension, Irp);
+            return Status;
+        }
+        /*
+         * It may already hold data, so it becomes the current read directly
+         * instead of passing through the queue, where a cancellation would
+         * complete it without that data.
+         */
+        IoMarkIrpPending(Irp);
+        InitializeListHead(&CompleteList);
+        if (CH341ReadSetCurrent(DeviceExtension, Irp, &CompleteList))
+            CH341ReadArmTimer(DeviceExtension, Now);
+        KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+        CH341ReadCompleteList(DeviceExtension, &CompleteList);
+        return STATUS_PENDING;
+    }
+    Status = CH341QueueIrp(DeviceObject, Irp);
+    if (!NT_SUCCESS(Status)) {
+        KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+        CH341Error(         "%s. CH341QueueIrp failed with %08lx\n",
+                            __FUNCTION__, Status);
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return Status;
+    }
+    /* Starts the timeouts if this became the current read */
+    InitializeListHead(&CompleteList);
+    CH341ReadProcess(DeviceExtension, &CompleteList);
+    KeReleaseSpinLock(&DeviceExtension->RxLock, OldIrql);
+    CH341ReadCompleteList(DeviceExtension, &CompleteList);
+    return STATUS_PENDING;
+}
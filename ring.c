@@ -0,0 +1,108 @@
+/*
+ * CH341 Driver ring buffer routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "ch341.h"
+
+/*
+ * Head and Tail are free-running byte counters. Size is a power of two, so
+ * Head - Tail is always the fill level and masking with Size - 1 yields the
+ * buffer offset. Callers provide their own synchronization.
+ */
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341RingInitialize)
+#pragma alloc_text(PAGE, CH341RingFree)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+CH341RingInitialize(
+    _Out_ PRING_BUFFER Ring,
+    _In_ ULONG Size) {
+    PAGED_CODE();
+    NT_ASSERT(Size != 0 && (Size & (Size - 1)) == 0);
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    Ring->Size = Size;
+    Ring->Buffer = ExAllocatePoolWithTag(NonPagedPool, Size, CH341_TAG);
+    if (!Ring->Buffer) {
+        CH341Error(         "%s. Allocating ring buffer of size %lu failed\n",
+                            __FUNCTION__, Size);
+        Ring->Size = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341RingFree(
+    _Inout_ PRING_BUFFER Ring) {
+    PAGED_CODE();
+    if (Ring->Buffer)
+        ExFreePoolWithTag(Ring->Buffer, CH341_TAG);
+    Ring->Buffer = NULL;
+    Ring->Size = 0;
+    Ring->Head = 0;
+    Ring->Tail = 0;
+}
+
+ULONG
+CH341RingWrite(
+    _Inout_ PRING_BUFFER Ring,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length) {
+    ULONG Offset;
+    ULONG Chunk;
+    Length = min(Length, Ring->Size - CH341RingCount(Ring));
+    if (!Length)
+        return 0;
+    Offset = Ring->Head & (Ring->Size - 1);
+    Chunk = min(Length, Ring->Size - Offset);
+    RtlCopyMemory(Ring->Buffer + Offset, Data, Chunk);
+    RtlCopyMemory(Ring->Buffer, Data + Chunk, Length - Chunk);
+    Ring->Head += Length;
+    return Length;
+}
+
+ULONG
+CH341RingRead(
+    _Inout_ PRING_BUFFER Ring,
+    _Out_writes_bytes_(Length) PUCHAR Data,
+    _In_ ULONG Length) {
+    ULONG Offset;
+    ULONG Chunk;
+    Length = min(Length, CH341RingCount(Ring));
+    if (!Length)
+        return 0;
+    Offset = Ring->Tail & (Ring->Size - 1);
+    Chunk = min(Length, Ring->Size - Offset);
+    RtlCopyMemory(Data, Ring->Buffer + Offset, Chunk);
+    RtlCopyMemory(Data + Chunk, Ring->Buffer, Length - Chunk);
+    Ring->Tail += Length;
+    return Length;
+}
+
+VOID
+CH341RingMove(
+    _Inout_ PRING_BUFFER Target,
+    _Inout_ PRING_BUFFER Source) {
+    /* Target is freshly initialized, so the data lands in one piece */
+    NT_ASSERT(Target->Head == 0 && Target->Tail == 0);
+    NT_ASSERT(Target->Size >= CH341RingCount(Source));
+    Target->Head = CH341RingRead(Source, Target->Buffer, CH341RingCount(Source));
+}
@@ -0,0 +1,89 @@
+/*
+ * CH341 Driver receive data scanner
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef CH341_USER_MODE
+#include "scan.h"
+#else
+#include "ch341.h"
+#endif
+
+#if defined(_M_AMD64)
+#include <emmintrin.h>
+#elif defined(_M_ARM64)
+#include <arm64_neon.h>
+#endif
+
+/*
+ * Returns the offset of the first byte equal to First, Second or Third, or
+ * Length if there is none; callers repeat a character to look for fewer.
+ * Received data is scanned in full at the line rate, so sixteen bytes at a
+ * time are compared with SSE2 on x64 and NEON on ARM64. The kernel does
+ * not need to save vector state around either.
+ */
+ULONG
+CH341FlowScan(
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ ULONG Length,
+    _In_ UCHAR First,
+    _In_ UCHAR Second,
+    _In_ UCHAR Third) {
+    ULONG Offset = 0;
+#if defined(_M_AMD64)
+    __m128i FirstMask = _mm_set1_epi8((char)First);
+    __m128i SecondMask = _mm_set1_epi8((char)Second);
+    __m128i ThirdMask = _mm_set1_epi8((char)Third);
+    __m128i Block;
+    ULONG Matches;
+    ULONG Index;
+    for (; Length - Offset >= sizeof(Block); Offset += sizeof(Block)) {
+        Block = _mm_loadu_si128((const __m128i *)(Data + Offset));
+        Matches = (ULONG)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(Block, FirstMask),
+                                           _mm_cmpeq_epi8(Block, SecondMask)),
+                                           _mm_cmpeq_epi8(Block, ThirdMask)));
+        if (Matches) {
+            _BitScanForward(&Index, Matches);
+            return Offset + Index;
+        }
+    }
+#elif defined(_M_ARM64)
+    uint8x16_t FirstMask = vdupq_n_u8(First);
+    uint8x16_t SecondMask = vdupq_n_u8(Second);
+    uint8x16_t ThirdMask = vdupq_n_u8(Third);
+    uint8x16_t Block;
+    ULONG64 Matches;
+    ULONG Index;
+    for (; Length - Offset >= sizeof(Block); Offset += sizeof(Block)) {
+        Block = vld1q_u8(Data + Offset);
+        Block = vorrq_u8(vorrq_u8(vceqq_u8(Block, FirstMask),
+                                  vceqq_u8(Block, SecondMask)),
+                         vceqq_u8(Block, ThirdMask));
+        /* There is no movemask; narrowing leaves four bits per byte instead */
+        Matches = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(Block), 4)), 0);
+        if (Matches) {
+            _BitScanForward64(&Index, Matches);
+            return Offset + Index / 4;
+        }
+    }
+#endif
+    for (; Offset < Length; Offset++) {
+        if (Data[Offset] == First || Data[Offset] == Second || Data[Offset] == Third)
+            break;
+    }
+    return Offset;
+}
@@ -0,0 +1,31 @@
+/*
+ * CH341 Driver receive data scanner declarations
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Kept apart from ch341.h so that tools/ch341flowscan.c can build scan.c
+ * in user mode.
+ */
+
+#pragma once
+
+ULONG CH341FlowScan(_In_reads_bytes_(Length) const UCHAR *Data,
+                    _In_ ULONG Length,
+                    _In_ UCHAR First,
+                    _In_ UCHAR Second,
+                    _In_ UCHAR Third);
@@ -0,0 +1,176 @@
+/*
+ * CH341 Driver statistics
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "ch341.h"
+
+/*
+ * Counters are kept per processor and only ever grow, so updating them needs
+ * neither a lock nor a shared cache line. Queries add up all slots. Clearing
+ * does not touch the slots either: it records the current totals as a
+ * baseline that later queries subtract, which makes it atomic with respect
+ * to queries without stopping the I/O path.
+ *
+ * The latency histograms are plain shared buckets, each sample is a single
+ * interlocked increment.
+ */
+
+#define CH341_STATS_COUNTERS (sizeof(CH341_STATS) / sizeof(ULONGLONG))
+
+C_ASSERT(sizeof(CH341_STATS) % sizeof(ULONGLONG) == 0);
+C_ASSERT(sizeof(CH341_STATS) <= CH341_STATS_SLOT_SIZE);
+
+static VOID CH341StatsSum(_In_ PDEVICE_EXTENSION DeviceExtension,
+                          _Out_ PCH341_STATS Stats);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341StatsAllocate)
+#pragma alloc_text(PAGE, CH341StatsFree)
+#endif /* defined ALLOC_PRAGMA */
+
+NTSTATUS
+CH341StatsAllocate(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Slots;
+    PAGED_CODE();
+    NT_ASSERT(!DeviceExtension->Stats);
+    KeInitializeSpinLock(&DeviceExtension->StatsLock);
+    RtlZeroMemory(&DeviceExtension->StatsBaseline, sizeof(DeviceExtension->StatsBaseline));
+    RtlZeroMemory((PVOID)DeviceExtension->Latency, sizeof(DeviceExtension->Latency));
+    (VOID)KeQueryPerformanceCounter(&DeviceExtension->PerformanceFrequency);
+    Slots = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    DeviceExtension->Stats = ExAllocatePoolWithTag(NonPagedPool,
+                             Slots * sizeof(STATS_SLOT),
+                             CH341_TAG);
+    if (!DeviceExtension->Stats) {
+        CH341Error(         "%s. Allocating statistics for %lu processors failed\n",
+                            __FUNCTION__, Slots);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(DeviceExtension->Stats, Slots * sizeof(STATS_SLOT));
+    DeviceExtension->StatsSlots = Slots;
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341StatsFree(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    if (!DeviceExtension->Stats)
+        return;
+    ExFreePoolWithTag(DeviceExtension->Stats, CH341_TAG);
+    DeviceExtension->Stats = NULL;
+    DeviceExtension->StatsSlots = 0;
+}
+
+static
+VOID
+CH341StatsSum(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Out_ PCH341_STATS Stats) {
+    PULONGLONG Total = (PULONGLONG)Stats;
+    const volatile ULONGLONG *Counters;
+    ULONG Slot;
+    ULONG i;
+    RtlZeroMemory(Stats, sizeof(*Stats));
+    for (Slot = 0; Slot < DeviceExtension->StatsSlots; Slot++) {
+        Counters = (const volatile ULONGLONG *)&DeviceExtension->Stats[Slot].Stats;
+        for (i = 0; i < CH341_STATS_COUNTERS; i++)
+            Total[i] += ReadULong64NoFence(&Counters[i]);
+    }
+}
+
+VOID
+CH341StatsQuery(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PCH341_STATS Stats) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PULONGLONG Total = (PULONGLONG)Stats;
+    const ULONGLONG *Baseline = (const ULONGLONG *)&DeviceExtension->StatsBaseline;
+    KIRQL OldIrql;
+    ULONG i;
+    if (!DeviceExtension->Stats) {
+        RtlZeroMemory(Stats, sizeof(*Stats));
+        return;
+    }
+    KeAcquireSpinLock(&DeviceExtension->StatsLock, &OldIrql);
+    CH341StatsSum(DeviceExtension, Stats);
+    for (i = 0; i < CH341_STATS_COUNTERS; i++)
+        Total[i] -= Baseline[i];
+    KeReleaseSpinLock(&DeviceExtension->StatsLock, OldIrql);
+}
+
+VOID
+CH341StatsClear(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    ULONG Histogram;
+    ULONG Bucket;
+    /* Not atomic as a whole, samples recorded meanwhile may survive */
+    for (Histogram = 0; Histogram < CH341_LATENCY_HISTOGRAMS; Histogram++)
+        for (Bucket = 0; Bucket < CH341_LATENCY_BUCKETS; Bucket++)
+            (VOID)InterlockedExchange(&DeviceExtension->Latency[Histogram][Bucket], 0);
+    if (!DeviceExtension->Stats)
+        return;
+    KeAcquireSpinLock(&DeviceExtension->StatsLock, &OldIrql);
+    CH341StatsSum(DeviceExtension, &DeviceExtension->StatsBaseline);
+    KeReleaseSpinLock(&DeviceExtension->StatsLock, OldIrql);
+}
+
+VOID
+CH341LatencyAdd(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG Histogram,
+    _In_ ULONGLONG Ticks) {
+    ULONGLONG Frequency = (ULONGLONG)DeviceExtension->PerformanceFrequency.QuadPart;
+    ULONGLONG Microseconds;
+    ULONG Clamped;
+    ULONG HighBit;
+    ULONG Bucket;
+    NT_ASSERT(Histogram < CH341_LATENCY_HISTOGRAMS);
+    if (!Frequency)
+        return;
+    Microseconds = Ticks * 1000000 / Frequency;
+    if (Microseconds < 4) {
+        Bucket = (ULONG)Microseconds;
+    } else {
+        /* The last bucket is reached long before 32 bits run out, and x86 has no _BitScanReverse64 */
+        Clamped = (ULONG)min(Microseconds, MAXULONG);
+        (VOID)_BitScanReverse(&HighBit, Clamped);
+        Bucket = 4 * (HighBit - 1) + ((Clamped >> (HighBit - 2)) & 3);
+    }
+    Bucket = min(Bucket, CH341_LATENCY_BUCKETS - 1);
+    (VOID)InterlockedIncrement(&DeviceExtension->Latency[Histogram][Bucket]);
+}
+
+VOID
+CH341LatencyQuery(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_ PCH341_LATENCY Latency) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Histogram;
+    ULONG Bucket;
+    Latency->Histograms = CH341_LATENCY_HISTOGRAMS;
+    Latency->Buckets = CH341_LATENCY_BUCKETS;
+    for (Histogram = 0; Histogram < CH341_LATENCY_HISTOGRAMS; Histogram++)
+        for (Bucket = 0; Bucket < CH341_LATENCY_BUCKETS; Bucket++)
+            Latency->Counts[Histogram][Bucket] = (ULONG)ReadNoFence(&DeviceExtension->Latency[Histogram][Bucket]);
+}
@@ -0,0 +1,375 @@
+/*
+ * CH341 Driver modem status and event routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_STATUS
+#include "ch341.h"
+
+/*
+ * One interrupt IN transfer is kept posted while the device is started. The
+ * CH341 sends a status packet on every modem line change, which modem.c
+ * decodes. The lines are cached in ModemStatus as SERIAL_MSR_* bits, so
+ * IOCTL_SERIAL_GET_MODEMSTATUS does not touch the bus, and line changes are
+ * reported as SERIAL_EV_* events.
+ *
+ * Events matching WaitMask accumulate in HistoryMask until a WAIT_ON_MASK
+ * IRP collects them. At most one such IRP is pending, as with serial.sys.
+ */
+
+#define CH341_VALID_WAIT_MASK (SERIAL_EV_RXCHAR | SERIAL_EV_RXFLAG | SERIAL_EV_TXEMPTY | \
+                               SERIAL_EV_CTS | SERIAL_EV_DSR | SERIAL_EV_RLSD | \
+                               SERIAL_EV_BREAK | SERIAL_EV_ERR | SERIAL_EV_RING | \
+                               SERIAL_EV_PERR | SERIAL_EV_RX80FULL | \
+                               SERIAL_EV_EVENT1 | SERIAL_EV_EVENT2)
+
+static VOID CH341SubmitStatus(_In_ PSTATUS_CONTEXT Context);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI CH341StatusCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+        _In_ PIRP Irp,
+        _In_reads_(sizeof(STATUS_CONTEXT)) PVOID Context);
+static VOID CH341UpdateModemStatus(_In_ PDEVICE_OBJECT DeviceObject,
+                                   _In_ ULONG ModemStatus);
+static DRIVER_CANCEL CH341WaitCancel;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341StartStatusPipe)
+#pragma alloc_text(PAGE, CH341StopStatusPipe)
+#endif /* defined ALLOC_PRAGMA */
+
+static
+VOID
+CH341UpdateModemStatus(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG ModemStatus) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Old;
+    ULONG Changed;
+    Old = (ULONG)InterlockedExchange(&DeviceExtension->ModemStatus, (LONG)ModemStatus);
+    Changed = Old ^ ModemStatus;
+    if (!Changed)
+        return;
+    CH341Debug(         "%s. ModemStatus=0x%02lx, Changed=0x%02lx\n",
+                        __FUNCTION__, ModemStatus, Changed);
+    CH341ReadInsertModemStatus(DeviceObject, CH341ModemStatusRegister(Old, ModemStatus));
+    CH341SignalEvents(DeviceObject, CH341ModemStatusEvents(Old, ModemStatus));
+    if (Changed & (SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_DCD))
+        CH341FlowUpdateHolds(DeviceExtension);
+}
+
+static
+VOID
+CH341SubmitStatus(
+    _In_ PSTATUS_CONTEXT Context) {
+    PDEVICE_EXTENSION DeviceExtension = Context->DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    IoReuseIrp(Context->Irp, STATUS_SUCCESS);
+    UsbBuildInterruptOrBulkTransferRequest((PURB)&Context->Urb,
+                                           sizeof(Context->Urb),
+                                           DeviceExtension->InterruptInPipe,
+                                           Context->Buffer,
+                                           NULL,
+                                           sizeof(Context->Buffer),
+                                           USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+                                           NULL);
+    IoStack = IoGetNextIrpStackLocation(Context->Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    IoStack->Parameters.Others.Argument1 = &Context->Urb;
+    IoSetCompletionRoutine(Context->Irp,
+                           CH341StatusCompletion,
+                           Context,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Context->Irp);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+CH341StatusCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(STATUS_CONTEXT)) PVOID Context) {
+    PSTATUS_CONTEXT StatusContext = Context;
+    PDEVICE_EXTENSION DeviceExtension = StatusContext->DeviceObject->DeviceExtension;
+    NTSTATUS Status = Irp->IoStatus.Status;
+    ULONG ModemStatus;
+    BOOLEAN Resubmit;
+    /* We allocated the IRP ourselves, so there is no stack location for us */
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    if (NT_SUCCESS(Status) && USBD_SUCCESS(StatusContext->Urb.Hdr.Status)) {
+        StatusContext->Errors = 0;
+        if (CH341DecodeStatusPacket(StatusContext->Buffer,
+                                    StatusContext->Urb.TransferBufferLength,
+                                    &ModemStatus))
+            CH341UpdateModemStatus(StatusContext->DeviceObject, ModemStatus);
+        Resubmit = TRUE;
+    } else {
+        CH341Warn(         "%s. Status read failed with %08lx, %08lx\n",
+                           __FUNCTION__, Status, StatusContext->Urb.Hdr.Status);
+        Resubmit = Status != STATUS_CANCELLED &&
+                   Status != STATUS_NO_SUCH_DEVICE &&
+                   Status != STATUS_DEVICE_NOT_CONNECTED &&
+                   ++StatusContext->Errors < CH341_MAX_STATUS_ERRORS;
+    }
+    /* See CH341ReadCompletion for how StatusSubmitting closes the race with the stopper */
+    InterlockedIncrement(&DeviceExtension->StatusSubmitting);
+    if (Resubmit && DeviceExtension->StatusPipeRunning) {
+        CH341SubmitStatus(StatusContext);
+        InterlockedDecrement(&DeviceExtension->StatusSubmitting);
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    }
+    InterlockedDecrement(&DeviceExtension->StatusSubmitting);
+    KeSetEvent(&DeviceExtension->StatusIdleEvent, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS
+CH341StartStatusPipe(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PSTATUS_CONTEXT Context;
+    UCHAR Lines;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    NT_ASSERT(!DeviceExtension->StatusContext);
+    /* Seed the cache, the device only reports changes */
+    Status = CH341UsbGetModemStatus(DeviceObject, &Lines);
+    if (NT_SUCCESS(Status)) {
+        CH341UpdateModemStatus(DeviceObject, CH341DecodeModemStatus(Lines));
+    } else {
+        CH341Warn(         "%s. CH341UsbGetModemStatus failed with %08lx\n",
+                           __FUNCTION__, Status);
+    }
+    Context = ExAllocatePoolWithTag(NonPagedPool,
+                                    sizeof(*Context),
+                                    CH341_URB_TAG);
+    if (!Context) {
+        CH341Error(         "%s. Allocating status context failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Context, sizeof(*Context));
+    Context->DeviceObject = DeviceObject;
+    Context->Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+    if (!Context->Irp) {
+        CH341Error(         "%s. Allocating status IRP failed\n",
+                            __FUNCTION__);
+        ExFreePoolWithTag(Context, CH341_URB_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    DeviceExtension->StatusContext = Context;
+    KeClearEvent(&DeviceExtension->StatusIdleEvent);
+    InterlockedExchange(&DeviceExtension->StatusPipeRunning, TRUE);
+    CH341SubmitStatus(Context);
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341StopStatusPipe(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LARGE_INTEGER Timeout;
+    LARGE_INTEGER Poll;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    if (!DeviceExtension->StatusContext)
+        return;
+    /* The transfer may be posted again after the abort, see CH341ReadAbort */
+    Timeout.QuadPart = -(LONGLONG)CH341_PIPE_DRAIN_TIMEOUT_MS * 10000;
+    Poll.QuadPart = -(LONGLONG)CH341_PIPE_DRAIN_POLL_US * 10;
+    InterlockedExchange(&DeviceExtension->StatusPipeRunning, FALSE);
+    for (;;) {
+        while (DeviceExtension->StatusSubmitting)
+            (VOID)KeDelayExecutionThread(KernelMode, FALSE, &Poll);
+        Status = CH341UsbAbortPipe(DeviceObject, DeviceExtension->InterruptInPipe);
+        if (!NT_SUCCESS(Status)) {
+            CH341Warn(         "%s. CH341UsbAbortPipe failed with %08lx\n",
+                               __FUNCTION__, Status);
+        }
+        (VOID)IoCancelIrp(DeviceExtension->StatusContext->Irp);
+        Status = KeWaitForSingleObject(&DeviceExtension->StatusIdleEvent,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       &Timeout);
+        if (Status == STATUS_SUCCESS)
+            break;
+        CH341Warn(         "%s. Status transfer still outstanding, aborting again\n",
+                           __FUNCTION__);
+    }
+    IoFreeIrp(DeviceExtension->StatusContext->Irp);
+    ExFreePoolWithTag(DeviceExtension->StatusContext, CH341_URB_TAG);
+    DeviceExtension->StatusContext = NULL;
+}
+
+VOID
+CH341SignalEvents(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Events) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    PIRP Irp = NULL;
+    /* Unlocked peek, so that unwatched events stay cheap on the data path */
+    if (!(Events & DeviceExtension->WaitMask))
+        return;
+    KeAcquireSpinLock(&DeviceExtension->EventLock, &OldIrql);
+    Events &= DeviceExtension->WaitMask;
+    DeviceExtension->HistoryMask |= Events;
+    if (DeviceExtension->HistoryMask && DeviceExtension->WaitIrp &&
+            IoSetCancelRoutine(DeviceExtension->WaitIrp, NULL)) {
+        Irp = DeviceExtension->WaitIrp;
+        DeviceExtension->WaitIrp = NULL;
+        *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->HistoryMask;
+        DeviceExtension->HistoryMask = 0;
+    }
+    KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+    if (Irp) {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = sizeof(ULONG);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+ULONG
+CH341GetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    return DeviceExtension->WaitMask;
+}
+
+NTSTATUS
+CH341SetWaitMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG WaitMask) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    PIRP Irp = NULL;
+    if (WaitMask & ~CH341_VALID_WAIT_MASK)
+        return STATUS_INVALID_PARAMETER;
+    KeAcquireSpinLock(&DeviceExtension->EventLock, &OldIrql);
+    DeviceExtension->WaitMask = WaitMask;
+    DeviceExtension->HistoryMask = 0;
+    /* A pending wait completes with no events when the mask changes */
+    if (DeviceExtension->WaitIrp &&
+            IoSetCancelRoutine(DeviceExtension->WaitIrp, NULL)) {
+        Irp = DeviceExtension->WaitIrp;
+        *(PULONG)Irp->AssociatedIrp.SystemBuffer = 0;
+    }
+    DeviceExtension->WaitIrp = NULL;
+    KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+    if (Irp) {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = sizeof(ULONG);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+NTAPI
+CH341WaitCancel(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+    KeAcquireSpinLock(&DeviceExtension->EventLock, &OldIrql);
+    if (DeviceExtension->WaitIrp == Irp)
+        DeviceExtension->WaitIrp = NULL;
+    KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS
+CH341WaitOnMask(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    KIRQL OldIrql;
+    if (IoStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG)) {
+        Status = STATUS_BUFFER_TOO_SMALL;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+    KeAcquireSpinLock(&DeviceExtension->EventLock, &OldIrql);
+    if (!DeviceExtension->WaitMask || DeviceExtension->WaitIrp) {
+        KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+        Status = STATUS_INVALID_PARAMETER;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+    if (DeviceExtension->HistoryMask) {
+        *(PULONG)Irp->AssociatedIrp.SystemBuffer = DeviceExtension->HistoryMask;
+        DeviceExtension->HistoryMask = 0;
+        KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+        Status = STATUS_SUCCESS;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = sizeof(ULONG);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+    IoMarkIrpPending(Irp);
+    (VOID)IoSetCancelRoutine(Irp, CH341WaitCancel);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL)) {
+        KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return STATUS_PENDING;
+    }
+    DeviceExtension->WaitIrp = Irp;
+    KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+    return STATUS_PENDING;
+}
+
+VOID
+CH341CancelWait(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    PIRP Irp = NULL;
+    KeAcquireSpinLock(&DeviceExtension->EventLock, &OldIrql);
+    if (DeviceExtension->WaitIrp &&
+            IoSetCancelRoutine(DeviceExtension->WaitIrp, NULL))
+        Irp = DeviceExtension->WaitIrp;
+    DeviceExtension->WaitIrp = NULL;
+    KeReleaseSpinLock(&DeviceExtension->EventLock, OldIrql);
+    if (Irp) {
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
@@ -0,0 +1,180 @@
+/*
+ * CH341 baud rate divisor check
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Builds the driver's baud.c in user mode and runs CH341ComputeBaudDivisor
+ * for every rate from 50 to 3000000 baud. For each rate the returned
+ * registers must be in range and give the reported rate and error, and the
+ * error must be within CH341_MAX_BAUD_ERROR_PPM. Rates that are refused
+ * must have no register setting within that bound. At every standard rate,
+ * which comes from the table, and at a sample of the others, an exhaustive
+ * search over all settings must not find a smaller error. Build with a
+ * plain
+ *     cl ch341baud.c
+ * from a developer command prompt and run it without arguments; it exits
+ * with 1 if any check fails.
+ */
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <stdio.h>
+
+typedef LONG NTSTATUS;
+#define NT_SUCCESS(Status) ((NTSTATUS)(Status) >= 0)
+
+#define CH341_USER_MODE
+#include "../baud.c"
+
+#define SWEEP_FIRST_RATE    50
+#define SWEEP_LAST_RATE     3000000
+#define SEARCH_SAMPLE       97
+
+typedef struct _SETTING {
+    ULONGLONG Multiple;     /* Clock divisor times divisor */
+    ULONGLONG Error;        /* |48 MHz - BaudRate * Multiple| */
+} SETTING;
+
+static ULONG Failures;
+
+static
+void
+Fail(
+    ULONG BaudRate,
+    const char *What) {
+    if (Failures++ < 20)
+        printf("%lu baud: %s\n", BaudRate, What);
+}
+
+static
+SETTING
+MakeSetting(
+    ULONG BaudRate,
+    ULONGLONG Multiple) {
+    SETTING Setting;
+    ULONGLONG Target = (ULONGLONG)BaudRate * Multiple;
+    Setting.Multiple = Multiple;
+    Setting.Error = Target > CH341_BAUD_CLOCK ? Target - CH341_BAUD_CLOCK :
+                    CH341_BAUD_CLOCK - Target;
+    return Setting;
+}
+
+/* The smallest relative error over every prescaler, factor and divisor */
+static
+SETTING
+BestSetting(
+    ULONG BaudRate) {
+    SETTING Best = { 0, 0 };
+    SETTING Setting;
+    ULONG Prescaler;
+    ULONG Factor;
+    ULONG Candidate;
+    for (Prescaler = 0; Prescaler < 4; Prescaler++) {
+        for (Factor = 0; Factor < 2; Factor++) {
+            for (Candidate = Factor ? 9 : 2; Candidate <= (Factor ? 255UL : 256UL); Candidate++) {
+                Setting = MakeSetting(BaudRate,
+                                      (ULONGLONG)CH341_CLOCK_DIVISOR(Prescaler, Factor) * Candidate);
+                if (!Best.Multiple || Setting.Error * Best.Multiple < Best.Error * Setting.Multiple)
+                    Best = Setting;
+            }
+        }
+    }
+    return Best;
+}
+
+static
+BOOL
+WithinBound(
+    ULONG BaudRate,
+    SETTING Setting) {
+    /* The driver measures the error relative to the requested rate */
+    return Setting.Error * 1000000 <= (ULONGLONG)CH341_MAX_BAUD_ERROR_PPM * BaudRate * Setting.Multiple;
+}
+
+/* Returns FALSE if the rate was refused */
+static
+BOOL
+CheckRate(
+    ULONG BaudRate,
+    BOOL Search) {
+    BAUD_DIVISOR Divisor;
+    NTSTATUS Status;
+    ULONG Prescaler;
+    ULONG Factor;
+    ULONG Candidate;
+    LONGLONG Target;
+    SETTING Setting;
+    SETTING Best;
+    Status = CH341ComputeBaudDivisor(BaudRate, &Divisor);
+    if (!NT_SUCCESS(Status)) {
+        if (WithinBound(BaudRate, BestSetting(BaudRate)))
+            Fail(BaudRate, "refused, but a setting within the bound exists");
+        return FALSE;
+    }
+    if (Divisor.Prescaler & ~0x7) {
+        Fail(BaudRate, "prescaler has bits outside the divisor");
+        return TRUE;
+    }
+    Prescaler = Divisor.Prescaler & 0x3;
+    Factor = Divisor.Prescaler >> 2 & 0x1;
+    Candidate = 0x100 - Divisor.Divisor;
+    if (Candidate < (Factor ? 9UL : 2UL) || Candidate > (Factor ? 255UL : 256UL)) {
+        Fail(BaudRate, "divisor out of range");
+        return TRUE;
+    }
+    Setting = MakeSetting(BaudRate, (ULONGLONG)CH341_CLOCK_DIVISOR(Prescaler, Factor) * Candidate);
+    if (Divisor.ActualRate != (ULONG)((CH341_BAUD_CLOCK + Setting.Multiple / 2) / Setting.Multiple))
+        Fail(BaudRate, "reported rate does not match the registers");
+    Target = (LONGLONG)BaudRate * (LONGLONG)Setting.Multiple;
+    if (Divisor.ErrorPpm != (LONG)((CH341_BAUD_CLOCK - Target) * 1000000 / Target))
+        Fail(BaudRate, "reported error does not match the registers");
+    if (!WithinBound(BaudRate, Setting))
+        Fail(BaudRate, "error exceeds the bound");
+    if (Search) {
+        Best = BestSetting(BaudRate);
+        if (Best.Error * Setting.Multiple < Setting.Error * Best.Multiple)
+            Fail(BaudRate, "a closer setting exists");
+    }
+    return TRUE;
+}
+
+int
+main(
+    void) {
+    BAUD_DIVISOR Divisor;
+    ULONG BaudRate;
+    ULONG Refused = 0;
+    ULONG i;
+    for (BaudRate = SWEEP_FIRST_RATE; BaudRate <= SWEEP_LAST_RATE; BaudRate++) {
+        if (!CheckRate(BaudRate, BaudRate % SEARCH_SAMPLE == 0))
+            Refused++;
+    }
+    for (i = 0; i < RTL_NUMBER_OF(BaudTable); i++)
+        (void)CheckRate(BaudTable[i].BaudRate, TRUE);
+    if (!NT_SUCCESS(CH341ComputeBaudDivisor(CH341_MIN_BAUD_RATE, &Divisor)))
+        Fail(CH341_MIN_BAUD_RATE, "minimum rate refused");
+    if (NT_SUCCESS(CH341ComputeBaudDivisor(CH341_MIN_BAUD_RATE - 1, &Divisor)))
+        Fail(CH341_MIN_BAUD_RATE - 1, "rate below the minimum accepted");
+    if (NT_SUCCESS(CH341ComputeBaudDivisor(CH341_MAX_BAUD_RATE + 1, &Divisor)))
+        Fail(CH341_MAX_BAUD_RATE + 1, "rate above the maximum accepted");
+    printf("%lu rates checked, %lu refused as out of bound, %lu failures\n",
+           SWEEP_LAST_RATE - SWEEP_FIRST_RATE + 1, Refused, Failures);
+    return Failures ? 1 : 0;
+}
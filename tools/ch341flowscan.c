@@ -0,0 +1,262 @@
+/*
+ * CH341 receive data scanner check and benchmark
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Builds the driver's scan.c in user mode and compares CH341FlowScan, which
+ * uses SSE2 on x64 and NEON on ARM64, with a plain byte loop:
+ *
+ * - on random buffers of random length and alignment, with characters
+ *   taken from a small alphabet so that matches are frequent,
+ * - for every length up to four vectors, with no match and with a single
+ *   match at each offset, so that every tail length is covered.
+ *
+ * It then times both on 1 MiB buffers: an EventChar scan with a single
+ * match at the end, and the XON/XOFF loop of CH341ReadReceive, which scans
+ * again after each flow character, with one flow character per 4 KiB.
+ * Build with a plain
+ *     cl /O2 ch341flowscan.c
+ * from a developer command prompt and run it without arguments; it exits
+ * with 1 if the two disagree.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CH341_USER_MODE
+#include "../scan.c"
+
+#define VECTOR_SIZE         16
+#define RANDOM_ROUNDS       1000000
+#define RANDOM_MAX_LENGTH   200
+#define BENCH_SIZE          (1024 * 1024)
+#define BENCH_ROUNDS        200
+#define BENCH_FLOW_SPACING  4096
+#define XON                 0x11
+#define XOFF                0x13
+
+typedef ULONG SCAN_ROUTINE(const UCHAR *Data, ULONG Length, UCHAR First, UCHAR Second, UCHAR Third);
+
+static UCHAR Buffer[BENCH_SIZE + VECTOR_SIZE];
+static ULONG Failures;
+static ULONG Seed = 0x12345678;
+
+/* xorshift32, so that runs are repeatable */
+static
+ULONG
+Random(
+    void) {
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+static
+ULONG
+ScanReference(
+    const UCHAR *Data,
+    ULONG Length,
+    UCHAR First,
+    UCHAR Second,
+    UCHAR Third) {
+    ULONG Offset;
+    for (Offset = 0; Offset < Length; Offset++) {
+        if (Data[Offset] == First || Data[Offset] == Second || Data[Offset] == Third)
+            break;
+    }
+    return Offset;
+}
+
+static
+void
+Compare(
+    const UCHAR *Data,
+    ULONG Length,
+    UCHAR First,
+    UCHAR Second,
+    UCHAR Third) {
+    ULONG Expected = ScanReference(Data, Length, First, Second, Third);
+    ULONG Actual = CH341FlowScan(Data, Length, First, Second, Third);
+    if (Actual != Expected && Failures++ < 20) {
+        printf("Length %lu, alignment %lu, characters 0x%02x 0x%02x 0x%02x: "
+               "got %lu, expected %lu\n",
+               Length, (ULONG)((ULONG_PTR)Data % VECTOR_SIZE),
+               First, Second, Third, Actual, Expected);
+    }
+}
+
+static
+void
+CheckRandom(
+    void) {
+    ULONG Round;
+    ULONG Length;
+    ULONG Alignment;
+    ULONG Alphabet;
+    ULONG i;
+    UCHAR Chars[3];
+    for (Round = 0; Round < RANDOM_ROUNDS; Round++) {
+        Length = Random() % (RANDOM_MAX_LENGTH + 1);
+        Alignment = Random() % VECTOR_SIZE;
+        /* Small alphabets match often, large ones rarely */
+        Alphabet = 2 + Random() % 255;
+        for (i = 0; i < Length; i++)
+            Buffer[Alignment + i] = (UCHAR)(0x80 + Random() % Alphabet);
+        for (i = 0; i < 3; i++)
+            Chars[i] = (UCHAR)(0x80 + Random() % Alphabet);
+        /* Also look for one or two characters, as the driver does */
+        switch (Round % 3) {
+        case 1:
+            Chars[2] = Chars[1] = Chars[0];
+            break;
+        case 2:
+            Chars[2] = Chars[0];
+            break;
+        }
+        Compare(Buffer + Alignment, Length, Chars[0], Chars[1], Chars[2]);
+    }
+}
+
+static
+void
+CheckTails(
+    void) {
+    ULONG Length;
+    ULONG Alignment;
+    ULONG Offset;
+    for (Alignment = 0; Alignment < VECTOR_SIZE; Alignment++) {
+        for (Length = 0; Length <= 4 * VECTOR_SIZE; Length++) {
+            memset(Buffer, 'a', Alignment + Length + VECTOR_SIZE);
+            Compare(Buffer + Alignment, Length, 'x', 'y', 'z');
+            /* A match just past the end must not be found */
+            Buffer[Alignment + Length] = 'x';
+            Compare(Buffer + Alignment, Length, 'x', 'y', 'z');
+            Buffer[Alignment + Length] = 'a';
+            for (Offset = 0; Offset < Length; Offset++) {
+                Buffer[Alignment + Offset] = "xyz"[Offset % 3];
+                Compare(Buffer + Alignment, Length, 'x', 'y', 'z');
+                Buffer[Alignment + Offset] = 'a';
+            }
+        }
+    }
+}
+
+/* Counts the flow characters the way CH341ReadReceive finds them */
+static
+ULONG
+ScanFlow(
+    SCAN_ROUTINE *Scan,
+    const UCHAR *Data,
+    ULONG Length) {
+    ULONG Chunk;
+    ULONG Found = 0;
+    while ((Chunk = Scan(Data, Length, XON, XOFF, XON)) < Length) {
+        Found++;
+        Data += Chunk + 1;
+        Length -= Chunk + 1;
+    }
+    return Found;
+}
+
+static
+double
+Throughput(
+    LONGLONG Ticks,
+    LONGLONG Frequency) {
+    return (double)BENCH_SIZE * BENCH_ROUNDS / (1024 * 1024) * Frequency / (Ticks ? Ticks : 1);
+}
+
+static
+void
+Benchmark(
+    void) {
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Start;
+    LARGE_INTEGER End;
+    LONGLONG VectorTicks;
+    LONGLONG ScalarTicks;
+    volatile ULONG Sink = 0;
+    ULONG Round;
+    ULONG i;
+    for (i = 0; i < BENCH_SIZE; i++)
+        Buffer[i] = (UCHAR)Random();
+    /* EventChar only shows up at the very end, so the whole buffer is read */
+    for (i = 0; i < BENCH_SIZE; i++) {
+        if (Buffer[i] == '\n')
+            Buffer[i] = ' ';
+    }
+    Buffer[BENCH_SIZE - 1] = '\n';
+    Compare(Buffer, BENCH_SIZE, '\n', '\n', '\n');
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (Round = 0; Round < BENCH_ROUNDS; Round++)
+        Sink += CH341FlowScan(Buffer, BENCH_SIZE, '\n', '\n', '\n');
+    QueryPerformanceCounter(&End);
+    VectorTicks = End.QuadPart - Start.QuadPart;
+    QueryPerformanceCounter(&Start);
+    for (Round = 0; Round < BENCH_ROUNDS; Round++)
+        Sink += ScanReference(Buffer, BENCH_SIZE, '\n', '\n', '\n');
+    QueryPerformanceCounter(&End);
+    ScalarTicks = End.QuadPart - Start.QuadPart;
+    printf("EventChar scan of 1 MiB: CH341FlowScan %.0f MiB/s, byte loop %.0f MiB/s, %.1fx\n",
+           Throughput(VectorTicks, Frequency.QuadPart),
+           Throughput(ScalarTicks, Frequency.QuadPart),
+           (double)ScalarTicks / (VectorTicks ? VectorTicks : 1));
+    for (i = 0; i < BENCH_SIZE; i++) {
+        if (Buffer[i] == XON || Buffer[i] == XOFF)
+            Buffer[i] = ' ';
+    }
+    for (i = Random() % BENCH_FLOW_SPACING; i < BENCH_SIZE; i += BENCH_FLOW_SPACING)
+        Buffer[i] = Random() % 2 ? XON : XOFF;
+    if (ScanFlow(CH341FlowScan, Buffer, BENCH_SIZE) != ScanFlow(ScanReference, Buffer, BENCH_SIZE) &&
+            Failures++ < 20)
+        printf("XON/XOFF counts differ\n");
+    QueryPerformanceCounter(&Start);
+    for (Round = 0; Round < BENCH_ROUNDS; Round++)
+        Sink += ScanFlow(CH341FlowScan, Buffer, BENCH_SIZE);
+    QueryPerformanceCounter(&End);
+    VectorTicks = End.QuadPart - Start.QuadPart;
+    QueryPerformanceCounter(&Start);
+    for (Round = 0; Round < BENCH_ROUNDS; Round++)
+        Sink += ScanFlow(ScanReference, Buffer, BENCH_SIZE);
+    QueryPerformanceCounter(&End);
+    ScalarTicks = End.QuadPart - Start.QuadPart;
+    printf("XON/XOFF scan of 1 MiB:  CH341FlowScan %.0f MiB/s, byte loop %.0f MiB/s, %.1fx\n",
+           Throughput(VectorTicks, Frequency.QuadPart),
+           Throughput(ScalarTicks, Frequency.QuadPart),
+           (double)ScalarTicks / (VectorTicks ? VectorTicks : 1));
+}
+
+int
+main(
+    void) {
+#if defined(_M_AMD64)
+    printf("Vector path: SSE2\n");
+#elif defined(_M_ARM64)
+    printf("Vector path: NEON\n");
+#else
+    printf("Vector path: none, CH341FlowScan is a byte loop on this target\n");
+#endif
+    CheckRandom();
+    CheckTails();
+    Benchmark();
+    printf("%lu mismatches\n", Failures);
+    return Failures ? 1 : 0;
+}
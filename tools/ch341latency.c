@@ -0,0 +1,133 @@
+/*
+ * CH341 latency histogram dump
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Reads the latency histograms of a CH341 port through
+ * IOCTL_CH341_GET_LATENCY and prints p50/p99/p999 for each. Percentiles are
+ * reported as the upper bound of the bucket they fall into. Build with a plain
+ *     cl ch341latency.c
+ * from a developer command prompt, then run e.g. "ch341latency COM5".
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+
+#include "../ch341ioctl.h"
+
+static const char *HistogramNames[CH341_LATENCY_HISTOGRAMS] = {
+    "Write dispatch to submit",
+    "Bulk IN submit to complete",
+    "Bulk OUT submit to complete",
+    "Control submit to complete",
+    "Read IRP lifetime",
+    "Write IRP lifetime",
+};
+
+/* Exclusive upper bound of a bucket, in microseconds */
+static
+ULONGLONG
+BucketLimit(
+    ULONG Bucket) {
+    if (Bucket < 4)
+        return Bucket + 1;
+    return (ULONGLONG)(5 + Bucket % 4) << (Bucket / 4 - 1);
+}
+
+static
+void
+PrintPercentile(
+    const char *Name,
+    const ULONG *Counts,
+    ULONGLONG Total,
+    ULONG PerTenThousand) {
+    ULONGLONG Rank = (Total * PerTenThousand + 9999) / 10000;
+    ULONGLONG Seen = 0;
+    ULONG Bucket;
+    for (Bucket = 0; Bucket < CH341_LATENCY_BUCKETS - 1; Bucket++) {
+        Seen += Counts[Bucket];
+        if (Seen >= Rank)
+            break;
+    }
+    if (Bucket == CH341_LATENCY_BUCKETS - 1)
+        printf("  %s >= %I64u us", Name, BucketLimit(Bucket - 1));
+    else
+        printf("  %s < %I64u us", Name, BucketLimit(Bucket));
+}
+
+int
+main(
+    int argc,
+    char **argv) {
+    char Path[MAX_PATH];
+    HANDLE Port;
+    CH341_LATENCY Latency;
+    DWORD Returned;
+    ULONGLONG Total;
+    ULONG Histogram;
+    ULONG Bucket;
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s COMn\n", argv[0]);
+        return 1;
+    }
+    _snprintf_s(Path, sizeof(Path), _TRUNCATE, "\\\\.\\%s", argv[1]);
+    Port = CreateFileA(Path,
+                       GENERIC_READ | GENERIC_WRITE,
+                       0,
+                       NULL,
+                       OPEN_EXISTING,
+                       0,
+                       NULL);
+    if (Port == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Opening %s failed with %lu\n", Path, GetLastError());
+        return 1;
+    }
+    if (!DeviceIoControl(Port,
+                         IOCTL_CH341_GET_LATENCY,
+                         NULL,
+                         0,
+                         &Latency,
+                         sizeof(Latency),
+                         &Returned,
+                         NULL)) {
+        fprintf(stderr, "IOCTL_CH341_GET_LATENCY failed with %lu\n", GetLastError());
+        CloseHandle(Port);
+        return 1;
+    }
+    CloseHandle(Port);
+    if (Returned != sizeof(Latency) ||
+            Latency.Histograms != CH341_LATENCY_HISTOGRAMS ||
+            Latency.Buckets != CH341_LATENCY_BUCKETS) {
+        fprintf(stderr, "Unsupported histogram format\n");
+        return 1;
+    }
+    for (Histogram = 0; Histogram < CH341_LATENCY_HISTOGRAMS; Histogram++) {
+        Total = 0;
+        for (Bucket = 0; Bucket < CH341_LATENCY_BUCKETS; Bucket++)
+            Total += Latency.Counts[Histogram][Bucket];
+        printf("%-28s %10I64u samples", HistogramNames[Histogram], Total);
+        if (Total) {
+            PrintPercentile("p50", Latency.Counts[Histogram], Total, 5000);
+            PrintPercentile("p99", Latency.Counts[Histogram], Total, 9900);
+            PrintPercentile("p999", Latency.Counts[Histogram], Total, 9990);
+        }
+        printf("\n");
+    }
+    return 0;
+}
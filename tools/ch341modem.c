@@ -0,0 +1,163 @@
+/*
+ * CH341 modem status packet replay
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Builds the driver's modem.c in user mode and replays status packets
+ * through it the way CH341StatusCompletion and CH341UpdateModemStatus do,
+ * starting from all lines off. Without arguments, it replays the built-in
+ * sequence below and checks the cached lines, the events and the modem
+ * status register byte after every packet. Given a file with one packet
+ * per line in hex, e.g. "e4 00 fe ee 00 00 00 00", it replays those and
+ * prints what the driver would report. Build with a plain
+ *     cl ch341modem.c
+ * from a developer command prompt; it exits with 1 if any check fails.
+ */
+
+#include <windows.h>
+#include <ntddser.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CH341_USER_MODE
+#include "../modem.c"
+
+typedef struct _REPLAY_STEP {
+    const char *Name;
+    ULONG Length;
+    UCHAR Packet[CH341_STATUS_PACKET_SIZE];
+    ULONG ModemStatus;      /* SERIAL_MSR_* lines after the packet */
+    ULONG Events;           /* SERIAL_EV_* signalled, 0 if nothing changed */
+    UCHAR Register;         /* Byte inserted into the receive data, if changed */
+} REPLAY_STEP;
+
+/* The third byte holds the lines inverted: 0xfe is CTS, 0xfd DSR, 0xfb RI, 0xf7 DCD */
+static const REPLAY_STEP Steps[] = {
+    { "all lines off",          8, { 0xe4, 0x00, 0xff, 0xee }, 0x00, 0, 0 },
+    { "CTS on",                 8, { 0xe4, 0x00, 0xfe, 0xee }, 0x10, SERIAL_EV_CTS, 0x11 },
+    { "CTS on again",           8, { 0xe4, 0x00, 0xfe, 0xee }, 0x10, 0, 0 },
+    { "DSR on",                 8, { 0xe4, 0x00, 0xfc, 0xee }, 0x30, SERIAL_EV_DSR, 0x32 },
+    { "CTS and DSR off",        8, { 0xe4, 0x00, 0xff, 0xee }, 0x00, SERIAL_EV_CTS | SERIAL_EV_DSR, 0x03 },
+    /* TERI is only set on the trailing edge of RI */
+    { "RI on",                  8, { 0xe4, 0x00, 0xfb, 0xee }, 0x40, SERIAL_EV_RING, 0x40 },
+    { "RI off",                 8, { 0xe4, 0x00, 0xff, 0xee }, 0x00, SERIAL_EV_RING, 0x04 },
+    { "DCD on",                 8, { 0xe4, 0x00, 0xf7, 0xee }, 0x80, SERIAL_EV_RLSD, 0x88 },
+    { "short packet ignored",   3, { 0xe4, 0x00, 0xf0 },       0x80, 0, 0 },
+    { "empty packet ignored",   0, { 0 },                      0x80, 0, 0 },
+    { "all lines on, 4 bytes",  4, { 0xe4, 0x00, 0xf0, 0xee }, 0xf0,
+      SERIAL_EV_CTS | SERIAL_EV_DSR | SERIAL_EV_RING, 0xf3 },
+    { "upper bits ignored",     8, { 0xe4, 0x00, 0x00, 0xee }, 0xf0, 0, 0 },
+    { "DCD off",                8, { 0xe4, 0x00, 0xf8, 0xee }, 0x70, SERIAL_EV_RLSD, 0x78 },
+};
+
+/* What CH341UpdateModemStatus does with a decoded packet */
+static
+BOOL
+Replay(
+    const UCHAR *Packet,
+    ULONG Length,
+    PULONG ModemStatus,
+    PULONG Events,
+    PUCHAR Register) {
+    ULONG New;
+    *Events = 0;
+    *Register = 0;
+    if (!CH341DecodeStatusPacket(Packet, Length, &New) || New == *ModemStatus)
+        return FALSE;
+    *Events = CH341ModemStatusEvents(*ModemStatus, New);
+    *Register = CH341ModemStatusRegister(*ModemStatus, New);
+    *ModemStatus = New;
+    return TRUE;
+}
+
+static
+ULONG
+ReplayBuiltIn(
+    void) {
+    ULONG Failures = 0;
+    ULONG ModemStatus = 0;
+    ULONG Events;
+    UCHAR Register;
+    ULONG i;
+    for (i = 0; i < RTL_NUMBER_OF(Steps); i++) {
+        (void)Replay(Steps[i].Packet, Steps[i].Length, &ModemStatus, &Events, &Register);
+        if (ModemStatus != Steps[i].ModemStatus ||
+                Events != Steps[i].Events ||
+                Register != Steps[i].Register) {
+            printf("%s: lines 0x%02lx, events 0x%04lx, register 0x%02x; "
+                   "expected 0x%02lx, 0x%04lx, 0x%02x\n",
+                   Steps[i].Name, ModemStatus, Events, Register,
+                   Steps[i].ModemStatus, Steps[i].Events, Steps[i].Register);
+            Failures++;
+        }
+    }
+    printf("%lu packets replayed, %lu failures\n", (ULONG)RTL_NUMBER_OF(Steps), Failures);
+    return Failures;
+}
+
+static
+BOOL
+ReplayFile(
+    const char *FileName) {
+    UCHAR Packet[64];
+    char Line[512];
+    char *Cursor;
+    char *End;
+    ULONG ModemStatus = 0;
+    ULONG Length;
+    ULONG Number = 0;
+    ULONG Events;
+    UCHAR Register;
+    FILE *File;
+    if (fopen_s(&File, FileName, "r") != 0) {
+        fprintf(stderr, "Cannot open %s\n", FileName);
+        return FALSE;
+    }
+    while (fgets(Line, sizeof(Line), File)) {
+        Number++;
+        Length = 0;
+        for (Cursor = Line; Length < sizeof(Packet); Cursor = End) {
+            Packet[Length] = (UCHAR)strtoul(Cursor, &End, 16);
+            if (End == Cursor)
+                break;
+            Length++;
+        }
+        if (Replay(Packet, Length, &ModemStatus, &Events, &Register))
+            printf("%lu: lines 0x%02lx, events 0x%04lx, register 0x%02x\n",
+                   Number, ModemStatus, Events, Register);
+        else if (Length < CH341_STATUS_PACKET_MIN)
+            printf("%lu: %lu bytes, ignored\n", Number, Length);
+        else
+            printf("%lu: no change\n", Number);
+    }
+    fclose(File);
+    return TRUE;
+}
+
+int
+main(
+    int argc,
+    char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [packet file]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2)
+        return ReplayFile(argv[1]) ? 0 : 1;
+    return ReplayBuiltIn() ? 1 : 0;
+}
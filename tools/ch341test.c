@@ -0,0 +1,1418 @@
+/*
+ * CH341 loopback tests
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Drives a CH341 port through the standard serial requests and the
+ * IOCTL_CH341_* ones, and checks what comes back. The port needs a
+ * loopback plug: TXD to RXD, and for the modem line tests RTS to CTS and
+ * DTR to DSR. Each test opens the port itself. Build with a plain
+ *     cl ch341test.c
+ * from a developer command prompt, then run e.g. "ch341test COM5 stream",
+ * or leave out the test name to run all of them. It exits with 1 if any
+ * test fails.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ch341ioctl.h"
+
+typedef BOOL TEST_ROUTINE(const char *PortName);
+
+typedef struct _TEST {
+    const char *Name;
+    const char *Wiring;
+    TEST_ROUTINE *Routine;
+} TEST;
+
+static LARGE_INTEGER Frequency;
+static ULONG Seed = 0x12345678;
+
+/* xorshift32, so that runs are repeatable */
+static
+ULONG
+Random(
+    void) {
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+static
+ULONGLONG
+Microseconds(
+    void) {
+    LARGE_INTEGER Counter;
+    QueryPerformanceCounter(&Counter);
+    return (ULONGLONG)Counter.QuadPart * 1000000 / (ULONGLONG)Frequency.QuadPart;
+}
+
+static
+HANDLE
+OpenPort(
+    const char *PortName,
+    DWORD BaudRate) {
+    char Path[MAX_PATH];
+    HANDLE Port;
+    DCB Dcb;
+    _snprintf_s(Path, sizeof(Path), _TRUNCATE, "\\\\.\\%s", PortName);
+    Port = CreateFileA(Path,
+                       GENERIC_READ | GENERIC_WRITE,
+                       0,
+                       NULL,
+                       OPEN_EXISTING,
+                       FILE_FLAG_OVERLAPPED,
+                       NULL);
+    if (Port == INVALID_HANDLE_VALUE) {
+        printf("  Opening %s failed with %lu\n", Path, GetLastError());
+        return NULL;
+    }
+    memset(&Dcb, 0, sizeof(Dcb));
+    Dcb.DCBlength = sizeof(Dcb);
+    Dcb.BaudRate = BaudRate;
+    Dcb.fBinary = TRUE;
+    Dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    Dcb.fRtsControl = RTS_CONTROL_ENABLE;
+    Dcb.ByteSize = 8;
+    Dcb.Parity = NOPARITY;
+    Dcb.StopBits = ONESTOPBIT;
+    Dcb.XonChar = 0x11;
+    Dcb.XoffChar = 0x13;
+    if (!SetCommState(Port, &Dcb) ||
+            !PurgeComm(Port, PURGE_TXABORT | PURGE_RXABORT | PURGE_TXCLEAR | PURGE_RXCLEAR)) {
+        printf("  Setting up %s failed with %lu\n", Path, GetLastError());
+        CloseHandle(Port);
+        return NULL;
+    }
+    return Port;
+}
+
+static
+BOOL
+SetTimeouts(
+    HANDLE Port,
+    DWORD Interval,
+    DWORD Multiplier,
+    DWORD Constant) {
+    COMMTIMEOUTS Timeouts;
+    memset(&Timeouts, 0, sizeof(Timeouts));
+    Timeouts.ReadIntervalTimeout = Interval;
+    Timeouts.ReadTotalTimeoutMultiplier = Multiplier;
+    Timeouts.ReadTotalTimeoutConstant = Constant;
+    if (!SetCommTimeouts(Port, &Timeouts)) {
+        printf("  SetCommTimeouts failed with %lu\n", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Reads or writes and waits for the result; Done and the last error are valid on failure too */
+static
+BOOL
+Transfer(
+    HANDLE Port,
+    BOOL Write,
+    PVOID Buffer,
+    DWORD Length,
+    PDWORD Done) {
+    OVERLAPPED Overlapped;
+    DWORD Error;
+    BOOL Success;
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    *Done = 0;
+    if (!Overlapped.hEvent)
+        return FALSE;
+    if (Write)
+        Success = WriteFile(Port, Buffer, Length, NULL, &Overlapped);
+    else
+        Success = ReadFile(Port, Buffer, Length, NULL, &Overlapped);
+    if (Success || GetLastError() == ERROR_IO_PENDING)
+        Success = GetOverlappedResult(Port, &Overlapped, Done, TRUE);
+    Error = GetLastError();
+    CloseHandle(Overlapped.hEvent);
+    SetLastError(Error);
+    return Success;
+}
+
+static
+BOOL
+Control(
+    HANDLE Port,
+    DWORD IoControlCode,
+    PVOID Input,
+    DWORD InputLength,
+    PVOID Output,
+    DWORD OutputLength) {
+    OVERLAPPED Overlapped;
+    DWORD Returned;
+    DWORD Error;
+    BOOL Success;
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+        return FALSE;
+    Success = DeviceIoControl(Port,
+                              IoControlCode,
+                              Input,
+                              InputLength,
+                              Output,
+                              OutputLength,
+                              NULL,
+                              &Overlapped);
+    if (Success || GetLastError() == ERROR_IO_PENDING)
+        Success = GetOverlappedResult(Port, &Overlapped, &Returned, TRUE);
+    Error = GetLastError();
+    CloseHandle(Overlapped.hEvent);
+    SetLastError(Error);
+    return Success;
+}
+
+static
+BOOL
+GetStats(
+    HANDLE Port,
+    PCH341_STATS Stats) {
+    if (!Control(Port, IOCTL_CH341_GET_STATS, NULL, 0, Stats, sizeof(*Stats))) {
+        printf("  IOCTL_CH341_GET_STATS failed with %lu\n", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static
+int
+CompareTimes(
+    const void *First,
+    const void *Second) {
+    ULONGLONG A = *(const ULONGLONG *)First;
+    ULONGLONG B = *(const ULONGLONG *)Second;
+    return A < B ? -1 : A > B;
+}
+
+/* Sorts Times and prints the minimum, median, p99 and maximum */
+static
+void
+PrintTimes(
+    const char *Name,
+    ULONGLONG *Times,
+    ULONG Count) {
+    qsort(Times, Count, sizeof(*Times), CompareTimes);
+    printf("  %s: min %I64u us, p50 %I64u us, p99 %I64u us, max %I64u us\n",
+           Name, Times[0], Times[Count / 2], Times[(ULONGLONG)Count * 99 / 100],
+           Times[Count - 1]);
+}
+
+/* Data that shows where a byte went missing or came twice */
+static
+UCHAR
+Pattern(
+    ULONGLONG Offset) {
+    return (UCHAR)(Offset ^ Offset >> 8 ^ Offset >> 16);
+}
+
+/* Compares Length received bytes with the pattern, Received bytes in */
+static
+BOOL
+CheckPattern(
+    const UCHAR *Data,
+    DWORD Length,
+    ULONGLONG Received) {
+    DWORD i;
+    for (i = 0; i < Length; i++) {
+        if (Data[i] != Pattern(Received + i)) {
+            printf("  Byte %I64u is 0x%02x, expected 0x%02x\n",
+                   Received + i, Data[i], Pattern(Received + i));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Streams the pattern at line rate in both directions of the loopback for
+ * STREAM_SECONDS while the reader drains it, then reports throughput and
+ * bytes lost. With the read pump, nothing may be lost even though the
+ * reader only has one request outstanding at a time.
+ */
+#define STREAM_BAUD_RATE    921600
+#define STREAM_SECONDS      10
+#define STREAM_CHUNK        4096
+
+typedef struct _STREAM {
+    HANDLE Port;
+    ULONGLONG Sent;
+    BOOL Failed;
+} STREAM;
+
+static
+DWORD
+WINAPI
+StreamWriter(
+    PVOID Context) {
+    STREAM *Stream = Context;
+    UCHAR Buffer[STREAM_CHUNK];
+    ULONGLONG End = Microseconds() + STREAM_SECONDS * 1000000ULL;
+    DWORD Done;
+    DWORD i;
+    while (Microseconds() < End) {
+        for (i = 0; i < sizeof(Buffer); i++)
+            Buffer[i] = Pattern(Stream->Sent + i);
+        if (!Transfer(Stream->Port, TRUE, Buffer, sizeof(Buffer), &Done)) {
+            printf("  Write failed with %lu\n", GetLastError());
+            Stream->Failed = TRUE;
+        }
+        Stream->Sent += Done;
+        if (Stream->Failed)
+            break;
+    }
+    return 0;
+}
+
+static
+BOOL
+TestStream(
+    const char *PortName) {
+    STREAM Stream;
+    HANDLE Thread;
+    UCHAR Buffer[STREAM_CHUNK];
+    CH341_STATS Before;
+    CH341_STATS After;
+    ULONGLONG Received = 0;
+    ULONGLONG Start;
+    ULONGLONG Elapsed;
+    BOOL Success = TRUE;
+    DWORD Done;
+    memset(&Stream, 0, sizeof(Stream));
+    Stream.Port = OpenPort(PortName, STREAM_BAUD_RATE);
+    if (!Stream.Port)
+        return FALSE;
+    /* Return once a chunk is full, or 100 ms after the data stops */
+    if (!SetTimeouts(Stream.Port, 100, 0, 1000) || !GetStats(Stream.Port, &Before)) {
+        CloseHandle(Stream.Port);
+        return FALSE;
+    }
+    Start = Microseconds();
+    Thread = CreateThread(NULL, 0, StreamWriter, &Stream, 0, NULL);
+    if (!Thread) {
+        printf("  CreateThread failed with %lu\n", GetLastError());
+        CloseHandle(Stream.Port);
+        return FALSE;
+    }
+    for (;;) {
+        if (!Transfer(Stream.Port, FALSE, Buffer, sizeof(Buffer), &Done)) {
+            printf("  Read failed with %lu\n", GetLastError());
+            Success = FALSE;
+            break;
+        }
+        if (Success && !CheckPattern(Buffer, Done, Received))
+            Success = FALSE;
+        Received += Done;
+        if (!Done && WaitForSingleObject(Thread, 0) == WAIT_OBJECT_0)
+            break;
+    }
+    Elapsed = Microseconds() - Start;
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+    if (!GetStats(Stream.Port, &After))
+        Success = FALSE;
+    CloseHandle(Stream.Port);
+    printf("  %I64u bytes sent, %I64u received, %I64d lost, %I64u dropped by the driver\n",
+           Stream.Sent, Received, (LONGLONG)(Stream.Sent - Received),
+           After.BufferOverruns - Before.BufferOverruns);
+    printf("  %.0f bytes/s, %.1f%% of the line rate\n",
+           Received * 1e6 / Elapsed,
+           Received * 1e6 / Elapsed * 10 * 100 / STREAM_BAUD_RATE);
+    return Success && !Stream.Failed && Received == Stream.Sent;
+}
+
+/*
+ * Times CONTROL_ROUNDS DTR changes, each a control transfer that goes
+ * through the reused IRP, from the request to its completion. The driver's
+ * own view of the same transfers is the control histogram of
+ * ch341latency.
+ */
+#define CONTROL_ROUNDS      2000
+
+static
+BOOL
+TestControl(
+    const char *PortName) {
+    static ULONGLONG Times[CONTROL_ROUNDS];
+    CH341_STATS Before;
+    CH341_STATS After;
+    ULONGLONG Start;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    ULONG Round;
+    Port = OpenPort(PortName, 115200);
+    if (!Port)
+        return FALSE;
+    if (!GetStats(Port, &Before)) {
+        CloseHandle(Port);
+        return FALSE;
+    }
+    for (Round = 0; Round < CONTROL_ROUNDS; Round++) {
+        Start = Microseconds();
+        if (!Control(Port, Round % 2 ? IOCTL_SERIAL_SET_DTR : IOCTL_SERIAL_CLR_DTR,
+                     NULL, 0, NULL, 0)) {
+            printf("  DTR change %lu failed with %lu\n", Round, GetLastError());
+            Success = FALSE;
+            break;
+        }
+        Times[Round] = Microseconds() - Start;
+    }
+    if (!GetStats(Port, &After))
+        Success = FALSE;
+    CloseHandle(Port);
+    if (!Success)
+        return FALSE;
+    PrintTimes("DTR round trip", Times, CONTROL_ROUNDS);
+    /* Fewer transfers than rounds if ControlCoalesceDeadline is set */
+    printf("  %I64u control transfers, %I64u errors\n",
+           After.ControlTransfers - Before.ControlTransfers,
+           After.ControlErrors - Before.ControlErrors);
+    return After.ControlErrors == Before.ControlErrors;
+}
+
+/*
+ * Reads the pattern back from the loopback until Expected bytes are in or
+ * nothing arrives for the port's read timeouts, on a thread of its own.
+ */
+typedef struct _READER {
+    HANDLE Port;
+    HANDLE Thread;
+    ULONGLONG Expected;
+    ULONGLONG Received;
+    BOOL Failed;
+} READER;
+
+static
+DWORD
+WINAPI
+ReaderThread(
+    PVOID Context) {
+    READER *Reader = Context;
+    UCHAR Buffer[4096];
+    DWORD Done;
+    while (Reader->Received < Reader->Expected) {
+        if (!Transfer(Reader->Port, FALSE, Buffer, sizeof(Buffer), &Done)) {
+            printf("  Read failed with %lu\n", GetLastError());
+            Reader->Failed = TRUE;
+            break;
+        }
+        if (!Done)
+            break;
+        if (!Reader->Failed && !CheckPattern(Buffer, Done, Reader->Received))
+            Reader->Failed = TRUE;
+        Reader->Received += Done;
+    }
+    return 0;
+}
+
+static
+BOOL
+StartReader(
+    READER *Reader,
+    HANDLE Port,
+    ULONGLONG Expected) {
+    memset(Reader, 0, sizeof(*Reader));
+    Reader->Port = Port;
+    Reader->Expected = Expected;
+    /* Give up once nothing has arrived for a second */
+    if (!SetTimeouts(Port, 100, 0, 1000))
+        return FALSE;
+    Reader->Thread = CreateThread(NULL, 0, ReaderThread, Reader, 0, NULL);
+    if (!Reader->Thread) {
+        printf("  CreateThread failed with %lu\n", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static
+BOOL
+FinishReader(
+    READER *Reader) {
+    WaitForSingleObject(Reader->Thread, INFINITE);
+    CloseHandle(Reader->Thread);
+    if (Reader->Received != Reader->Expected)
+        printf("  %I64u of %I64u bytes came back\n", Reader->Received, Reader->Expected);
+    return !Reader->Failed && Reader->Received == Reader->Expected;
+}
+
+/*
+ * Keeps WRITE_DEPTH one-byte writes in flight, as a byte-at-a-time writer
+ * with overlapped I/O does, and reports bytes/s and bulk OUT transfers/s.
+ * Run it once with the WriteCoalescing registry value set and once
+ * without; coalescing should raise the bytes per transfer and lower the
+ * transfer rate for the same data.
+ */
+#define WRITE_BAUD_RATE     921600
+#define WRITE_BYTES         20000
+#define WRITE_DEPTH         MAXIMUM_WAIT_OBJECTS
+
+static
+BOOL
+TestSmallWrites(
+    const char *PortName) {
+    OVERLAPPED Overlapped[WRITE_DEPTH];
+    HANDLE Events[WRITE_DEPTH];
+    UCHAR Data[WRITE_DEPTH];
+    CH341_STATS Before;
+    CH341_STATS After;
+    READER Reader;
+    ULONGLONG Start;
+    ULONGLONG Elapsed;
+    ULONGLONG Transfers;
+    ULONG Sent = 0;
+    ULONG InFlight = 0;
+    ULONG Slot;
+    DWORD Done;
+    DWORD Wait;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    Port = OpenPort(PortName, WRITE_BAUD_RATE);
+    if (!Port)
+        return FALSE;
+    memset(Overlapped, 0, sizeof(Overlapped));
+    for (Slot = 0; Slot < WRITE_DEPTH; Slot++) {
+        Events[Slot] = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!Events[Slot]) {
+            while (Slot--)
+                CloseHandle(Events[Slot]);
+            CloseHandle(Port);
+            return FALSE;
+        }
+        Overlapped[Slot].hEvent = Events[Slot];
+    }
+    if (!GetStats(Port, &Before) || !StartReader(&Reader, Port, WRITE_BYTES)) {
+        for (Slot = 0; Slot < WRITE_DEPTH; Slot++)
+            CloseHandle(Events[Slot]);
+        CloseHandle(Port);
+        return FALSE;
+    }
+    Start = Microseconds();
+    /* Slot n starts out with byte n, a completed slot takes the next byte */
+    for (Slot = 0; Slot < WRITE_DEPTH; Slot++) {
+        Data[Slot] = Pattern(Sent++);
+        if (!WriteFile(Port, &Data[Slot], 1, NULL, &Overlapped[Slot]) &&
+                GetLastError() != ERROR_IO_PENDING) {
+            printf("  Write failed with %lu\n", GetLastError());
+            Success = FALSE;
+            break;
+        }
+        InFlight++;
+    }
+    while (InFlight) {
+        /* Retired slots have their event reset and never signal again */
+        Wait = WaitForMultipleObjects(WRITE_DEPTH, Events, FALSE, INFINITE);
+        Slot = Wait - WAIT_OBJECT_0;
+        if (Slot >= WRITE_DEPTH)
+            break;
+        ResetEvent(Events[Slot]);
+        if (!GetOverlappedResult(Port, &Overlapped[Slot], &Done, FALSE) || Done != 1) {
+            printf("  Write failed with %lu\n", GetLastError());
+            Success = FALSE;
+        }
+        if (!Success || Sent == WRITE_BYTES) {
+            InFlight--;
+            continue;
+        }
+        Data[Slot] = Pattern(Sent++);
+        if (!WriteFile(Port, &Data[Slot], 1, NULL, &Overlapped[Slot]) &&
+                GetLastError() != ERROR_IO_PENDING) {
+            printf("  Write failed with %lu\n", GetLastError());
+            Success = FALSE;
+            InFlight--;
+        }
+    }
+    Elapsed = Microseconds() - Start;
+    if (!FinishReader(&Reader))
+        Success = FALSE;
+    if (!GetStats(Port, &After))
+        Success = FALSE;
+    CloseHandle(Port);
+    for (Slot = 0; Slot < WRITE_DEPTH; Slot++)
+        CloseHandle(Events[Slot]);
+    Transfers = After.BulkOutTransfers - Before.BulkOutTransfers;
+    printf("  %lu bytes in %I64u bulk OUT transfers, %.1f bytes per transfer\n",
+           Sent, Transfers, Transfers ? (double)Sent / Transfers : 0.0);
+    printf("  %.0f bytes/s, %.0f transfers/s\n",
+           Sent * 1e6 / Elapsed, Transfers * 1e6 / Elapsed);
+    return Success;
+}
+
+/*
+ * Issues PIPELINE_WRITES large writes at once and takes their completions
+ * from a completion port, which hands them out in the order the driver
+ * completed them. That must be submission order, and the data must come
+ * back from the loopback in that order too. The throughput shows whether
+ * the bulk OUT pipeline keeps the line busy.
+ */
+#define PIPELINE_BAUD_RATE  921600
+#define PIPELINE_WRITES     8
+#define PIPELINE_LENGTH     (32 * 1024)
+
+static
+BOOL
+TestPipeline(
+    const char *PortName) {
+    static UCHAR Data[PIPELINE_WRITES][PIPELINE_LENGTH];
+    OVERLAPPED Overlapped[PIPELINE_WRITES];
+    LPOVERLAPPED Completed;
+    ULONG_PTR Key;
+    HANDLE CompletionPort;
+    READER Reader;
+    ULONGLONG Start;
+    ULONGLONG Elapsed;
+    ULONG Issued;
+    ULONG Retired = 0;
+    ULONG Index;
+    ULONG i;
+    DWORD Done;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    Port = OpenPort(PortName, PIPELINE_BAUD_RATE);
+    if (!Port)
+        return FALSE;
+    CompletionPort = CreateIoCompletionPort(Port, NULL, 0, 1);
+    if (!CompletionPort) {
+        printf("  CreateIoCompletionPort failed with %lu\n", GetLastError());
+        CloseHandle(Port);
+        return FALSE;
+    }
+    for (Index = 0; Index < PIPELINE_WRITES; Index++) {
+        for (i = 0; i < PIPELINE_LENGTH; i++)
+            Data[Index][i] = Pattern((ULONGLONG)Index * PIPELINE_LENGTH + i);
+    }
+    if (!StartReader(&Reader, Port, (ULONGLONG)PIPELINE_WRITES * PIPELINE_LENGTH)) {
+        CloseHandle(CompletionPort);
+        CloseHandle(Port);
+        return FALSE;
+    }
+    memset(Overlapped, 0, sizeof(Overlapped));
+    Start = Microseconds();
+    for (Issued = 0; Issued < PIPELINE_WRITES; Issued++) {
+        if (!WriteFile(Port, Data[Issued], PIPELINE_LENGTH, NULL, &Overlapped[Issued]) &&
+                GetLastError() != ERROR_IO_PENDING) {
+            printf("  Write %lu failed with %lu\n", Issued, GetLastError());
+            Success = FALSE;
+            break;
+        }
+    }
+    while (Retired < Issued) {
+        if (!GetQueuedCompletionStatus(CompletionPort, &Done, &Key, &Completed, INFINITE) &&
+                !Completed) {
+            printf("  GetQueuedCompletionStatus failed with %lu\n", GetLastError());
+            Success = FALSE;
+            break;
+        }
+        /* The reader's requests complete to the same port */
+        if (Completed < &Overlapped[0] || Completed >= &Overlapped[PIPELINE_WRITES])
+            continue;
+        Index = (ULONG)(Completed - Overlapped);
+        if (Index != Retired) {
+            printf("  Write %lu completed in place of write %lu\n", Index, Retired);
+            Success = FALSE;
+        }
+        if (Done != PIPELINE_LENGTH) {
+            printf("  Write %lu sent %lu bytes\n", Index, Done);
+            Success = FALSE;
+        }
+        Retired++;
+    }
+    Elapsed = Microseconds() - Start;
+    if (!FinishReader(&Reader))
+        Success = FALSE;
+    CloseHandle(Port);
+    CloseHandle(CompletionPort);
+    printf("  %lu writes of %lu bytes, %.0f bytes/s, %.1f%% of the line rate\n",
+           Retired, (ULONG)PIPELINE_LENGTH,
+           (double)Retired * PIPELINE_LENGTH * 1e6 / Elapsed,
+           (double)Retired * PIPELINE_LENGTH * 1e6 / Elapsed * 10 * 100 / PIPELINE_BAUD_RATE);
+    return Success;
+}
+
+/*
+ * Streams the pattern through the loopback like the stream test while
+ * keeping CANCEL_DEPTH reads of random length outstanding, and cancels
+ * about half of them with CancelIoEx after a random delay, whether they
+ * are still queued or already current. Every read must complete, and the
+ * data of the ones that succeed, taken in the order they were issued, must
+ * be the pattern with nothing missing.
+ *
+ * Reads return as soon as any data is there, so a pending read never
+ * holds data: the I/O manager does not copy a cancelled read's buffer
+ * back, so any bytes it reports would be lost, and that fails the test.
+ */
+#define CANCEL_DEPTH        4
+#define CANCEL_MAX_LENGTH   4096
+#define CANCEL_MAX_DELAY    500     /* us */
+#define CANCEL_WAIT         5000    /* ms a read may take before it is hung */
+
+static
+BOOL
+TestCancel(
+    const char *PortName) {
+    static UCHAR Buffers[CANCEL_DEPTH][CANCEL_MAX_LENGTH];
+    OVERLAPPED Overlapped[CANCEL_DEPTH];
+    STREAM Stream;
+    HANDLE Thread;
+    ULONGLONG Received = 0;
+    ULONGLONG Completed = 0;
+    ULONGLONG Cancelled = 0;
+    ULONGLONG Issued = 0;
+    ULONGLONG Oldest = 0;
+    ULONGLONG Until;
+    ULONG Slot;
+    DWORD Done;
+    BOOL Success = TRUE;
+    BOOL Finished = FALSE;
+    memset(&Stream, 0, sizeof(Stream));
+    memset(Overlapped, 0, sizeof(Overlapped));
+    Stream.Port = OpenPort(PortName, STREAM_BAUD_RATE);
+    if (!Stream.Port)
+        return FALSE;
+    for (Slot = 0; Slot < CANCEL_DEPTH; Slot++) {
+        Overlapped[Slot].hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!Overlapped[Slot].hEvent) {
+            while (Slot--)
+                CloseHandle(Overlapped[Slot].hEvent);
+            CloseHandle(Stream.Port);
+            return FALSE;
+        }
+    }
+    Thread = NULL;
+    if (SetTimeouts(Stream.Port, MAXDWORD, MAXDWORD, 1000)) {
+        Thread = CreateThread(NULL, 0, StreamWriter, &Stream, 0, NULL);
+        if (!Thread)
+            printf("  CreateThread failed with %lu\n", GetLastError());
+    }
+    if (!Thread) {
+        Success = FALSE;
+        Finished = TRUE;
+    }
+    while (!Finished || Oldest < Issued) {
+        /* Slots are used round robin, so Oldest % CANCEL_DEPTH is the oldest */
+        while (!Finished && Issued - Oldest < CANCEL_DEPTH) {
+            Slot = (ULONG)(Issued % CANCEL_DEPTH);
+            ResetEvent(Overlapped[Slot].hEvent);
+            if (!ReadFile(Stream.Port, Buffers[Slot], 1 + Random() % CANCEL_MAX_LENGTH,
+                          NULL, &Overlapped[Slot]) &&
+                    GetLastError() != ERROR_IO_PENDING) {
+                printf("  Read failed with %lu\n", GetLastError());
+                Success = FALSE;
+                Finished = TRUE;
+                break;
+            }
+            Issued++;
+        }
+        if (!Finished && Random() % 2) {
+            Until = Microseconds() + Random() % CANCEL_MAX_DELAY;
+            while (Microseconds() < Until)
+                ;
+            Slot = (ULONG)((Oldest + Random() % (Issued - Oldest)) % CANCEL_DEPTH);
+            (void)CancelIoEx(Stream.Port, &Overlapped[Slot]);
+        }
+        if (Oldest == Issued)
+            break;
+        Slot = (ULONG)(Oldest % CANCEL_DEPTH);
+        if (WaitForSingleObject(Overlapped[Slot].hEvent, CANCEL_WAIT) != WAIT_OBJECT_0) {
+            printf("  Read %I64u did not complete\n", Oldest);
+            Success = FALSE;
+            break;
+        }
+        Oldest++;
+        if (GetOverlappedResult(Stream.Port, &Overlapped[Slot], &Done, FALSE)) {
+            Completed++;
+            if (Success && !CheckPattern(Buffers[Slot], Done, Received))
+                Success = FALSE;
+            Received += Done;
+            /* Nothing for a second and the writer is done */
+            if (!Done && WaitForSingleObject(Thread, 0) == WAIT_OBJECT_0)
+                Finished = TRUE;
+        } else if (GetLastError() == ERROR_OPERATION_ABORTED) {
+            Cancelled++;
+            if (Done) {
+                printf("  Cancelled read %I64u lost %lu bytes\n", Oldest - 1, Done);
+                Success = FALSE;
+                Received += Done;
+            }
+        } else {
+            printf("  Read failed with %lu\n", GetLastError());
+            Success = FALSE;
+            Finished = TRUE;
+        }
+    }
+    if (Oldest < Issued) {
+        /* A read hung; do not free what it still points to */
+        CancelIoEx(Stream.Port, NULL);
+        Sleep(CANCEL_WAIT);
+    }
+    if (Thread) {
+        WaitForSingleObject(Thread, INFINITE);
+        CloseHandle(Thread);
+    }
+    CloseHandle(Stream.Port);
+    for (Slot = 0; Slot < CANCEL_DEPTH; Slot++)
+        CloseHandle(Overlapped[Slot].hEvent);
+    printf("  %I64u reads completed, %I64u cancelled\n", Completed, Cancelled);
+    printf("  %I64u bytes sent, %I64u received\n", Stream.Sent, Received);
+    return Success && !Stream.Failed && Received == Stream.Sent;
+}
+
+/*
+ * Checks the read timeout modes against their deadlines. Reads that wait
+ * for a byte sent through the loopback once they are pending get the
+ * loopback latency added to their window, measured first with the
+ * return-on-any mode. Each read must finish no earlier than its deadline
+ * and no later than TIMEOUT_TOLERANCE after it, with the expected count.
+ */
+#define TIMEOUT_TOLERANCE   1000    /* us */
+#define TIMEOUT_ROUNDS      10
+
+typedef struct _TIMEOUT_CASE {
+    const char *Name;
+    DWORD Interval;
+    DWORD Multiplier;
+    DWORD Constant;
+    DWORD Length;       /* Bytes asked for */
+    DWORD Buffered;     /* Bytes looped back before the read */
+    DWORD Sent;         /* Bytes written once the read is pending */
+    ULONG Deadline;     /* us after the read started */
+} TIMEOUT_CASE;
+
+static const TIMEOUT_CASE TimeoutCases[] = {
+    { "immediate, nothing buffered",    MAXDWORD,   0,          0,      16, 0,  0,  0 },
+    { "immediate, 4 bytes buffered",    MAXDWORD,   0,          0,      16, 4,  0,  0 },
+    { "total constant",                 0,          0,          50,     16, 0,  0,  50000 },
+    { "total with multiplier",          0,          2,          20,     16, 0,  0,  52000 },
+    { "return on any, nothing sent",    MAXDWORD,   MAXDWORD,   30,     16, 0,  0,  30000 },
+    { "interval",                       20,         0,          0,      16, 0,  1,  20000 },
+    { "interval before total",          20,         0,          200,    16, 0,  1,  20000 },
+    { "total before interval",          100,        0,          30,     16, 0,  1,  30000 },
+};
+
+/* Times one read, writing Sent bytes to the loopback once it is pending */
+static
+BOOL
+TimeRead(
+    HANDLE Port,
+    DWORD Length,
+    DWORD Sent,
+    PDWORD Done,
+    PULONGLONG Elapsed) {
+    UCHAR Buffer[64];
+    UCHAR Data[64];
+    OVERLAPPED Overlapped;
+    ULONGLONG Start;
+    DWORD Written;
+    BOOL Success;
+    memset(Data, 0x55, sizeof(Data));
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+        return FALSE;
+    Start = Microseconds();
+    Success = ReadFile(Port, Buffer, Length, NULL, &Overlapped);
+    if (Success || GetLastError() == ERROR_IO_PENDING) {
+        if (Sent) {
+            if (!Transfer(Port, TRUE, Data, Sent, &Written) || Written != Sent)
+                printf("  Write failed with %lu\n", GetLastError());
+        }
+        Success = GetOverlappedResult(Port, &Overlapped, Done, TRUE);
+    }
+    *Elapsed = Microseconds() - Start;
+    CloseHandle(Overlapped.hEvent);
+    if (!Success)
+        printf("  Read failed with %lu\n", GetLastError());
+    return Success;
+}
+
+static
+BOOL
+TestTimeouts(
+    const char *PortName) {
+    const TIMEOUT_CASE *Case;
+    UCHAR Data[64];
+    ULONGLONG Latency = 0;
+    ULONGLONG Elapsed;
+    ULONGLONG Limit;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    DWORD Expected;
+    DWORD Done;
+    ULONG Round;
+    ULONG i;
+    Port = OpenPort(PortName, 115200);
+    if (!Port)
+        return FALSE;
+    memset(Data, 0x55, sizeof(Data));
+    /* The longest a sent byte takes to complete a return-on-any read */
+    if (!SetTimeouts(Port, MAXDWORD, MAXDWORD, 1000)) {
+        CloseHandle(Port);
+        return FALSE;
+    }
+    for (Round = 0; Round < TIMEOUT_ROUNDS; Round++) {
+        if (!TimeRead(Port, 16, 1, &Done, &Elapsed) || Done != 1) {
+            printf("  Loopback byte did not come back\n");
+            CloseHandle(Port);
+            return FALSE;
+        }
+        if (Elapsed > Latency)
+            Latency = Elapsed;
+    }
+    printf("  Loopback latency up to %I64u us\n", Latency);
+    for (i = 0; i < RTL_NUMBER_OF(TimeoutCases); i++) {
+        Case = &TimeoutCases[i];
+        if (!PurgeComm(Port, PURGE_RXCLEAR)) {
+            Success = FALSE;
+            break;
+        }
+        if (Case->Buffered) {
+            if (!Transfer(Port, TRUE, Data, Case->Buffered, &Done)) {
+                printf("  Write failed with %lu\n", GetLastError());
+                Success = FALSE;
+                break;
+            }
+            Sleep(100);
+        }
+        if (!SetTimeouts(Port, Case->Interval, Case->Multiplier, Case->Constant) ||
+                !TimeRead(Port, Case->Length, Case->Sent, &Done, &Elapsed)) {
+            Success = FALSE;
+            break;
+        }
+        Expected = min(Case->Length, Case->Buffered + Case->Sent);
+        Limit = Case->Deadline + TIMEOUT_TOLERANCE + (Case->Sent ? Latency : 0);
+        printf("  %-30s %2lu bytes after %6I64u us, window %6lu to %6I64u us\n",
+               Case->Name, Done, Elapsed, Case->Deadline, Limit);
+        if (Done != Expected || Elapsed < Case->Deadline || Elapsed > Limit) {
+            printf("  %s: expected %lu bytes\n", Case->Name, Expected);
+            Success = FALSE;
+        }
+    }
+    CloseHandle(Port);
+    return Success;
+}
+
+/*
+ * Toggles RTS and DTR, looped back to CTS and DSR, and checks that each
+ * change completes a WaitCommEvent with the matching event and shows up in
+ * GetCommModemStatus. Then reads the modem status MODEM_READS times, which
+ * must be served from the cached status without any control transfer.
+ */
+#define MODEM_ROUNDS        50
+#define MODEM_READS         1000
+#define MODEM_WAIT          1000    /* ms */
+
+typedef struct _MODEM_LINE {
+    const char *Name;
+    DWORD Set;
+    DWORD Clear;
+    DWORD Event;
+    DWORD Status;
+} MODEM_LINE;
+
+static const MODEM_LINE ModemLines[] = {
+    { "RTS-CTS",    SETRTS, CLRRTS, EV_CTS, MS_CTS_ON },
+    { "DTR-DSR",    SETDTR, CLRDTR, EV_DSR, MS_DSR_ON },
+};
+
+/* Starts a WaitCommEvent, runs Function and waits for the event */
+static
+BOOL
+WaitForEvent(
+    HANDLE Port,
+    DWORD Function,
+    PDWORD Events,
+    PULONGLONG Elapsed) {
+    OVERLAPPED Overlapped;
+    ULONGLONG Start;
+    DWORD Done;
+    BOOL Success;
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+        return FALSE;
+    *Events = 0;
+    Success = WaitCommEvent(Port, Events, &Overlapped);
+    if (!Success && GetLastError() != ERROR_IO_PENDING) {
+        printf("  WaitCommEvent failed with %lu\n", GetLastError());
+        CloseHandle(Overlapped.hEvent);
+        return FALSE;
+    }
+    Start = Microseconds();
+    if (!EscapeCommFunction(Port, Function)) {
+        printf("  EscapeCommFunction failed with %lu\n", GetLastError());
+        Success = FALSE;
+    } else if (WaitForSingleObject(Overlapped.hEvent, MODEM_WAIT) != WAIT_OBJECT_0) {
+        printf("  No event within %lu ms\n", (ULONG)MODEM_WAIT);
+        Success = FALSE;
+    } else {
+        Success = GetOverlappedResult(Port, &Overlapped, &Done, FALSE);
+    }
+    *Elapsed = Microseconds() - Start;
+    if (!Success) {
+        /* SetCommMask completes a pending wait */
+        SetCommMask(Port, 0);
+        GetOverlappedResult(Port, &Overlapped, &Done, TRUE);
+    }
+    CloseHandle(Overlapped.hEvent);
+    return Success;
+}
+
+static
+BOOL
+TestModem(
+    const char *PortName) {
+    static ULONGLONG Times[MODEM_ROUNDS * 2];
+    const MODEM_LINE *Line;
+    CH341_STATS Before;
+    CH341_STATS After;
+    ULONGLONG Elapsed;
+    ULONGLONG Start;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    DWORD Events;
+    DWORD Status;
+    ULONG Round;
+    ULONG i;
+    Port = OpenPort(PortName, 115200);
+    if (!Port)
+        return FALSE;
+    for (i = 0; Success && i < RTL_NUMBER_OF(ModemLines); i++) {
+        Line = &ModemLines[i];
+        if (!SetCommMask(Port, Line->Event)) {
+            printf("  SetCommMask failed with %lu\n", GetLastError());
+            Success = FALSE;
+            break;
+        }
+        /* Start from the line off, the first change is then always an edge */
+        if (!EscapeCommFunction(Port, Line->Clear)) {
+            Success = FALSE;
+            break;
+        }
+        Sleep(50);
+        for (Round = 0; Round < MODEM_ROUNDS * 2; Round++) {
+            if (!WaitForEvent(Port, Round % 2 ? Line->Clear : Line->Set, &Events, &Elapsed) ||
+                    !GetCommModemStatus(Port, &Status)) {
+                printf("  %s change %lu failed\n", Line->Name, Round);
+                Success = FALSE;
+                break;
+            }
+            Times[Round] = Elapsed;
+            /* Even rounds set the line, odd ones clear it */
+            if (!(Events & Line->Event) ||
+                    (Status & Line->Status ? 0UL : 1UL) != Round % 2) {
+                printf("  %s change %lu: events 0x%lx, modem status 0x%lx\n",
+                       Line->Name, Round, Events, Status);
+                Success = FALSE;
+                break;
+            }
+        }
+        if (Success)
+            PrintTimes(Line->Name, Times, MODEM_ROUNDS * 2);
+    }
+    if (Success && GetStats(Port, &Before)) {
+        Start = Microseconds();
+        for (Round = 0; Round < MODEM_READS; Round++) {
+            if (!GetCommModemStatus(Port, &Status)) {
+                printf("  GetCommModemStatus failed with %lu\n", GetLastError());
+                Success = FALSE;
+                break;
+            }
+        }
+        Elapsed = Microseconds() - Start;
+        if (!GetStats(Port, &After)) {
+            Success = FALSE;
+        } else {
+            printf("  %lu modem status reads, %.1f us each, %I64u control transfers\n",
+                   (ULONG)MODEM_READS, (double)Elapsed / MODEM_READS,
+                   After.ControlTransfers - Before.ControlTransfers);
+            if (After.ControlTransfers != Before.ControlTransfers)
+                Success = FALSE;
+        }
+    } else {
+        Success = FALSE;
+    }
+    CloseHandle(Port);
+    return Success;
+}
+
+/*
+ * Changes DTR and RTS together, looped back to DSR and CTS, and measures
+ * how far apart EV_DSR and EV_CTS arrive. Through
+ * IOCTL_CH341_SET_CONTROL_LINES both lines change in one transfer, so both
+ * events must come within one USB frame, normally in the same
+ * WaitCommEvent completion. The standard SET_DTR/SET_RTS pair is measured
+ * too; it is held to the same bound only when ControlCoalesceDeadline
+ * merged it into one transfer.
+ */
+#define LINES_ROUNDS        100
+#define LINES_MAX_SKEW      1000    /* us, one full speed frame */
+
+/* Returns the time between the first and the last event, and their count */
+static
+BOOL
+ChangeLines(
+    HANDLE Port,
+    BOOL Private,
+    BOOL On,
+    PULONG Completions,
+    PULONGLONG Skew) {
+    CH341_CONTROL_LINES Lines;
+    OVERLAPPED Overlapped;
+    ULONGLONG First = 0;
+    DWORD Events = 0;
+    DWORD Seen = 0;
+    DWORD Done;
+    BOOL Success;
+    BOOL Pending = TRUE;
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+        return FALSE;
+    *Completions = 0;
+    *Skew = 0;
+    Success = WaitCommEvent(Port, &Events, &Overlapped);
+    if (!Success && GetLastError() != ERROR_IO_PENDING) {
+        printf("  WaitCommEvent failed with %lu\n", GetLastError());
+        CloseHandle(Overlapped.hEvent);
+        return FALSE;
+    }
+    if (Private) {
+        Lines.Mask = CH341_LINE_DTR | CH341_LINE_RTS;
+        Lines.Lines = On ? CH341_LINE_DTR | CH341_LINE_RTS : 0;
+        Success = Control(Port, IOCTL_CH341_SET_CONTROL_LINES, &Lines, sizeof(Lines), NULL, 0);
+    } else {
+        Success = Control(Port, On ? IOCTL_SERIAL_SET_DTR : IOCTL_SERIAL_CLR_DTR, NULL, 0, NULL, 0) &&
+                  Control(Port, On ? IOCTL_SERIAL_SET_RTS : IOCTL_SERIAL_CLR_RTS, NULL, 0, NULL, 0);
+    }
+    if (!Success)
+        printf("  Changing the lines failed with %lu\n", GetLastError());
+    while (Success) {
+        if (WaitForSingleObject(Overlapped.hEvent, MODEM_WAIT) != WAIT_OBJECT_0 ||
+                !GetOverlappedResult(Port, &Overlapped, &Done, FALSE)) {
+            printf("  Events 0x%lx only\n", Seen);
+            Success = FALSE;
+            break;
+        }
+        if (!*Completions)
+            First = Microseconds();
+        else
+            *Skew = Microseconds() - First;
+        ++*Completions;
+        Seen |= Events;
+        if ((Seen & (EV_CTS | EV_DSR)) == (EV_CTS | EV_DSR))
+            break;
+        ResetEvent(Overlapped.hEvent);
+        if (!WaitCommEvent(Port, &Events, &Overlapped) && GetLastError() != ERROR_IO_PENDING) {
+            printf("  WaitCommEvent failed with %lu\n", GetLastError());
+            Success = FALSE;
+            Pending = FALSE;
+        }
+    }
+    if (!Success && Pending) {
+        SetCommMask(Port, EV_CTS | EV_DSR);
+        GetOverlappedResult(Port, &Overlapped, &Done, TRUE);
+    }
+    CloseHandle(Overlapped.hEvent);
+    return Success;
+}
+
+static
+BOOL
+TestLines(
+    const char *PortName) {
+    static ULONGLONG Skews[LINES_ROUNDS];
+    CH341_STATS Before;
+    CH341_STATS After;
+    ULONGLONG Transfers;
+    ULONG Completions;
+    ULONG Split;
+    ULONG Round;
+    ULONG Pass;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    BOOL Private;
+    Port = OpenPort(PortName, 115200);
+    if (!Port)
+        return FALSE;
+    for (Pass = 0; Success && Pass < 2; Pass++) {
+        Private = Pass == 0;
+        Split = 0;
+        if (!SetCommMask(Port, EV_CTS | EV_DSR) ||
+                !Control(Port, IOCTL_SERIAL_CLR_DTR, NULL, 0, NULL, 0) ||
+                !Control(Port, IOCTL_SERIAL_CLR_RTS, NULL, 0, NULL, 0)) {
+            Success = FALSE;
+            break;
+        }
+        /* Let the edges of the reset settle before the mask is set again */
+        Sleep(50);
+        if (!SetCommMask(Port, EV_CTS | EV_DSR) || !GetStats(Port, &Before)) {
+            Success = FALSE;
+            break;
+        }
+        for (Round = 0; Round < LINES_ROUNDS; Round++) {
+            if (!ChangeLines(Port, Private, Round % 2 == 0, &Completions, &Skews[Round])) {
+                Success = FALSE;
+                break;
+            }
+            if (Completions > 1)
+                Split++;
+        }
+        if (!Success || !GetStats(Port, &After)) {
+            Success = FALSE;
+            break;
+        }
+        Transfers = After.ControlTransfers - Before.ControlTransfers;
+        printf("  %s: %I64u control transfers for %lu changes, %lu with split events\n",
+               Private ? "IOCTL_CH341_SET_CONTROL_LINES" : "SET_DTR and SET_RTS",
+               Transfers, (ULONG)LINES_ROUNDS, Split);
+        /* PrintTimes sorts, so the last one is the largest */
+        PrintTimes("skew", Skews, LINES_ROUNDS);
+        if ((Private || Transfers == LINES_ROUNDS) && Skews[LINES_ROUNDS - 1] >= LINES_MAX_SKEW) {
+            printf("  Skew above %lu us\n", (ULONG)LINES_MAX_SKEW);
+            Success = FALSE;
+        }
+        if (Private && Transfers != LINES_ROUNDS)
+            Success = FALSE;
+    }
+    CloseHandle(Port);
+    return Success;
+}
+
+/*
+ * Sends BREAK_ROUNDS timed breaks through IOCTL_CH341_SEND_BREAK with a
+ * frame written right behind each request. The request must take at least
+ * break plus mark, the frame must not go out before that, and it must come
+ * back intact after whatever the receiver made of the break; the spread
+ * of the request times past break plus mark is the host jitter. Then,
+ * during one long break, a DTR change must not wait for it, while break
+ * changes through other requests are refused.
+ */
+#define BREAK_ROUNDS        50
+#define BREAK_MICROSECONDS  10000
+#define MARK_MICROSECONDS   1000
+#define BREAK_LONG          200000  /* us */
+#define BREAK_DTR_LIMIT     50000   /* us a DTR change may take meanwhile */
+
+static const UCHAR BreakFrame[] = { 0x55, 0x3c, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+
+/* Starts an overlapped request without waiting for it */
+static
+BOOL
+StartControl(
+    HANDLE Port,
+    DWORD IoControlCode,
+    PVOID Input,
+    DWORD InputLength,
+    LPOVERLAPPED Overlapped) {
+    if (!DeviceIoControl(Port, IoControlCode, Input, InputLength, NULL, 0, NULL, Overlapped) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        printf("  Request failed with %lu\n", GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Checks that the frame is what came back, after any break characters */
+static
+BOOL
+CheckBreakFrame(
+    HANDLE Port) {
+    UCHAR Buffer[64];
+    DWORD Done;
+    DWORD Skip = 0;
+    if (!Transfer(Port, FALSE, Buffer, sizeof(Buffer), &Done))
+        return FALSE;
+    while (Skip < Done && Buffer[Skip] == 0)
+        Skip++;
+    if (Done - Skip != sizeof(BreakFrame) ||
+            memcmp(Buffer + Skip, BreakFrame, sizeof(BreakFrame)) != 0) {
+        printf("  Received %lu bytes after %lu break characters, expected the %lu byte frame\n",
+               Done - Skip, Skip, (ULONG)sizeof(BreakFrame));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static
+BOOL
+TestBreak(
+    const char *PortName) {
+    static ULONGLONG Jitter[BREAK_ROUNDS];
+    CH341_BREAK Break;
+    OVERLAPPED BreakOverlapped;
+    OVERLAPPED WriteOverlapped;
+    ULONGLONG Start;
+    ULONGLONG BreakDone;
+    ULONGLONG WriteDone;
+    ULONGLONG Elapsed;
+    ULONG Round;
+    DWORD Done;
+    HANDLE Port;
+    BOOL Success = TRUE;
+    Port = OpenPort(PortName, 19200);
+    if (!Port)
+        return FALSE;
+    memset(&BreakOverlapped, 0, sizeof(BreakOverlapped));
+    memset(&WriteOverlapped, 0, sizeof(WriteOverlapped));
+    BreakOverlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    WriteOverlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!BreakOverlapped.hEvent || !WriteOverlapped.hEvent ||
+            !SetTimeouts(Port, 50, 0, 1000))
+        Success = FALSE;
+    for (Round = 0; Success && Round < BREAK_ROUNDS; Round++) {
+        Break.BreakMicroseconds = BREAK_MICROSECONDS;
+        Break.MarkMicroseconds = MARK_MICROSECONDS;
+        ResetEvent(BreakOverlapped.hEvent);
+        ResetEvent(WriteOverlapped.hEvent);
+        Start = Microseconds();
+        if (!StartControl(Port, IOCTL_CH341_SEND_BREAK, &Break, sizeof(Break), &BreakOverlapped)) {
+            Success = FALSE;
+            break;
+        }
+        if (!WriteFile(Port, BreakFrame, sizeof(BreakFrame), NULL, &WriteOverlapped) &&
+                GetLastError() != ERROR_IO_PENDING) {
+            printf("  Write failed with %lu\n", GetLastError());
+            GetOverlappedResult(Port, &BreakOverlapped, &Done, TRUE);
+            Success = FALSE;
+            break;
+        }
+        if (!GetOverlappedResult(Port, &BreakOverlapped, &Done, TRUE)) {
+            printf("  IOCTL_CH341_SEND_BREAK failed with %lu\n", GetLastError());
+            GetOverlappedResult(Port, &WriteOverlapped, &Done, TRUE);
+            Success = FALSE;
+            break;
+        }
+        BreakDone = Microseconds() - Start;
+        if (!GetOverlappedResult(Port, &WriteOverlapped, &Done, TRUE) || Done != sizeof(BreakFrame)) {
+            printf("  Write failed with %lu\n", GetLastError());
+            Success = FALSE;
+            break;
+        }
+        WriteDone = Microseconds() - Start;
+        if (BreakDone < BREAK_MICROSECONDS + MARK_MICROSECONDS ||
+                WriteDone < BREAK_MICROSECONDS + MARK_MICROSECONDS) {
+            printf("  Round %lu: break done after %I64u us, frame after %I64u us\n",
+                   Round, BreakDone, WriteDone);
+            Success = FALSE;
+        }
+        Jitter[Round] = BreakDone - (BREAK_MICROSECONDS + MARK_MICROSECONDS);
+        if (!CheckBreakFrame(Port)) {
+            Success = FALSE;
+            break;
+        }
+    }
+    if (Success)
+        PrintTimes("time past break and mark", Jitter, BREAK_ROUNDS);
+    if (Success) {
+        Break.BreakMicroseconds = BREAK_LONG;
+        Break.MarkMicroseconds = 0;
+        ResetEvent(BreakOverlapped.hEvent);
+        if (!StartControl(Port, IOCTL_CH341_SEND_BREAK, &Break, sizeof(Break), &BreakOverlapped)) {
+            Success = FALSE;
+        } else {
+            /* Give the request time to set break before poking at it */
+            Sleep(20);
+            Start = Microseconds();
+            if (!Control(Port, IOCTL_SERIAL_SET_DTR, NULL, 0, NULL, 0)) {
+                printf("  SET_DTR during the break failed with %lu\n", GetLastError());
+                Success = FALSE;
+            }
+            Elapsed = Microseconds() - Start;
+            printf("  SET_DTR during the break took %I64u us\n", Elapsed);
+            if (Elapsed > BREAK_DTR_LIMIT)
+                Success = FALSE;
+            if (Control(Port, IOCTL_SERIAL_SET_BREAK_ON, NULL, 0, NULL, 0) ||
+                    GetLastError() != ERROR_BUSY) {
+                printf("  SET_BREAK_ON during the break: %lu, expected ERROR_BUSY\n", GetLastError());
+                Success = FALSE;
+            }
+            if (Control(Port, IOCTL_CH341_SEND_BREAK, &Break, sizeof(Break), NULL, 0) ||
+                    GetLastError() != ERROR_BAD_COMMAND) {
+                printf("  Second SEND_BREAK: %lu, expected ERROR_BAD_COMMAND\n", GetLastError());
+                Success = FALSE;
+            }
+            if (!GetOverlappedResult(Port, &BreakOverlapped, &Done, TRUE)) {
+                printf("  IOCTL_CH341_SEND_BREAK failed with %lu\n", GetLastError());
+                Success = FALSE;
+            }
+        }
+    }
+    if (BreakOverlapped.hEvent)
+        CloseHandle(BreakOverlapped.hEvent);
+    if (WriteOverlapped.hEvent)
+        CloseHandle(WriteOverlapped.hEvent);
+    CloseHandle(Port);
+    return Success;
+}
+
+static const TEST Tests[] = {
+    { "stream",     "TXD-RXD",  TestStream },
+    { "control",    "none",     TestControl },
+    { "smallwrites", "TXD-RXD", TestSmallWrites },
+    { "pipeline",   "TXD-RXD",  TestPipeline },
+    { "cancel",     "TXD-RXD",  TestCancel },
+    { "timeouts",   "TXD-RXD",  TestTimeouts },
+    { "modem",      "RTS-CTS, DTR-DSR", TestModem },
+    { "lines",      "RTS-CTS, DTR-DSR", TestLines },
+    { "break",      "TXD-RXD",  TestBreak },
+};
+
+int
+main(
+    int argc,
+    char **argv) {
+    ULONG i;
+    ULONG Run = 0;
+    ULONG Failed = 0;
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s COMn [test]\nTests:", argv[0]);
+        for (i = 0; i < RTL_NUMBER_OF(Tests); i++)
+            fprintf(stderr, " %s", Tests[i].Name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&Frequency);
+    for (i = 0; i < RTL_NUMBER_OF(Tests); i++) {
+        if (argc == 3 && strcmp(argv[2], Tests[i].Name) != 0)
+            continue;
+        printf("%s (%s)\n", Tests[i].Name, Tests[i].Wiring);
+        Run++;
+        if (Tests[i].Routine(argv[1])) {
+            printf("  passed\n");
+        } else {
+            printf("  FAILED\n");
+            Failed++;
+        }
+    }
+    if (!Run) {
+        fprintf(stderr, "Unknown test %s\n", argv[2]);
+        return 1;
+    }
+    printf("%lu of %lu tests failed\n", Failed, Run);
+    return Failed ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * CH341 trace ring decoder
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Fetches the trace ring of a CH341 port through IOCTL_CH341_GET_TRACE and
+ * prints per-transfer latency histograms. Build with a plain
+ *     cl ch341trace.c
+ * from a developer command prompt, then run e.g. "ch341trace COM5".
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../ch341ioctl.h"
+
+#define MAX_RECORDS     65536
+#define MAX_PENDING     1024
+#define BUCKET_COUNT    32
+
+enum {
+    KindRead,
+    KindWrite,
+    KindBulkIn,
+    KindBulkOut,
+    KindMaximum
+};
+
+static const char *KindNames[KindMaximum] = {
+    "Read IRP",
+    "Write IRP",
+    "Bulk IN transfer",
+    "Bulk OUT transfer",
+};
+
+typedef struct _PENDING {
+    ULONGLONG Id;
+    ULONGLONG Timestamp;
+    int Kind;
+} PENDING;
+
+static PENDING Pending[MAX_PENDING];
+static ULONG PendingCount;
+static ULONG Histogram[KindMaximum][BUCKET_COUNT];
+static ULONGLONG Bytes[KindMaximum];
+static ULONG Failures[KindMaximum];
+static ULONG Unmatched;
+
+static
+void
+Start(
+    ULONGLONG Id,
+    ULONGLONG Timestamp,
+    int Kind) {
+    ULONG i;
+    /* Transfer contexts are reused, a new submit replaces the old one */
+    for (i = 0; i < PendingCount; i++) {
+        if (Pending[i].Id == Id && (Pending[i].Kind >= KindBulkIn) == (Kind >= KindBulkIn)) {
+            Pending[i].Timestamp = Timestamp;
+            Pending[i].Kind = Kind;
+            return;
+        }
+    }
+    if (PendingCount == MAX_PENDING) {
+        Unmatched++;
+        return;
+    }
+    Pending[PendingCount].Id = Id;
+    Pending[PendingCount].Timestamp = Timestamp;
+    Pending[PendingCount].Kind = Kind;
+    PendingCount++;
+}
+
+static
+void
+Finish(
+    const CH341_TRACE_RECORD *Record,
+    BOOL Bulk,
+    LONGLONG Frequency) {
+    ULONG i;
+    ULONGLONG Microseconds;
+    ULONG Bucket;
+    int Kind;
+    for (i = 0; i < PendingCount; i++) {
+        if (Pending[i].Id == Record->Id && (Pending[i].Kind >= KindBulkIn) == Bulk)
+            break;
+    }
+    if (i == PendingCount) {
+        /* Started before the oldest record, or an IRP we do not track */
+        Unmatched++;
+        return;
+    }
+    Kind = Pending[i].Kind;
+    Microseconds = (Record->Timestamp - Pending[i].Timestamp) * 1000000 / Frequency;
+    for (Bucket = 0; Bucket < BUCKET_COUNT - 1 && (1ULL << (Bucket + 1)) <= Microseconds; Bucket++)
+        ;
+    Histogram[Kind][Bucket]++;
+    Bytes[Kind] += Record->Length;
+    if (Record->Status < 0)
+        Failures[Kind]++;
+    Pending[i] = Pending[--PendingCount];
+}
+
+static
+void
+PrintHistogram(
+    int Kind) {
+    ULONG Total = 0;
+    ULONG Max = 0;
+    ULONG Bucket;
+    ULONG Width;
+    for (Bucket = 0; Bucket < BUCKET_COUNT; Bucket++) {
+        Total += Histogram[Kind][Bucket];
+        if (Histogram[Kind][Bucket] > Max)
+            Max = Histogram[Kind][Bucket];
+    }
+    printf("%s: %lu completed, %I64u bytes, %lu failed\n",
+           KindNames[Kind], Total, Bytes[Kind], Failures[Kind]);
+    if (!Total)
+        return;
+    for (Bucket = 0; Bucket < BUCKET_COUNT; Bucket++) {
+        if (!Histogram[Kind][Bucket])
+            continue;
+        Width = (ULONG)((ULONGLONG)Histogram[Kind][Bucket] * 50 / Max);
+        printf("  %10I64u us  %8lu  %.*s\n",
+               Bucket ? 1ULL << Bucket : 0ULL,
+               Histogram[Kind][Bucket],
+               (int)Width,
+               "##################################################");
+    }
+}
+
+int
+main(
+    int argc,
+    char **argv) {
+    char Path[MAX_PATH];
+    HANDLE Port;
+    PCH341_TRACE_HEADER Header;
+    PCH341_TRACE_RECORD Records;
+    DWORD BufferLength;
+    DWORD Returned;
+    ULONG Gaps = 0;
+    ULONG i;
+    int Kind;
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s COMn\n", argv[0]);
+        return 1;
+    }
+    _snprintf_s(Path, sizeof(Path), _TRUNCATE, "\\\\.\\%s", argv[1]);
+    Port = CreateFileA(Path,
+                       GENERIC_READ | GENERIC_WRITE,
+                       0,
+                       NULL,
+                       OPEN_EXISTING,
+                       0,
+                       NULL);
+    if (Port == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Opening %s failed with %lu\n", Path, GetLastError());
+        return 1;
+    }
+    BufferLength = sizeof(CH341_TRACE_HEADER) + MAX_RECORDS * sizeof(CH341_TRACE_RECORD);
+    Header = malloc(BufferLength);
+    if (!Header) {
+        fprintf(stderr, "Out of memory\n");
+        CloseHandle(Port);
+        return 1;
+    }
+    if (!DeviceIoControl(Port,
+                         IOCTL_CH341_GET_TRACE,
+                         NULL,
+                         0,
+                         Header,
+                         BufferLength,
+                         &Returned,
+                         NULL)) {
+        fprintf(stderr, "IOCTL_CH341_GET_TRACE failed with %lu\n", GetLastError());
+        free(Header);
+        CloseHandle(Port);
+        return 1;
+    }
+    CloseHandle(Port);
+    if (Returned < sizeof(*Header) ||
+            Header->Version != CH341_TRACE_VERSION ||
+            Header->RecordSize != sizeof(CH341_TRACE_RECORD) ||
+            Header->Frequency <= 0) {
+        fprintf(stderr, "Unsupported trace format\n");
+        free(Header);
+        return 1;
+    }
+    Records = (PCH341_TRACE_RECORD)(Header + 1);
+    printf("%lu records (ring holds %lu, %lu written since start)\n",
+           Header->RecordCount, Header->Capacity, Header->NextSequence);
+    for (i = 0; i < Header->RecordCount; i++) {
+        if (i && Records[i].Sequence != Records[i - 1].Sequence + 1)
+            Gaps++;
+        switch (Records[i].Event) {
+        case CH341_TRACE_EVENT_READ_IRP:
+            Start(Records[i].Id, Records[i].Timestamp, KindRead);
+            break;
+        case CH341_TRACE_EVENT_WRITE_IRP:
+            Start(Records[i].Id, Records[i].Timestamp, KindWrite);
+            break;
+        case CH341_TRACE_EVENT_BULK_IN_SUBMIT:
+            Start(Records[i].Id, Records[i].Timestamp, KindBulkIn);
+            break;
+        case CH341_TRACE_EVENT_BULK_OUT_SUBMIT:
+            Start(Records[i].Id, Records[i].Timestamp, KindBulkOut);
+            break;
+        case CH341_TRACE_EVENT_IRP_COMPLETE:
+            Finish(&Records[i], FALSE, Header->Frequency);
+            break;
+        case CH341_TRACE_EVENT_BULK_IN_COMPLETE:
+        case CH341_TRACE_EVENT_BULK_OUT_COMPLETE:
+            Finish(&Records[i], TRUE, Header->Frequency);
+            break;
+        }
+    }
+    for (Kind = 0; Kind < KindMaximum; Kind++)
+        PrintHistogram(Kind);
+    printf("%lu completions without a start, %lu still pending, %lu gaps\n",
+           Unmatched, PendingCount, Gaps);
+    free(Header);
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * CH341 Driver trace ring
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "ch341.h"
+
+/*
+ * Each I/O event is stored as a fixed-size binary record, formatting is left
+ * to the host. Writers claim a slot by incrementing TraceNext, so any number
+ * of them can run concurrently without a lock. A slot's Sequence is
+ * invalidated while it is being filled and set to the claimed sequence number
+ * once it is complete, which lets the reader drop records it raced with.
+ *
+ * Record Ids tie the events of one IRP or transfer together. They are
+ * SipHash-2-4 of the object's address under a random key chosen when the
+ * ring is allocated, so the ring can be handed to any caller without
+ * disclosing kernel addresses or the distance between two of them.
+ */
+
+#define CH341_SIP_ROUND(V0, V1, V2, V3) \
+    do {                                \
+        V0 += V1;                       \
+        V1 = RotateLeft64(V1, 13);      \
+        V1 ^= V0;                       \
+        V0 = RotateLeft64(V0, 32);      \
+        V2 += V3;                       \
+        V3 = RotateLeft64(V3, 16);      \
+        V3 ^= V2;                       \
+        V0 += V3;                       \
+        V3 = RotateLeft64(V3, 21);      \
+        V3 ^= V0;                       \
+        V2 += V1;                       \
+        V1 = RotateLeft64(V1, 17);      \
+        V1 ^= V2;                       \
+        V2 = RotateLeft64(V2, 32);      \
+    } while (0)
+
+/* SipHash-2-4 of the eight bytes of Value, little endian */
+static
+ULONGLONG
+CH341TraceHashId(
+    _In_reads_(2) const ULONGLONG *Key,
+    _In_ ULONGLONG Value) {
+    ULONGLONG V0 = Key[0] ^ 0x736f6d6570736575ULL;
+    ULONGLONG V1 = Key[1] ^ 0x646f72616e646f6dULL;
+    ULONGLONG V2 = Key[0] ^ 0x6c7967656e657261ULL;
+    ULONGLONG V3 = Key[1] ^ 0x7465646279746573ULL;
+    const ULONGLONG Last = 8ULL << 56;
+    V3 ^= Value;
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    V0 ^= Value;
+    V3 ^= Last;
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    V0 ^= Last;
+    V2 ^= 0xff;
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    CH341_SIP_ROUND(V0, V1, V2, V3);
+    return V0 ^ V1 ^ V2 ^ V3;
+}
+
+static FAST_MUTEX CH341TraceDeviceMutex;
+static LIST_ENTRY CH341TraceDevices;
+
+static VOID CH341TraceUpdateGlobals(VOID);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, CH341TraceInitialize)
+#pragma alloc_text(PAGE, CH341TraceAddDevice)
+#pragma alloc_text(PAGE, CH341TraceRemoveDevice)
+#pragma alloc_text(PAGE, CH341TraceUpdateGlobals)
+#pragma alloc_text(PAGE, CH341TraceAllocate)
+#pragma alloc_text(PAGE, CH341TraceFree)
+#endif /* defined ALLOC_PRAGMA */
+
+VOID
+CH341TraceInitialize(VOID) {
+    PAGED_CODE();
+    ExInitializeFastMutex(&CH341TraceDeviceMutex);
+    InitializeListHead(&CH341TraceDevices);
+}
+
+/* Without any device the defaults apply, so DriverEntry and unload still trace */
+_Requires_lock_held_(CH341TraceDeviceMutex)
+static
+VOID
+CH341TraceUpdateGlobals(VOID) {
+    PLIST_ENTRY ListEntry;
+    PDEVICE_EXTENSION DeviceExtension;
+    ULONG Level = CH341_TRACE_LEVEL_NONE;
+    ULONG Flags = 0;
+    PAGED_CODE();
+    if (IsListEmpty(&CH341TraceDevices)) {
+        Level = CH341_DEFAULT_TRACE_LEVEL;
+        Flags = CH341_DEFAULT_TRACE_FLAGS;
+    }
+    for (ListEntry = CH341TraceDevices.Flink;
+            ListEntry != &CH341TraceDevices;
+            ListEntry = ListEntry->Flink) {
+        DeviceExtension = CONTAINING_RECORD(ListEntry, DEVICE_EXTENSION, TraceListEntry);
+        Level = max(Level, DeviceExtension->TraceLevel);
+        Flags |= DeviceExtension->TraceFlags;
+    }
+    CH341TraceLevel = Level;
+    CH341TraceFlags = Flags;
+}
+
+VOID
+CH341TraceAddDevice(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Level,
+    _In_ ULONG Flags) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    DeviceExtension->TraceLevel = Level;
+    DeviceExtension->TraceFlags = Flags;
+    ExAcquireFastMutex(&CH341TraceDeviceMutex);
+    InsertTailList(&CH341TraceDevices, &DeviceExtension->TraceListEntry);
+    CH341TraceUpdateGlobals();
+    ExReleaseFastMutex(&CH341TraceDeviceMutex);
+}
+
+VOID
+CH341TraceRemoveDevice(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    ExAcquireFastMutex(&CH341TraceDeviceMutex);
+    RemoveEntryList(&DeviceExtension->TraceListEntry);
+    CH341TraceUpdateGlobals();
+    ExReleaseFastMutex(&CH341TraceDeviceMutex);
+}
+
+NTSTATUS
+CH341TraceAllocate(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG Capacity) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Seed;
+    ULONG i;
+    PAGED_CODE();
+    NT_ASSERT(!DeviceExtension->TraceRing);
+    NT_ASSERT(Capacity != 0 && (Capacity & (Capacity - 1)) == 0);
+    DeviceExtension->TraceRing = ExAllocatePoolWithTag(NonPagedPool,
+                                 Capacity * sizeof(CH341_TRACE_RECORD),
+                                 CH341_TAG);
+    if (!DeviceExtension->TraceRing) {
+        CH341Error(         "%s. Allocating trace ring of %lu records failed\n",
+                            __FUNCTION__, Capacity);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    for (i = 0; i < Capacity; i++)
+        DeviceExtension->TraceRing[i].Sequence = MAXULONG;
+    DeviceExtension->TraceCapacity = Capacity;
+    DeviceExtension->TraceNext = 0;
+    Seed = KeQueryPerformanceCounter(NULL).LowPart ^ (ULONG)KeQueryInterruptTime();
+    /* Sixteen bits at a time, RtlRandomEx only gives 31; the counter adds what jitter there is */
+    for (i = 0; i < 8; i++) {
+        Seed ^= KeQueryPerformanceCounter(NULL).LowPart;
+        DeviceExtension->TraceIdKey[i / 4] = DeviceExtension->TraceIdKey[i / 4] << 16 |
+                                             (RtlRandomEx(&Seed) & 0xffff);
+    }
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341TraceFree(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    if (!DeviceExtension->TraceRing)
+        return;
+    ExFreePoolWithTag(DeviceExtension->TraceRing, CH341_TAG);
+    DeviceExtension->TraceRing = NULL;
+    DeviceExtension->TraceCapacity = 0;
+}
+
+VOID
+CH341TraceEvent(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ USHORT Event,
+    _In_ PVOID Id,
+    _In_ ULONG Length,
+    _In_ NTSTATUS Status) {
+    PCH341_TRACE_RECORD Record;
+    ULONG Sequence;
+    if (!DeviceExtension->TraceRing)
+        return;
+    Sequence = (ULONG)InterlockedIncrement(&DeviceExtension->TraceNext) - 1;
+    Record = &DeviceExtension->TraceRing[Sequence & (DeviceExtension->TraceCapacity - 1)];
+    (VOID)InterlockedExchange((volatile LONG *)&Record->Sequence, (LONG)MAXULONG);
+    Record->Timestamp = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+    Record->Id = CH341TraceHashId(DeviceExtension->TraceIdKey, (ULONGLONG)(ULONG_PTR)Id);
+    Record->Event = Event;
+    Record->Processor = (USHORT)KeGetCurrentProcessorNumberEx(NULL);
+    Record->Length = Length;
+    Record->Status = Status;
+    (VOID)InterlockedExchange((volatile LONG *)&Record->Sequence, (LONG)Sequence);
+}
+
+VOID
+CH341TraceCompleteIrp(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp) {
+    UCHAR MajorFunction = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+    if (MajorFunction == IRP_MJ_READ)
+        CH341LatencySince(DeviceExtension, CH341_LATENCY_READ_IRP, CH341IrpArrivalTime(Irp));
+    else if (MajorFunction == IRP_MJ_WRITE)
+        CH341LatencySince(DeviceExtension, CH341_LATENCY_WRITE_IRP, CH341IrpArrivalTime(Irp));
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_IRP_COMPLETE,
+                    Irp,
+                    (ULONG)Irp->IoStatus.Information,
+                    Irp->IoStatus.Status);
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS
+CH341TraceExport(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Out_writes_bytes_(BufferLength) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG_PTR Information) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PCH341_TRACE_HEADER Header = Buffer;
+    PCH341_TRACE_RECORD Records = (PCH341_TRACE_RECORD)(Header + 1);
+    PCH341_TRACE_RECORD Record;
+    LARGE_INTEGER Frequency;
+    ULONG Next;
+    ULONG Count;
+    ULONG Sequence;
+    ULONG Copied = 0;
+    *Information = 0;
+    if (BufferLength < sizeof(CH341_TRACE_HEADER))
+        return STATUS_BUFFER_TOO_SMALL;
+    if (!DeviceExtension->TraceRing)
+        return STATUS_NOT_SUPPORTED;
+    (VOID)KeQueryPerformanceCounter(&Frequency);
+    Next = (ULONG)ReadNoFence(&DeviceExtension->TraceNext);
+    Count = min(Next, DeviceExtension->TraceCapacity);
+    Count = min(Count, (BufferLength - sizeof(CH341_TRACE_HEADER)) / sizeof(CH341_TRACE_RECORD));
+    /* Newest records win if the buffer cannot hold them all */
+    for (Sequence = Next - Count; Sequence != Next; Sequence++) {
+        Record = &DeviceExtension->TraceRing[Sequence & (DeviceExtension->TraceCapacity - 1)];
+        if (ReadULongAcquire(&Record->Sequence) != Sequence)
+            continue;
+        Records[Copied] = *Record;
+        KeMemoryBarrier();
+        /* Overwritten while we were copying it */
+        if (ReadULongAcquire(&Record->Sequence) != Sequence)
+            continue;
+        Copied++;
+    }
+    Header->Version = CH341_TRACE_VERSION;
+    Header->RecordSize = sizeof(CH341_TRACE_RECORD);
+    Header->RecordCount = Copied;
+    Header->Capacity = DeviceExtension->TraceCapacity;
+    Header->NextSequence = Next;
+    Header->Reserved = 0;
+    Header->Frequency = Frequency.QuadPart;
+    *Information = sizeof(CH341_TRACE_HEADER) + Copied * sizeof(CH341_TRACE_RECORD);
+    return STATUS_SUCCESS;
+}
@@ -17,15 +17,66 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_USB
 #include "ch341.h"
 
+/*
+ * Vendor requests that bring the device up after it has been configured.
+ * A register write must only reach the chip if everything before it
+ * succeeded, so each write starts a new batch once the previous batch has
+ * completed. Reads have no side effects and go out together with the write
+ * ahead of them; the default pipe runs a batch back to back in table order.
+ * The first failure ends the sequence and the remaining steps are skipped.
+ */
+typedef struct _INIT_STEP {
+    UCHAR Request;
+    USHORT Value;
+    USHORT Index;
+} INIT_STEP;
+
+static const INIT_STEP InitSteps[] = {
+    { CH341_VENDOR_READ_REQUEST,  0x8484, 0    }, // expect: 2
+    { CH341_VENDOR_WRITE_REQUEST, 0x0404, 0    },
+    { CH341_VENDOR_READ_REQUEST,  0x8484, 0    }, // expect: 2
+    { CH341_VENDOR_READ_REQUEST,  0x8383, 0    }, // expect: 0
+    { CH341_VENDOR_READ_REQUEST,  0x8484, 0    }, // expect: 2
+    { CH341_VENDOR_WRITE_REQUEST, 0x0404, 0    },
+    { CH341_VENDOR_READ_REQUEST,  0x8484, 0    }, // expect: 2
+    { CH341_VENDOR_READ_REQUEST,  0x8383, 0    }, // expect: 0
+    { CH341_VENDOR_WRITE_REQUEST, 0,      1    },
+    { CH341_VENDOR_WRITE_REQUEST, 1,      0    },
+    { CH341_VENDOR_WRITE_REQUEST, 2,      0x44 }, // non-HX has 0x24 here instead of 0x44
+};
+
+#define CH341_INIT_STEP_COUNT RTL_NUMBER_OF(InitSteps)
+
+typedef struct _INIT_CONTEXT {
+    struct _INIT_BATCH *Batch;
+    PIRP Irp;
+    LARGE_INTEGER CompletionTime;
+    struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST Urb;
+    UCHAR Buffer[1];
+} INIT_CONTEXT, *PINIT_CONTEXT;
+
+typedef struct _INIT_BATCH {
+    KEVENT Event;
+    volatile LONG Outstanding;
+    INIT_CONTEXT Steps[CH341_INIT_STEP_COUNT];
+} INIT_BATCH, *PINIT_BATCH;
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI CH341UsbSubmitUrbCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+        _In_ PIRP Irp,
+        _In_reads_(sizeof(KEVENT)) PVOID Context);
 static NTSTATUS CH341UsbSubmitUrb(_In_ PDEVICE_OBJECT DeviceObject, _In_ PURB Urb);
 static NTSTATUS CH341UsbGetDescriptor(_In_ PDEVICE_OBJECT DeviceObject,
                                       _In_ UCHAR DescriptorType,
                                       _Out_ PVOID *Buffer,
                                       _Inout_ PULONG BufferLength);
 static NTSTATUS CH341UsbVendorRead(_In_ PDEVICE_OBJECT DeviceObject,
-                                   _Out_ UCHAR *Buffer,
+                                   _In_ UCHAR Request,
+                                   _Out_writes_bytes_(Length) UCHAR *Buffer,
+                                   _In_ ULONG Length,
                                    _In_ USHORT Value,
                                    _In_ USHORT Index);
 static NTSTATUS CH341UsbVendorWrite(_In_ PDEVICE_OBJECT DeviceObject,
@@ -36,28 +87,57 @@ static NTSTATUS CH341UsbConfigureDevice(_In_ PDEVICE_OBJECT DeviceObject,
                                         _In_ PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor);
 static NTSTATUS CH341UsbUnconfigureDevice(_In_ PDEVICE_OBJECT DeviceObject);
 _Function_class_(IO_COMPLETION_ROUTINE)
-static NTSTATUS NTAPI CH341UsbReadCompletion(_In_ PDEVICE_OBJECT DeviceObject,
-        _In_ PIRP Irp,
-        _In_reads_(sizeof(URB)) PVOID Context);
-_Function_class_(IO_COMPLETION_ROUTINE)
-static NTSTATUS NTAPI CH341UsbWriteCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+static NTSTATUS NTAPI CH341UsbInitStepCompletion(_In_ PDEVICE_OBJECT DeviceObject,
         _In_ PIRP Irp,
-        _In_reads_(sizeof(URB)) PVOID Context);
+        _In_reads_(sizeof(INIT_CONTEXT)) PVOID Context);
+static NTSTATUS CH341UsbRunInitSteps(_In_ PDEVICE_OBJECT DeviceObject);
+static NTSTATUS CH341UsbGetConfigDescriptor(_In_ PDEVICE_OBJECT DeviceObject,
+        _In_ PUSB_DEVICE_DESCRIPTOR DeviceDescriptor,
+        _Out_ PUSB_CONFIGURATION_DESCRIPTOR *ConfigDescriptor);
+static NTSTATUS CH341UsbWriteLineRegisters(_In_ PDEVICE_OBJECT DeviceObject,
+        _In_reads_(LineRegisterMaximum) const UCHAR *Values);
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, CH341UsbSubmitUrb)
+#pragma alloc_text(PAGE, CH341UsbAllocateControlIrp)
+#pragma alloc_text(PAGE, CH341UsbFreeControlIrp)
 #pragma alloc_text(PAGE, CH341UsbGetDescriptor)
 #pragma alloc_text(PAGE, CH341UsbVendorRead)
 #pragma alloc_text(PAGE, CH341UsbVendorWrite)
 #pragma alloc_text(PAGE, CH341UsbConfigureDevice)
 #pragma alloc_text(PAGE, CH341UsbUnconfigureDevice)
+#pragma alloc_text(PAGE, CH341UsbRunInitSteps)
+#pragma alloc_text(PAGE, CH341UsbGetConfigDescriptor)
+#pragma alloc_text(PAGE, CH341UsbFreeDescriptorCache)
 #pragma alloc_text(PAGE, CH341UsbStart)
 #pragma alloc_text(PAGE, CH341UsbStop)
+#pragma alloc_text(PAGE, CH341UsbAbortPipe)
+#pragma alloc_text(PAGE, CH341UsbWriteLineRegisters)
 #pragma alloc_text(PAGE, CH341UsbSetLine)
-#pragma alloc_text(PAGE, CH341UsbRead)
-#pragma alloc_text(PAGE, CH341UsbWrite)
+#pragma alloc_text(PAGE, CH341UsbSetBreak)
+#pragma alloc_text(PAGE, CH341UsbGetModemStatus)
 #endif /* defined ALLOC_PRAGMA */
 
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+CH341UsbSubmitUrbCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(KEVENT)) PVOID Context) {
+    PKEVENT Event = Context;
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+    (VOID)KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+/*
+ * Control transfers are serialized on ControlMutex and all go through the
+ * one IRP allocated at start, so this path never allocates. The IRP is
+ * recycled with IoReuseIrp before each use.
+ */
 static
 NTSTATUS
 CH341UsbSubmitUrb(
@@ -66,39 +146,95 @@ CH341UsbSubmitUrb(
     NTSTATUS Status;
     PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
     PIRP Irp;
-    IO_STATUS_BLOCK IoStatus;
     PIO_STACK_LOCATION IoStack;
-    KEVENT Event;
+    LARGE_INTEGER StartTime;
+    LARGE_INTEGER EndTime;
+    ULONGLONG Ticks;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Urb=%p\n",
+    CH341Verbose(       "%s. DeviceObject=%p, Urb=%p\n",
                         __FUNCTION__, DeviceObject,    Urb);
-    KeInitializeEvent(&Event, NotificationEvent, FALSE);
-    Irp = IoBuildDeviceIoControlRequest(IOCTL_INTERNAL_USB_SUBMIT_URB,
-                                        DeviceExtension->LowerDevice,
-                                        NULL,
-                                        0,
-                                        NULL,
-                                        0,
-                                        TRUE,
-                                        &Event,
-                                        &IoStatus);
-    if (!Irp) {
-        CH341Error(         "%s. Allocating IRP for submitting URB failed\n",
-                            __FUNCTION__);
+    Irp = DeviceExtension->ControlIrp;
+    NT_ASSERT(Irp);
+    if (!Irp)
         return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    ExAcquireFastMutex(&DeviceExtension->ControlMutex);
+    IoReuseIrp(Irp, STATUS_NOT_SUPPORTED);
+    KeClearEvent(&DeviceExtension->ControlEvent);
     IoStack = IoGetNextIrpStackLocation(Irp);
-    NT_ASSERT(IoStack->MajorFunction == IRP_MJ_INTERNAL_DEVICE_CONTROL);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
     IoStack->Parameters.Others.Argument1 = Urb;
+    IoSetCompletionRoutine(Irp,
+                           CH341UsbSubmitUrbCompletion,
+                           &DeviceExtension->ControlEvent,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    StartTime = KeQueryPerformanceCounter(NULL);
     Status = IoCallDriver(DeviceExtension->LowerDevice, Irp);
     if (Status == STATUS_PENDING) {
-        Status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, NULL);
+        Status = KeWaitForSingleObject(&DeviceExtension->ControlEvent,
+                                       Executive,
+                                       KernelMode,
+                                       FALSE,
+                                       NULL);
         NT_ASSERT(Status == STATUS_SUCCESS);
-        Status = IoStatus.Status;
     }
+    Status = Irp->IoStatus.Status;
+    EndTime = KeQueryPerformanceCounter(NULL);
+    Ticks = (ULONGLONG)(EndTime.QuadPart - StartTime.QuadPart);
+    DeviceExtension->ControlRequests++;
+    DeviceExtension->ControlTicksTotal += Ticks;
+    if (Ticks > DeviceExtension->ControlTicksMax)
+        DeviceExtension->ControlTicksMax = Ticks;
+    ExReleaseFastMutex(&DeviceExtension->ControlMutex);
+    CH341LatencyAdd(DeviceExtension, CH341_LATENCY_CONTROL, Ticks);
+    CH341StatsAdd(DeviceExtension, ControlTransfers, 1);
+    if (!NT_SUCCESS(Status) || !USBD_SUCCESS(Urb->UrbHeader.Status))
+        CH341StatsAdd(DeviceExtension, ControlErrors, 1);
     return Status;
 }
 
+NTSTATUS
+CH341UsbAllocateControlIrp(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    NT_ASSERT(!DeviceExtension->ControlIrp);
+    DeviceExtension->ControlIrp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize,
+                                  FALSE);
+    if (!DeviceExtension->ControlIrp) {
+        CH341Error(         "%s. Allocating control IRP failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    (VOID)KeQueryPerformanceCounter(&DeviceExtension->PerformanceFrequency);
+    DeviceExtension->ControlRequests = 0;
+    DeviceExtension->ControlTicksTotal = 0;
+    DeviceExtension->ControlTicksMax = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341UsbFreeControlIrp(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONGLONG Frequency;
+    PAGED_CODE();
+    if (!DeviceExtension->ControlIrp)
+        return;
+    Frequency = (ULONGLONG)DeviceExtension->PerformanceFrequency.QuadPart;
+    if (DeviceExtension->ControlRequests && Frequency) {
+        CH341Debug(         "%s. %lu control transfers, average %I64u us, max %I64u us\n",
+                            __FUNCTION__, DeviceExtension->ControlRequests,
+                            DeviceExtension->ControlTicksTotal * 1000000 /
+                            Frequency / DeviceExtension->ControlRequests,
+                            DeviceExtension->ControlTicksMax * 1000000 / Frequency);
+    }
+    IoFreeIrp(DeviceExtension->ControlIrp);
+    DeviceExtension->ControlIrp = NULL;
+}
+
 static
 NTSTATUS
 CH341UsbGetDescriptor(
@@ -114,9 +250,7 @@ CH341UsbGetDescriptor(
     NT_ASSERT(*BufferLength > 0);
     CH341Debug(         "%s. DeviceObject=%p, DescriptorType=%u, Buffer=%p, BufferLength=%p\n",
                         __FUNCTION__, DeviceObject,    DescriptorType,    Buffer,    BufferLength);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST),
-                                CH341_URB_TAG);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
@@ -126,7 +260,7 @@ CH341UsbGetDescriptor(
     if (!*Buffer) {
         CH341Error(         "%s. Allocating URB transfer buffer of size %lu failed\n",
                             __FUNCTION__, *BufferLength);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     UsbBuildGetDescriptorRequest(Urb,
@@ -144,7 +278,7 @@ CH341UsbGetDescriptor(
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
         ExFreePoolWithTag(*Buffer, CH341_TAG);
         *Buffer = NULL;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         *BufferLength = 0;
         return Status;
     }
@@ -154,12 +288,12 @@ CH341UsbGetDescriptor(
         Status = Urb->UrbHeader.Status;
         ExFreePoolWithTag(*Buffer, CH341_TAG);
         *Buffer = NULL;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         *BufferLength = 0;
         return Status;
     }
     *BufferLength = Urb->UrbControlDescriptorRequest.TransferBufferLength;
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
     return Status;
 }
 
@@ -167,17 +301,17 @@ static
 NTSTATUS
 CH341UsbVendorRead(
     _In_ PDEVICE_OBJECT DeviceObject,
-    _Out_ UCHAR *Buffer,
+    _In_ UCHAR Request,
+    _Out_writes_bytes_(Length) UCHAR *Buffer,
+    _In_ ULONG Length,
     _In_ USHORT Value,
     _In_ USHORT Index) {
     NTSTATUS Status;
     PURB Urb;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Buffer=%p, Value=0x%x, Index=0x%x\n",
-                        __FUNCTION__, DeviceObject,    Buffer,    Value,      Index);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                CH341_URB_TAG);
+    CH341Debug(         "%s. DeviceObject=%p, Request=0x%x, Buffer=%p, Length=%lu, Value=0x%x, Index=0x%x\n",
+                        __FUNCTION__, DeviceObject,    Request,      Buffer,    Length,     Value,      Index);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
@@ -188,33 +322,34 @@ CH341UsbVendorRead(
                           sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
                           USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
                           0,
-                          CH341_VENDOR_READ_REQUEST,
+                          Request,
                           Value,
                           Index,
                           Buffer,
                           NULL,
-                          1,
+                          Length,
                           NULL);
     Status = CH341UsbSubmitUrb(DeviceObject, Urb);
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSubmitUrb failed with %08lx, %08lx\n",
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
     if (!USBD_SUCCESS(Urb->UrbHeader.Status)) {
         CH341Error(         "%s. URB failed with %08lx\n",
                             __FUNCTION__, Urb->UrbHeader.Status);
         Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
-    CH341Debug(         "%s. Vendor Read 0x%x/0x%x returned length %lu: 0x%x\n",
-                        __FUNCTION__, Value,
+    CH341Debug(         "%s. Vendor Read 0x%x 0x%x/0x%x returned length %lu: 0x%x\n",
+                        __FUNCTION__, Request,
+                        Value,
                         Index,
                         Urb->UrbControlVendorClassRequest.TransferBufferLength,
                         Buffer[0]);
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
     return Status;
 }
 
@@ -229,9 +364,7 @@ CH341UsbVendorWrite(
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p, Value=0x%x, Index=0x%x\n",
                         __FUNCTION__, DeviceObject,    Value,      Index);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                CH341_URB_TAG);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
@@ -253,17 +386,17 @@ CH341UsbVendorWrite(
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSubmitUrb failed with %08lx, %08lx\n",
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
     if (!USBD_SUCCESS(Urb->UrbHeader.Status)) {
         CH341Error(         "%s. URB failed with %08lx\n",
                             __FUNCTION__, Urb->UrbHeader.Status);
         Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
     return Status;
 }
 
@@ -311,6 +444,7 @@ CH341UsbConfigureDevice(
                 USB_ENDPOINT_DIRECTION_OUT(PipeInfo->EndpointAddress) &&
                 !DeviceExtension->BulkOutPipe) {
             DeviceExtension->BulkOutPipe = PipeInfo->PipeHandle;
+            DeviceExtension->BulkOutPacketSize = PipeInfo->MaximumPacketSize;
         }
         if (PipeInfo->PipeType == UsbdPipeTypeInterrupt &&
                 USB_ENDPOINT_DIRECTION_IN(PipeInfo->EndpointAddress) &&
@@ -329,6 +463,8 @@ CH341UsbConfigureDevice(
         ExFreePoolWithTag(Urb, 0);
         return STATUS_DEVICE_CONFIGURATION_ERROR;
     }
+    if (!DeviceExtension->BulkOutPacketSize)
+        DeviceExtension->BulkOutPacketSize = CH341_DEFAULT_BULK_OUT_PACKET;
     ExFreePoolWithTag(Urb, 0);
     return Status;
 }
@@ -342,9 +478,7 @@ CH341UsbUnconfigureDevice(
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p\n",
                         __FUNCTION__, DeviceObject);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_SELECT_CONFIGURATION),
-                                CH341_URB_TAG);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
@@ -357,13 +491,243 @@ CH341UsbUnconfigureDevice(
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSubmitUrb failed with %08lx, %08lx\n",
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
     return Status;
 }
 
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+CH341UsbInitStepCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(INIT_CONTEXT)) PVOID Context) {
+    PINIT_CONTEXT Step = Context;
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Irp);
+    Step->CompletionTime = KeQueryPerformanceCounter(NULL);
+    if (InterlockedDecrement(&Step->Batch->Outstanding) == 0)
+        (VOID)KeSetEvent(&Step->Batch->Event, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static
+NTSTATUS
+CH341UsbRunInitSteps(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    NTSTATUS StepStatus;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PINIT_BATCH Batch;
+    PINIT_CONTEXT Step;
+    PIO_STACK_LOCATION IoStack;
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER StartTime;
+    LARGE_INTEGER SubmitTime;
+    LARGE_INTEGER PreviousTime;
+    ULONGLONG Elapsed;
+    BOOLEAN Read;
+    ULONG First;
+    ULONG End;
+    ULONG i;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    Batch = ExAllocatePoolWithTag(NonPagedPool, sizeof(*Batch), CH341_URB_TAG);
+    if (!Batch) {
+        CH341Error(         "%s. Allocating init batch failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Batch, sizeof(*Batch));
+    KeInitializeEvent(&Batch->Event, NotificationEvent, FALSE);
+    for (i = 0; i < CH341_INIT_STEP_COUNT; i++) {
+        Batch->Steps[i].Batch = Batch;
+        Batch->Steps[i].Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+        if (!Batch->Steps[i].Irp) {
+            CH341Error(         "%s. Allocating IRP for step %lu failed\n",
+                                __FUNCTION__, i);
+            while (i--)
+                IoFreeIrp(Batch->Steps[i].Irp);
+            ExFreePoolWithTag(Batch, CH341_URB_TAG);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    StartTime = KeQueryPerformanceCounter(&Frequency);
+    PreviousTime = StartTime;
+    for (First = 0; First < CH341_INIT_STEP_COUNT && NT_SUCCESS(Status); First = End) {
+        End = First + 1;
+        while (End < CH341_INIT_STEP_COUNT && InitSteps[End].Request != CH341_VENDOR_WRITE_REQUEST)
+            End++;
+        KeClearEvent(&Batch->Event);
+        Batch->Outstanding = (LONG)(End - First);
+        SubmitTime = KeQueryPerformanceCounter(NULL);
+        for (i = First; i < End; i++) {
+            Step = &Batch->Steps[i];
+            Read = InitSteps[i].Request == CH341_VENDOR_READ_REQUEST;
+            UsbBuildVendorRequest((PURB)&Step->Urb,
+                                  URB_FUNCTION_VENDOR_DEVICE,
+                                  sizeof(Step->Urb),
+                                  Read ? USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK :
+                                  USBD_TRANSFER_DIRECTION_OUT,
+                                  0,
+                                  InitSteps[i].Request,
+                                  InitSteps[i].Value,
+                                  InitSteps[i].Index,
+                                  Read ? Step->Buffer : NULL,
+                                  NULL,
+                                  Read ? sizeof(Step->Buffer) : 0,
+                                  NULL);
+            IoStack = IoGetNextIrpStackLocation(Step->Irp);
+            IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+            IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+            IoStack->Parameters.Others.Argument1 = &Step->Urb;
+            IoSetCompletionRoutine(Step->Irp,
+                                   CH341UsbInitStepCompletion,
+                                   Step,
+                                   TRUE,
+                                   TRUE,
+                                   TRUE);
+            (VOID)IoCallDriver(DeviceExtension->LowerDevice, Step->Irp);
+        }
+        (VOID)KeWaitForSingleObject(&Batch->Event,
+                                    Executive,
+                                    KernelMode,
+                                    FALSE,
+                                    NULL);
+        /* Each step took the time since the one before it, or since the submit */
+        PreviousTime = SubmitTime;
+        for (i = First; i < End; i++) {
+            Step = &Batch->Steps[i];
+            StepStatus = Step->Irp->IoStatus.Status;
+            if (NT_SUCCESS(StepStatus) && !USBD_SUCCESS(Step->Urb.Hdr.Status))
+                StepStatus = Step->Urb.Hdr.Status;
+            /* Completions may be reported out of order */
+            Elapsed = 0;
+            if (Step->CompletionTime.QuadPart > PreviousTime.QuadPart) {
+                Elapsed = (ULONGLONG)(Step->CompletionTime.QuadPart - PreviousTime.QuadPart);
+                PreviousTime = Step->CompletionTime;
+                CH341LatencyAdd(DeviceExtension, CH341_LATENCY_CONTROL, Elapsed);
+            }
+            CH341Debug(         "%s. Step %lu: request 0x%x 0x%x/0x%x, data 0x%x, status %08lx, %I64u us\n",
+                                __FUNCTION__, i, InitSteps[i].Request,
+                                InitSteps[i].Value, InitSteps[i].Index,
+                                Step->Buffer[0], StepStatus,
+                                Elapsed * 1000000 / (ULONGLONG)Frequency.QuadPart);
+            CH341StatsAdd(DeviceExtension, ControlTransfers, 1);
+            if (!NT_SUCCESS(StepStatus))
+                CH341StatsAdd(DeviceExtension, ControlErrors, 1);
+            if (!NT_SUCCESS(StepStatus) && NT_SUCCESS(Status)) {
+                CH341Error(         "%s. Step %lu failed with %08lx\n",
+                                    __FUNCTION__, i, StepStatus);
+                Status = StepStatus;
+            }
+        }
+    }
+    if (End < CH341_INIT_STEP_COUNT) {
+        CH341Error(         "%s. Skipped steps %lu to %lu\n",
+                            __FUNCTION__, End, (ULONG)CH341_INIT_STEP_COUNT - 1);
+    }
+    for (i = 0; i < CH341_INIT_STEP_COUNT; i++)
+        IoFreeIrp(Batch->Steps[i].Irp);
+    DeviceExtension->InitMicroseconds = (ULONG)((ULONGLONG)(PreviousTime.QuadPart - StartTime.QuadPart) *
+                                        1000000 / (ULONGLONG)Frequency.QuadPart);
+    CH341Debug(         "%s. %lu steps took %lu us\n",
+                        __FUNCTION__, (ULONG)CH341_INIT_STEP_COUNT, DeviceExtension->InitMicroseconds);
+    ExFreePoolWithTag(Batch, CH341_URB_TAG);
+    return Status;
+}
+
+/*
+ * The configuration descriptor is cached in the device extension and reused
+ * across start cycles for as long as the device descriptor reports the same
+ * VID/PID/bcdDevice. On a miss it is fetched with a buffer large enough for
+ * the whole CH341 configuration, so the usual header-then-full pair of
+ * requests collapses into one.
+ */
+static
+NTSTATUS
+CH341UsbGetConfigDescriptor(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PUSB_DEVICE_DESCRIPTOR DeviceDescriptor,
+    _Out_ PUSB_CONFIGURATION_DESCRIPTOR *ConfigDescriptor) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PVOID Descriptor;
+    ULONG DescriptorLength;
+    ULONG TotalLength;
+    PAGED_CODE();
+    *ConfigDescriptor = NULL;
+    if (DeviceExtension->ConfigDescriptor &&
+            DeviceExtension->CachedVendorId == DeviceDescriptor->idVendor &&
+            DeviceExtension->CachedProductId == DeviceDescriptor->idProduct &&
+            DeviceExtension->CachedBcdDevice == DeviceDescriptor->bcdDevice) {
+        /* Both configuration descriptor requests are skipped */
+        CH341StatsAdd(DeviceExtension, DescriptorFetchesSaved, 2);
+        CH341Debug(         "%s. Using cached configuration descriptor\n",
+                            __FUNCTION__);
+        *ConfigDescriptor = DeviceExtension->ConfigDescriptor;
+        return STATUS_SUCCESS;
+    }
+    CH341UsbFreeDescriptorCache(DeviceObject);
+    DescriptorLength = CH341_CONFIG_DESCRIPTOR_CACHE_SIZE;
+    Status = CH341UsbGetDescriptor(DeviceObject,
+                                   USB_CONFIGURATION_DESCRIPTOR_TYPE,
+                                   &Descriptor,
+                                   &DescriptorLength);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. CH341UsbGetDescriptor failed with %08lx\n",
+                            __FUNCTION__, Status);
+        return Status;
+    }
+    if (DescriptorLength < sizeof(USB_CONFIGURATION_DESCRIPTOR)) {
+        CH341Error(         "%s. Configuration descriptor too short (%lu)\n",
+                            __FUNCTION__, DescriptorLength);
+        ExFreePoolWithTag(Descriptor, CH341_TAG);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+    TotalLength = ((PUSB_CONFIGURATION_DESCRIPTOR)Descriptor)->wTotalLength;
+    NT_ASSERT(TotalLength != 0);
+    if (TotalLength > DescriptorLength) {
+        /* Larger than expected, fall back to fetching it at its full size */
+        ExFreePoolWithTag(Descriptor, CH341_TAG);
+        DescriptorLength = TotalLength;
+        Status = CH341UsbGetDescriptor(DeviceObject,
+                                       USB_CONFIGURATION_DESCRIPTOR_TYPE,
+                                       &Descriptor,
+                                       &DescriptorLength);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341UsbGetDescriptor failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+    } else {
+        CH341StatsAdd(DeviceExtension, DescriptorFetchesSaved, 1);
+    }
+    NT_ASSERT(DescriptorLength == ((PUSB_CONFIGURATION_DESCRIPTOR)Descriptor)->wTotalLength);
+    DeviceExtension->ConfigDescriptor = Descriptor;
+    DeviceExtension->CachedVendorId = DeviceDescriptor->idVendor;
+    DeviceExtension->CachedProductId = DeviceDescriptor->idProduct;
+    DeviceExtension->CachedBcdDevice = DeviceDescriptor->bcdDevice;
+    *ConfigDescriptor = Descriptor;
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341UsbFreeDescriptorCache(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PAGED_CODE();
+    if (!DeviceExtension->ConfigDescriptor)
+        return;
+    ExFreePoolWithTag(DeviceExtension->ConfigDescriptor, CH341_TAG);
+    DeviceExtension->ConfigDescriptor = NULL;
+}
+
 NTSTATUS
 CH341UsbStart(
     _In_ PDEVICE_OBJECT DeviceObject) {
@@ -373,12 +737,16 @@ CH341UsbStart(
     PUSB_DEVICE_DESCRIPTOR DeviceDescriptor;
     PUSB_CONFIGURATION_DESCRIPTOR ConfigDescriptor;
     PUSB_INTERFACE_DESCRIPTOR InterfaceDescriptor;
-    UCHAR Buffer[1];
     PDEVICE_EXTENSION DeviceExtension;
+    UCHAR Version[2];
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p\n",
                         __FUNCTION__, DeviceObject);
     DeviceExtension = DeviceObject->DeviceExtension;
+    /* The device is reset, so the line registers need a full write */
+    DeviceExtension->LineRegistersValid = FALSE;
+    DeviceExtension->BreakRegisterValid = FALSE;
+    DeviceExtension->BreakOn = FALSE;
     DescriptorLength = sizeof(USB_DEVICE_DESCRIPTOR);
     Status = CH341UsbGetDescriptor(DeviceObject,
                                    USB_DEVICE_DESCRIPTOR_TYPE,
@@ -423,33 +791,13 @@ CH341UsbStart(
     /* We only support CH341 HX right now */
     NT_ASSERT(DeviceDescriptor->bDeviceClass != USB_DEVICE_CLASS_COMMUNICATIONS);
     NT_ASSERT(DeviceDescriptor->bMaxPacketSize0 == 64);
+    Status = CH341UsbGetConfigDescriptor(DeviceObject, DeviceDescriptor, &ConfigDescriptor);
     ExFreePoolWithTag(Descriptor, CH341_TAG);
-    DescriptorLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
-    Status = CH341UsbGetDescriptor(DeviceObject,
-                                   USB_CONFIGURATION_DESCRIPTOR_TYPE,
-                                   &Descriptor,
-                                   &DescriptorLength);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbGetDescriptor failed with %08lx\n",
+        CH341Error(         "%s. CH341UsbGetConfigDescriptor failed with %08lx\n",
                             __FUNCTION__, Status);
         return Status;
     }
-    NT_ASSERT(DescriptorLength == sizeof(USB_CONFIGURATION_DESCRIPTOR));
-    ConfigDescriptor = Descriptor;
-    NT_ASSERT(ConfigDescriptor->wTotalLength != 0);
-    DescriptorLength = ConfigDescriptor->wTotalLength;
-    ExFreePoolWithTag(Descriptor, CH341_TAG);
-    Status = CH341UsbGetDescriptor(DeviceObject,
-                                   USB_CONFIGURATION_DESCRIPTOR_TYPE,
-                                   &Descriptor,
-                                   &DescriptorLength);
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbGetDescriptor failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    ConfigDescriptor = Descriptor;
-    NT_ASSERT(DescriptorLength == ConfigDescriptor->wTotalLength);
     CH341Debug(         "%s. Config descriptor: "
                         "bLength=%u, "
                         "bDescriptorType=%u, "
@@ -470,7 +818,6 @@ CH341UsbStart(
     if (ConfigDescriptor->bNumInterfaces != 1) {
         CH341Error(         "%s. Configuration contains %u interfaces, expected one\n",
                             __FUNCTION__, ConfigDescriptor->bNumInterfaces);
-        ExFreePoolWithTag(Descriptor, CH341_TAG);
         return STATUS_DEVICE_CONFIGURATION_ERROR;
     }
     InterfaceDescriptor = USBD_ParseConfigurationDescriptorEx(ConfigDescriptor,
@@ -483,7 +830,6 @@ CH341UsbStart(
     if (!InterfaceDescriptor) {
         CH341Error(         "%s. USBD_ParseConfigurationDescriptorEx failed\n",
                             __FUNCTION__);
-        ExFreePoolWithTag(Descriptor, CH341_TAG);
         return STATUS_DEVICE_CONFIGURATION_ERROR;
     }
     CH341Debug(         "%s. Interface descriptor: "
@@ -509,74 +855,25 @@ CH341UsbStart(
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbConfigureDevice failed with %08lx\n",
                             __FUNCTION__, Status);
-        ExFreePoolWithTag(Descriptor, CH341_TAG);
-        return Status;
-    }
-    ExFreePoolWithTag(Descriptor, CH341_TAG);
-    /* TODO: Buffer should probably be nonpaged */
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[1] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorWrite(DeviceObject, 0x0404, 0);
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorWrite[2] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[3] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8383, 0); // expect: 0
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[4] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[5] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorWrite(DeviceObject, 0x0404, 0);
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorWrite[6] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8484, 0); // expect: 2
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[7] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorRead(DeviceObject, Buffer, 0x8383, 0); // expect: 0
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorRead[8] failed with %08lx\n",
-                            __FUNCTION__, Status);
         return Status;
     }
-    Status = CH341UsbVendorWrite(DeviceObject, 0, 1);
+    Status = CH341UsbVendorRead(DeviceObject,
+                                CH341_GET_VERSION_REQUEST,
+                                Version,
+                                sizeof(Version),
+                                0,
+                                0);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorWrite[9] failed with %08lx\n",
+        CH341Error(         "%s. Reading the chip version failed with %08lx\n",
                             __FUNCTION__, Status);
         return Status;
     }
-    Status = CH341UsbVendorWrite(DeviceObject, 1, 0);
+    DeviceExtension->ChipVersion = Version[0];
+    CH341Debug(         "%s. Chip version 0x%02x\n",
+                        __FUNCTION__, DeviceExtension->ChipVersion);
+    Status = CH341UsbRunInitSteps(DeviceObject);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorWrite[10] failed with %08lx\n",
-                            __FUNCTION__, Status);
-        return Status;
-    }
-    Status = CH341UsbVendorWrite(DeviceObject, 2, 0x44); // non-HX has 0x24 here instead of 0x44
-    if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. CH341UsbVendorWrite[11] failed with %08lx\n",
+        CH341Error(         "%s. CH341UsbRunInitSteps failed with %08lx\n",
                             __FUNCTION__, Status);
         return Status;
     }
@@ -595,93 +892,194 @@ CH341UsbStop(
 }
 
 NTSTATUS
-CH341UsbSetLine(
+CH341UsbAbortPipe(
     _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ ULONG BaudRate,
-    _In_ UCHAR StopBits,
-    _In_ UCHAR Parity,
-    _In_ UCHAR DataBits) {
+    _In_ USBD_PIPE_HANDLE PipeHandle) {
     NTSTATUS Status;
-    struct _LINE {
-        ULONG BaudRate;
-        UCHAR StopBits;
-        UCHAR Parity;
-        UCHAR DataBits;
-    } Line;
     PURB Urb;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, BaudRate=%lu, StopBits=%u, Parity=%u, "
-                        "DataBits=%u\n",
-                        __FUNCTION__, DeviceObject,    BaudRate,     StopBits,    Parity,
-                        DataBits);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                CH341_URB_TAG);
+    CH341Debug(         "%s. DeviceObject=%p, PipeHandle=%p\n",
+                        __FUNCTION__, DeviceObject,    PipeHandle);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
-    UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_CLASS_DEVICE,
-                          sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                          USBD_TRANSFER_DIRECTION_OUT,
-                          0,
-                          CH341_SET_LINE_REQUEST,
-                          0,
-                          0,
-                          &Line,
-                          NULL,
-                          sizeof(Line),
-                          NULL);
-    /* TODO: this should probably be nonpaged */
-    Line.BaudRate = BaudRate;
-    Line.StopBits = StopBits;
-    Line.Parity = Parity;
-    Line.DataBits = DataBits;
+    Urb->UrbHeader.Length = sizeof(struct _URB_PIPE_REQUEST);
+    Urb->UrbHeader.Function = URB_FUNCTION_ABORT_PIPE;
+    Urb->UrbPipeRequest.PipeHandle = PipeHandle;
     Status = CH341UsbSubmitUrb(DeviceObject, Urb);
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSubmitUrb failed with %08lx, %08lx\n",
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
     if (!USBD_SUCCESS(Urb->UrbHeader.Status)) {
         CH341Error(         "%s. URB failed with %08lx\n",
                             __FUNCTION__, Urb->UrbHeader.Status);
         Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
+    return Status;
+}
+
+/*
+ * LineRegisters mirrors what was last written to the prescaler, divisor and
+ * line control registers. Only registers that differ from it are sent, two
+ * per vendor write, so that re-applying an unchanged line setting costs no
+ * USB traffic. Callers serialize through LineStateMutex.
+ */
+static
+NTSTATUS
+CH341UsbWriteLineRegisters(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_reads_(LineRegisterMaximum) const UCHAR *Values) {
+    static const UCHAR Address[LineRegisterMaximum] = {
+        CH341_REG_PRESCALER,
+        CH341_REG_DIVISOR,
+        CH341_REG_LCR,
+        CH341_REG_LCR2,
+    };
+    NTSTATUS Status = STATUS_SUCCESS;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    ULONG Changed[LineRegisterMaximum];
+    ULONG Count = 0;
+    ULONG Writes = 0;
+    ULONG First;
+    ULONG Second;
+    ULONG i;
+    PAGED_CODE();
+    for (i = 0; i < LineRegisterMaximum; i++) {
+        if (!DeviceExtension->LineRegistersValid ||
+                DeviceExtension->LineRegisters[i] != Values[i])
+            Changed[Count++] = i;
+    }
+    for (i = 0; i < Count; i += 2) {
+        First = Changed[i];
+        /* A lone register goes out with its unchanged neighbour */
+        Second = i + 1 < Count ? Changed[i + 1] : First ^ 1;
+        Status = CH341UsbVendorWrite(DeviceObject,
+                                     Address[Second] << 8 | Address[First],
+                                     Values[Second] << 8 | Values[First]);
+        Writes++;
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. Writing register 0x%02x failed with %08lx\n",
+                                __FUNCTION__, Address[First], Status);
+            /* The device state is unknown now */
+            DeviceExtension->LineRegistersValid = FALSE;
+            CH341StatsAdd(DeviceExtension, LineWritesIssued, Writes);
+            return Status;
+        }
+    }
+    RtlCopyMemory(DeviceExtension->LineRegisters, Values, sizeof(DeviceExtension->LineRegisters));
+    DeviceExtension->LineRegistersValid = TRUE;
+    CH341StatsAdd(DeviceExtension, LineWritesIssued, Writes);
+    CH341StatsAdd(DeviceExtension, LineWritesSkipped, LineRegisterMaximum / 2 - Writes);
     return Status;
 }
 
+NTSTATUS
+CH341UsbSetLine(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ ULONG BaudRate,
+    _In_ UCHAR StopBits,
+    _In_ UCHAR Parity,
+    _In_ UCHAR DataBits) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    BAUD_DIVISOR Divisor;
+    UCHAR Lcr;
+    UCHAR Values[LineRegisterMaximum];
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, BaudRate=%lu, StopBits=%u, Parity=%u, "
+                        "DataBits=%u\n",
+                        __FUNCTION__, DeviceObject,    BaudRate,     StopBits,    Parity,
+                        DataBits);
+    Status = CH341ComputeBaudDivisor(BaudRate, &Divisor);
+    if (!NT_SUCCESS(Status)) {
+        CH341Error(         "%s. Baud rate %lu is not supported\n",
+                            __FUNCTION__, BaudRate);
+        return Status;
+    }
+    CH341Debug(         "%s. Prescaler=0x%02x, Divisor=0x%02x, ActualRate=%lu, Error=%ld ppm\n",
+                        __FUNCTION__, Divisor.Prescaler, Divisor.Divisor,
+                        Divisor.ActualRate, Divisor.ErrorPpm);
+    Lcr = CH341_LCR_ENABLE_RX | CH341_LCR_ENABLE_TX;
+    switch (DataBits) {
+    case 5:
+        Lcr |= CH341_LCR_CS5;
+        break;
+    case 6:
+        Lcr |= CH341_LCR_CS6;
+        break;
+    case 7:
+        Lcr |= CH341_LCR_CS7;
+        break;
+    default:
+        Lcr |= CH341_LCR_CS8;
+        break;
+    }
+    switch (Parity) {
+    case ODD_PARITY:
+        Lcr |= CH341_LCR_ENABLE_PAR;
+        break;
+    case EVEN_PARITY:
+        Lcr |= CH341_LCR_ENABLE_PAR | CH341_LCR_PAR_EVEN;
+        break;
+    case MARK_PARITY:
+        Lcr |= CH341_LCR_ENABLE_PAR | CH341_LCR_MARK_SPACE;
+        break;
+    case SPACE_PARITY:
+        Lcr |= CH341_LCR_ENABLE_PAR | CH341_LCR_MARK_SPACE | CH341_LCR_PAR_EVEN;
+        break;
+    }
+    /* The CH341 has no 1.5 stop bit mode, 2 is the closest */
+    if (StopBits != STOP_BIT_1)
+        Lcr |= CH341_LCR_STOP_BITS_2;
+    /* Turning the transmitter back on would end a break */
+    if (DeviceExtension->BreakOn)
+        Lcr &= ~CH341_LCR_ENABLE_TX;
+    Values[LineRegisterPrescaler] = Divisor.Prescaler;
+    if (DeviceExtension->ChipVersion >= CH341_PRESCALER_NO_WAIT_VERSION)
+        Values[LineRegisterPrescaler] |= CH341_PRESCALER_NO_WAIT;
+    Values[LineRegisterDivisor] = Divisor.Divisor;
+    Values[LineRegisterLcr] = Lcr;
+    Values[LineRegisterLcr2] = 0;
+    return CH341UsbWriteLineRegisters(DeviceObject, Values);
+}
+
 NTSTATUS
 CH341UsbSetControlLines(
     _In_ PDEVICE_OBJECT DeviceObject,
     _In_ USHORT DtrRts) {
     NTSTATUS Status;
     PURB Urb;
+    USHORT Value = 0;
     PAGED_CODE();
     CH341Debug(         "%s. DeviceObject=%p, DtrRts=%u\n",
                         __FUNCTION__, DeviceObject,    DtrRts);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
-                                CH341_URB_TAG);
+    Urb = CH341UrbAllocate(DeviceObject, UrbPoolControl);
     if (!Urb) {
         CH341Error(         "%s. Allocating URB failed\n",
                             __FUNCTION__);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
     NT_ASSERT((DtrRts & ~(SERIAL_DTR_STATE | SERIAL_RTS_STATE)) == 0);
+    if (DtrRts & SERIAL_DTR_STATE)
+        Value |= CH341_MODEM_CTRL_DTR;
+    if (DtrRts & SERIAL_RTS_STATE)
+        Value |= CH341_MODEM_CTRL_RTS;
     UsbBuildVendorRequest(Urb,
-                          URB_FUNCTION_CLASS_DEVICE,
+                          URB_FUNCTION_VENDOR_DEVICE,
                           sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
                           USBD_TRANSFER_DIRECTION_OUT,
                           0,
-                          CH341_SET_CONTROL_REQUEST,
-                          DtrRts,
+                          CH341_MODEM_CTRL_REQUEST,
+                          (USHORT)~Value,
                           0,
                           NULL,
                           NULL,
@@ -691,181 +1089,98 @@ CH341UsbSetControlLines(
     if (!NT_SUCCESS(Status)) {
         CH341Error(         "%s. CH341UsbSubmitUrb failed with %08lx, %08lx\n",
                             __FUNCTION__, Status, Urb->UrbHeader.Status);
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
     if (!USBD_SUCCESS(Urb->UrbHeader.Status)) {
         CH341Error(         "%s. URB failed with %08lx\n",
                             __FUNCTION__, Urb->UrbHeader.Status);
         Status = Urb->UrbHeader.Status;
-        ExFreePoolWithTag(Urb, CH341_URB_TAG);
+        CH341UrbFree(DeviceObject, Urb);
         return Status;
     }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
+    CH341UrbFree(DeviceObject, Urb);
     return Status;
 }
 
-_Function_class_(IO_COMPLETION_ROUTINE)
-static
-NTSTATUS
-NTAPI
-CH341UsbReadCompletion(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp,
-    _In_reads_(sizeof(URB)) PVOID Context) {
-    PURB Urb = Context;
-    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p, Context=%p\n",
-                        __FUNCTION__, DeviceObject,    Irp,    Context);
-    if (NT_SUCCESS(Irp->IoStatus.Status)) {
-        if (USBD_SUCCESS(Urb->UrbHeader.Status))
-            Irp->IoStatus.Information = Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
-        else
-            CH341Warn(         "%s. URB failed with %08lx\n",
-                               __FUNCTION__, Urb->UrbHeader.Status);
-    } else {
-        CH341Warn(         "%s. IRP failed with %08lx\n",
-                           __FUNCTION__, Irp->IoStatus.Status);
-    }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
-    return STATUS_CONTINUE_COMPLETION;
-}
-
+/*
+ * The CH341 holds break while both the break bit in register 0x05 and the
+ * transmitter enable in the LCR are clear. The two are next to each other,
+ * so one vendor write sets both. Register 0x05 is read once per start, the
+ * LCR comes from LineRegisters. Callers serialize through LineStateMutex.
+ */
 NTSTATUS
-CH341UsbRead(
+CH341UsbSetBreak(
     _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp) {
+    _In_ BOOLEAN On) {
     NTSTATUS Status;
     PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PURB Urb;
-    PIO_STACK_LOCATION IoStack;
+    UCHAR Buffer[2];
+    UCHAR Lcr;
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                        __FUNCTION__, DeviceObject,    Irp);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                CH341_URB_TAG);
-    if (!Urb) {
-        CH341Error(         "%s. Allocating URB failed\n",
-                            __FUNCTION__);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
+    CH341Debug(         "%s. DeviceObject=%p, On=%u\n",
+                        __FUNCTION__, DeviceObject,    On);
+    if (!DeviceExtension->BreakRegisterValid || !DeviceExtension->LineRegistersValid) {
+        Status = CH341UsbVendorRead(DeviceObject,
+                                    CH341_VENDOR_READ_REQUEST,
+                                    Buffer,
+                                    sizeof(Buffer),
+                                    CH341_REG_LCR << 8 | CH341_REG_BREAK,
+                                    0);
+        if (!NT_SUCCESS(Status)) {
+            CH341Error(         "%s. CH341UsbVendorRead failed with %08lx\n",
+                                __FUNCTION__, Status);
+            return Status;
+        }
+        DeviceExtension->BreakRegister = Buffer[0] | CH341_BREAK_OFF;
+        DeviceExtension->BreakRegisterValid = TRUE;
+        Lcr = Buffer[1];
+    } else {
+        Lcr = DeviceExtension->LineRegisters[LineRegisterLcr];
     }
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    UsbBuildInterruptOrBulkTransferRequest(Urb,
-                                           sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                           DeviceExtension->BulkInPipe,
-                                           Irp->AssociatedIrp.SystemBuffer,
-                                           NULL,
-                                           IoStack->Parameters.Read.Length,
-                                           USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
-                                           NULL);
-    IoStack = IoGetNextIrpStackLocation(Irp);
-    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-    IoStack->Parameters.Others.Argument1 = Urb;
-    Status = IoSetCompletionRoutineEx(DeviceObject,
-                                      Irp,
-                                      CH341UsbReadCompletion,
-                                      Urb,
-                                      TRUE,
-                                      TRUE,
-                                      TRUE);
+    if (On)
+        Lcr &= ~CH341_LCR_ENABLE_TX;
+    else
+        Lcr |= CH341_LCR_ENABLE_TX;
+    Status = CH341UsbVendorWrite(DeviceObject,
+                                 CH341_REG_LCR << 8 | CH341_REG_BREAK,
+                                 Lcr << 8 |
+                                 (On ? DeviceExtension->BreakRegister & ~CH341_BREAK_OFF :
+                                  DeviceExtension->BreakRegister));
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. IoSetCompletionRoutineEx failed with %08lx\n",
+        CH341Error(         "%s. CH341UsbVendorWrite failed with %08lx\n",
                             __FUNCTION__, Status);
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        DeviceExtension->LineRegistersValid = FALSE;
         return Status;
     }
-    IoMarkIrpPending(Irp);
-    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Irp);
-    return STATUS_PENDING;
-}
-
-
-_Function_class_(IO_COMPLETION_ROUTINE)
-static
-NTSTATUS
-NTAPI
-CH341UsbWriteCompletion(
-    _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp,
-    _In_reads_(sizeof(URB)) PVOID Context) {
-    PURB Urb = Context;
-    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p, Context=%p\n",
-                        __FUNCTION__, DeviceObject,    Irp,    Context);
-    if (NT_SUCCESS(Irp->IoStatus.Status)) {
-        if (USBD_SUCCESS(Urb->UrbHeader.Status))
-            Irp->IoStatus.Information = Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
-        else
-            CH341Warn(         "%s. URB failed with %08lx\n",
-                               __FUNCTION__, Urb->UrbHeader.Status);
-    } else {
-        CH341Warn(         "%s. IRP failed with %08lx\n",
-                           __FUNCTION__, Irp->IoStatus.Status);
-    }
-    ExFreePoolWithTag(Urb, CH341_URB_TAG);
-    return STATUS_CONTINUE_COMPLETION;
+    if (DeviceExtension->LineRegistersValid)
+        DeviceExtension->LineRegisters[LineRegisterLcr] = Lcr;
+    DeviceExtension->BreakOn = On;
+    return Status;
 }
 
 NTSTATUS
-CH341UsbWrite(
+CH341UsbGetModemStatus(
     _In_ PDEVICE_OBJECT DeviceObject,
-    _In_ PIRP Irp) {
+    _Out_ PUCHAR Lines) {
     NTSTATUS Status;
-    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
-    PURB Urb;
-    PIO_STACK_LOCATION IoStack;
+    UCHAR Buffer[1];
     PAGED_CODE();
-    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
-                        __FUNCTION__, DeviceObject,    Irp);
-    Urb = ExAllocatePoolWithTag(NonPagedPool,
-                                sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                CH341_URB_TAG);
-    if (!Urb) {
-        CH341Error(         "%s. Allocating URB failed\n",
-                            __FUNCTION__);
-        Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        return Status;
-    }
-    IoStack = IoGetCurrentIrpStackLocation(Irp);
-    UsbBuildInterruptOrBulkTransferRequest(Urb,
-                                           sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-                                           DeviceExtension->BulkOutPipe,
-                                           Irp->AssociatedIrp.SystemBuffer,
-                                           NULL,
-                                           IoStack->Parameters.Write.Length,
-                                           USBD_TRANSFER_DIRECTION_OUT,
-                                           NULL);
-    IoStack = IoGetNextIrpStackLocation(Irp);
-    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-    IoStack->Parameters.Others.Argument1 = Urb;
-    Status = IoSetCompletionRoutineEx(DeviceObject,
-                                      Irp,
-                                      CH341UsbWriteCompletion,
-                                      Urb,
-                                      TRUE,
-                                      TRUE,
-                                      TRUE);
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    Status = CH341UsbVendorRead(DeviceObject,
+                                CH341_VENDOR_READ_REQUEST,
+                                Buffer,
+                                sizeof(Buffer),
+                                CH341_STATUS_REGISTER,
+                                0);
     if (!NT_SUCCESS(Status)) {
-        CH341Error(         "%s. IoSetCompletionRoutineEx failed with %08lx\n",
+        CH341Error(         "%s. CH341UsbVendorRead failed with %08lx\n",
                             __FUNCTION__, Status);
-        Irp->IoStatus.Information = 0;
-        Irp->IoStatus.Status = Status;
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        *Lines = 0;
         return Status;
     }
-    IoMarkIrpPending(Irp);
-    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Irp);
-    return STATUS_PENDING;
+    /* The modem lines are reported inverted */
+    *Lines = ~Buffer[0] & CH341_STATUS_MASK;
+    return Status;
 }
\ No newline at end of file
@@ -0,0 +1,968 @@
+/*
+ * CH341 Driver write routines
+ * Copyright (C) 2012-2019  Thomas Faber
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define CH341_TRACE_SUBSYSTEM CH341_TRACE_WRITE
+#include "ch341.h"
+
+/*
+ * Write IRPs are queued on TxQueue and their data is copied, in order, into
+ * up to WriteUrbCount bulk OUT transfers of at most CH341_TX_BUFFER_SIZE
+ * bytes each. Large writes are split across several transfers, small ones
+ * share a transfer. Transfers are retired strictly in submission order, and
+ * a write IRP completes when the transfer carrying its last byte retires.
+ *
+ * With WriteCoalescing enabled, less than a packet's worth of data is held
+ * back until WriteCoalesceDeadline microseconds have passed or a flush is
+ * requested, so that byte-at-a-time writers do not cost a frame per byte.
+ *
+ * Only the head of TxQueue can be partially transferred; all other queued
+ * IRPs remain cancelable. Only one thread at a time (TxSubmitting) hands
+ * transfers to the lower driver, so they reach the pipe in order.
+ *
+ * While HoldReasons is non-zero no queued data is sent. Flow control and
+ * immediate characters are still sent, in a transfer of their own, ahead
+ * of any queued data.
+ *
+ * The write total timeout (multiplier * length + constant) is taken from
+ * SERIAL_TIMEOUTS when the IRP arrives and runs from when it becomes the
+ * head of TxQueue, so a hold cannot keep a write pending forever. A head
+ * that times out partially sent reports the bytes already handed to
+ * transfers.
+ */
+
+_Requires_lock_held_(DeviceExtension->TxLock)
+static PWRITE_CONTEXT CH341TxPrepare(_In_ PDEVICE_EXTENSION DeviceExtension);
+_Requires_lock_held_(DeviceExtension->TxLock)
+_Releases_lock_(DeviceExtension->TxLock)
+static VOID CH341TxKick(_In_ PDEVICE_EXTENSION DeviceExtension,
+                        _In_ KIRQL OldIrql);
+static VOID CH341TxSubmit(_In_ PWRITE_CONTEXT Context);
+_Function_class_(IO_COMPLETION_ROUTINE)
+static NTSTATUS NTAPI CH341TxCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                                        _In_ PIRP Irp,
+                                        _In_reads_(sizeof(WRITE_CONTEXT)) PVOID Context);
+_Requires_lock_held_(DeviceExtension->TxLock)
+static VOID CH341TxRetire(_In_ PDEVICE_EXTENSION DeviceExtension,
+                          _In_ PWRITE_CONTEXT Context,
+                          _Inout_ PLIST_ENTRY CompleteList);
+_Requires_lock_held_(DeviceExtension->TxLock)
+static VOID CH341TxRetireFlushes(_In_ PDEVICE_EXTENSION DeviceExtension,
+                                 _In_ NTSTATUS Status,
+                                 _Inout_ PLIST_ENTRY CompleteList);
+static EXT_CALLBACK CH341TxDeadline;
+_Requires_lock_held_(DeviceExtension->TxLock)
+static VOID CH341TxArmTimeout(_In_ PDEVICE_EXTENSION DeviceExtension);
+_Requires_lock_held_(DeviceExtension->TxLock)
+static VOID CH341TxDetachHead(_In_ PDEVICE_EXTENSION DeviceExtension,
+                              _In_ PIRP Irp);
+static EXT_CALLBACK CH341TxTimeout;
+static VOID CH341WriteFreeContexts(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID CH341WriteAbort(_In_ PDEVICE_OBJECT DeviceObject);
+static VOID CH341WriteCompleteList(_In_ PDEVICE_EXTENSION DeviceExtension,
+                                   _Inout_ PLIST_ENTRY CompleteList);
+static DRIVER_CANCEL CH341WriteCancel;
+static DRIVER_CANCEL CH341FlushCancel;
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, CH341StartWriteEngine)
+#pragma alloc_text(PAGE, CH341StopWriteEngine)
+#pragma alloc_text(PAGE, CH341WriteFreeContexts)
+#endif /* defined ALLOC_PRAGMA */
+
+/*
+ * With direct I/O, writes of at least DirectIoThreshold bytes get a transfer
+ * of their own that points the URB at the caller's MDL. Smaller ones are
+ * still copied and coalesced.
+ */
+static
+inline
+BOOLEAN
+CH341TxIsDirect(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp) {
+    return Irp->MdlAddress &&
+           DeviceExtension->DirectIoThreshold &&
+           IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length >= DeviceExtension->DirectIoThreshold;
+}
+
+/* Moves a filled context from TxFreeList to TxInFlightList */
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+inline
+PWRITE_CONTEXT
+CH341TxClaim(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PWRITE_CONTEXT Context) {
+    RemoveEntryList(&Context->ListEntry);
+    Context->Done = FALSE;
+    InsertTailList(&DeviceExtension->TxInFlightList, &Context->ListEntry);
+    DeviceExtension->TxInFlightBytes += Context->Length;
+    KeClearEvent(&DeviceExtension->TxIdleEvent);
+    return Context;
+}
+
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+PWRITE_CONTEXT
+CH341TxPrepare(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    PWRITE_CONTEXT Context;
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    PIO_STACK_LOCATION IoStack;
+    ULONG Chunk;
+    BOOLEAN Direct;
+    if (!DeviceExtension->TxRunning ||
+            IsListEmpty(&DeviceExtension->TxFreeList))
+        return NULL;
+    Context = CONTAINING_RECORD(DeviceExtension->TxFreeList.Flink, WRITE_CONTEXT, ListEntry);
+    Context->Length = 0;
+    Context->Mdl = NULL;
+    Context->PartialIrp = NULL;
+    /* Flow control and immediate characters jump the queue and ignore holds */
+    if (DeviceExtension->TxFlowCharPending) {
+        Context->Buffer[Context->Length++] = DeviceExtension->TxFlowChar;
+        DeviceExtension->TxFlowCharPending = FALSE;
+    }
+    if (DeviceExtension->TxImmediateCharPending) {
+        Context->Buffer[Context->Length++] = DeviceExtension->TxImmediateChar;
+        DeviceExtension->TxImmediateCharPending = FALSE;
+    }
+    if (Context->Length)
+        return CH341TxClaim(DeviceExtension, Context);
+    if (!DeviceExtension->TxQueuedBytes ||
+            DeviceExtension->HoldReasons)
+        return NULL;
+    if (DeviceExtension->WriteCoalescing &&
+            DeviceExtension->TxQueuedBytes < DeviceExtension->BulkOutPacketSize &&
+            !DeviceExtension->TxFlushPending) {
+        if (!DeviceExtension->TxTimerArmed) {
+            DeviceExtension->TxTimerArmed = TRUE;
+            (VOID)ExSetTimer(DeviceExtension->TxTimer,
+                             -(LONGLONG)DeviceExtension->WriteCoalesceDeadline * 10,
+                             0,
+                             NULL);
+        }
+        return NULL;
+    }
+    if (DeviceExtension->TxTimerArmed) {
+        DeviceExtension->TxTimerArmed = FALSE;
+        (VOID)ExCancelTimer(DeviceExtension->TxTimer, NULL);
+    }
+    while (!IsListEmpty(&DeviceExtension->TxQueue) &&
+            Context->Length < sizeof(Context->Buffer)) {
+        ListEntry = DeviceExtension->TxQueue.Flink;
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        IoStack = IoGetCurrentIrpStackLocation(Irp);
+        if (!DeviceExtension->TxHeadOffset) {
+            Direct = CH341TxIsDirect(DeviceExtension, Irp);
+            /* Send what is already packed first */
+            if (Direct && Context->Length)
+                break;
+            if (!IoSetCancelRoutine(Irp, NULL)) {
+                /* CH341WriteCancel owns this one and will complete it */
+                RemoveEntryList(ListEntry);
+                InitializeListHead(ListEntry);
+                DeviceExtension->TxQueuedBytes -= IoStack->Parameters.Write.Length;
+                continue;
+            }
+            /* Collects the first failure of any of the IRP's transfers */
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            CH341LatencySince(DeviceExtension, CH341_LATENCY_WRITE_DISPATCH, CH341IrpArrivalTime(Irp));
+            if (Direct) {
+                Context->Mdl = Irp->MdlAddress;
+                Context->Length = IoStack->Parameters.Write.Length;
+                DeviceExtension->TxQueuedBytes -= Context->Length;
+                RemoveEntryList(ListEntry);
+                InsertTailList(&Context->CompleteList, ListEntry);
+                break;
+            }
+        }
+        Chunk = min(IoStack->Parameters.Write.Length - DeviceExtension->TxHeadOffset,
+                    sizeof(Context->Buffer) - Context->Length);
+        RtlCopyMemory(Context->Buffer + Context->Length,
+                      CH341IrpBuffer(Irp) + DeviceExtension->TxHeadOffset,
+                      Chunk);
+        Context->Length += Chunk;
+        DeviceExtension->TxHeadOffset += Chunk;
+        DeviceExtension->TxQueuedBytes -= Chunk;
+        if (DeviceExtension->TxHeadOffset == IoStack->Parameters.Write.Length) {
+            RemoveEntryList(ListEntry);
+            InsertTailList(&Context->CompleteList, ListEntry);
+            DeviceExtension->TxHeadOffset = 0;
+        } else {
+            Context->PartialIrp = Irp;
+        }
+    }
+    if (!DeviceExtension->TxQueuedBytes)
+        DeviceExtension->TxFlushPending = FALSE;
+    if (!Context->Length)
+        return NULL;
+    return CH341TxClaim(DeviceExtension, Context);
+}
+
+_Requires_lock_held_(DeviceExtension->TxLock)
+_Releases_lock_(DeviceExtension->TxLock)
+static
+VOID
+CH341TxKick(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ KIRQL OldIrql) {
+    PWRITE_CONTEXT Next;
+    if (DeviceExtension->TxSubmitting) {
+        /* The submitting thread picks up whatever we queued */
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return;
+    }
+    DeviceExtension->TxSubmitting = TRUE;
+    while ((Next = CH341TxPrepare(DeviceExtension)) != NULL) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        CH341TxSubmit(Next);
+        KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    }
+    DeviceExtension->TxSubmitting = FALSE;
+    CH341TxArmTimeout(DeviceExtension);
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+}
+
+static
+VOID
+CH341TxSubmit(
+    _In_ PWRITE_CONTEXT Context) {
+    PDEVICE_EXTENSION DeviceExtension = Context->DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    IoReuseIrp(Context->Irp, STATUS_SUCCESS);
+    UsbBuildInterruptOrBulkTransferRequest(Context->Urb,
+                                           sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
+                                           DeviceExtension->BulkOutPipe,
+                                           Context->Mdl ? NULL : Context->Buffer,
+                                           Context->Mdl,
+                                           Context->Length,
+                                           USBD_TRANSFER_DIRECTION_OUT,
+                                           NULL);
+    IoStack = IoGetNextIrpStackLocation(Context->Irp);
+    IoStack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    IoStack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    IoStack->Parameters.Others.Argument1 = Context->Urb;
+    IoSetCompletionRoutine(Context->Irp,
+                           CH341TxCompletion,
+                           Context,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_BULK_OUT_SUBMIT,
+                    Context,
+                    Context->Length,
+                    STATUS_SUCCESS);
+    Context->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    (VOID)IoCallDriver(DeviceExtension->LowerDevice, Context->Irp);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+static
+NTSTATUS
+NTAPI
+CH341TxCompletion(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp,
+    _In_reads_(sizeof(WRITE_CONTEXT)) PVOID Context) {
+    PWRITE_CONTEXT WriteContext = Context;
+    PDEVICE_EXTENSION DeviceExtension = WriteContext->DeviceObject->DeviceExtension;
+    NTSTATUS Status = Irp->IoStatus.Status;
+    LIST_ENTRY CompleteList;
+    PWRITE_CONTEXT Head;
+    KIRQL OldIrql;
+    BOOLEAN TxEmpty = FALSE;
+    /* We allocated the IRP ourselves, so there is no stack location for us */
+    UNREFERENCED_PARAMETER(DeviceObject);
+    NT_ASSERT(KeGetCurrentIrql() <= DISPATCH_LEVEL);
+    if (NT_SUCCESS(Status) && !USBD_SUCCESS(WriteContext->Urb->UrbHeader.Status))
+        Status = STATUS_UNSUCCESSFUL;
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_BULK_OUT_COMPLETE,
+                    WriteContext,
+                    WriteContext->Urb->UrbBulkOrInterruptTransfer.TransferBufferLength,
+                    Status);
+    CH341LatencySince(DeviceExtension, CH341_LATENCY_BULK_OUT, WriteContext->SubmitTime);
+    if (!NT_SUCCESS(Status)) {
+        CH341Warn(         "%s. Write failed with %08lx, %08lx\n",
+                           __FUNCTION__, Irp->IoStatus.Status, WriteContext->Urb->UrbHeader.Status);
+        CH341StatsAdd(DeviceExtension, BulkOutErrors, 1);
+    } else {
+        CH341StatsAdd(DeviceExtension, BulkOutTransfers, 1);
+        CH341StatsAdd(DeviceExtension,
+                      BytesTransmitted,
+                      WriteContext->Urb->UrbBulkOrInterruptTransfer.TransferBufferLength);
+    }
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    WriteContext->Status = Status;
+    WriteContext->Done = TRUE;
+    /* Transfers may finish out of order, but are retired in order */
+    while (!IsListEmpty(&DeviceExtension->TxInFlightList)) {
+        Head = CONTAINING_RECORD(DeviceExtension->TxInFlightList.Flink, WRITE_CONTEXT, ListEntry);
+        if (!Head->Done)
+            break;
+        CH341TxRetire(DeviceExtension, Head, &CompleteList);
+    }
+    if (IsListEmpty(&DeviceExtension->TxInFlightList)) {
+        if (IsListEmpty(&DeviceExtension->TxQueue)) {
+            /* Everything queued so far is on the wire, so flushes are done */
+            CH341TxRetireFlushes(DeviceExtension, STATUS_SUCCESS, &CompleteList);
+            TxEmpty = TRUE;
+        }
+        KeSetEvent(&DeviceExtension->TxIdleEvent, IO_NO_INCREMENT, FALSE);
+    }
+    CH341TxKick(DeviceExtension, OldIrql);
+    CH341WriteCompleteList(DeviceExtension, &CompleteList);
+    if (TxEmpty)
+        CH341SignalEvents(WriteContext->DeviceObject, SERIAL_EV_TXEMPTY);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+VOID
+CH341TxRetire(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PWRITE_CONTEXT Context,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    RemoveEntryList(&Context->ListEntry);
+    DeviceExtension->TxInFlightBytes -= Context->Length;
+    while (!IsListEmpty(&Context->CompleteList)) {
+        ListEntry = RemoveHeadList(&Context->CompleteList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (!NT_SUCCESS(Context->Status))
+            Irp->IoStatus.Status = Context->Status;
+        Irp->IoStatus.Information = NT_SUCCESS(Irp->IoStatus.Status) ?
+                                    IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length : 0;
+        InsertTailList(CompleteList, ListEntry);
+    }
+    /* The rest of a partially sent IRP is still queued, remember the failure */
+    if (Context->PartialIrp && !NT_SUCCESS(Context->Status))
+        Context->PartialIrp->IoStatus.Status = Context->Status;
+    Context->PartialIrp = NULL;
+    DeviceExtension->TxUrbs++;
+    if (NT_SUCCESS(Context->Status))
+        DeviceExtension->TxBytes += Context->Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
+    InsertTailList(&DeviceExtension->TxFreeList, &Context->ListEntry);
+}
+
+/*
+ * Moves the pending flushes to CompleteList. A flush whose cancel routine
+ * already ran is left to CH341FlushCancel.
+ */
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+VOID
+CH341TxRetireFlushes(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ NTSTATUS Status,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    while (!IsListEmpty(&DeviceExtension->TxFlushList)) {
+        ListEntry = RemoveHeadList(&DeviceExtension->TxFlushList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (!IoSetCancelRoutine(Irp, NULL)) {
+            /* Being canceled */
+            InitializeListHead(ListEntry);
+            continue;
+        }
+        Irp->IoStatus.Status = Status;
+        InsertTailList(CompleteList, ListEntry);
+    }
+}
+
+static
+VOID
+NTAPI
+CH341TxDeadline(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context) {
+    PDEVICE_OBJECT DeviceObject = Context;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    UNREFERENCED_PARAMETER(Timer);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    DeviceExtension->TxTimerArmed = FALSE;
+    if (DeviceExtension->TxQueuedBytes)
+        DeviceExtension->TxFlushPending = TRUE;
+    CH341TxKick(DeviceExtension, OldIrql);
+}
+
+/* Starts the total timeout of the head of TxQueue if the head has changed */
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+VOID
+CH341TxArmTimeout(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    PIRP Irp = NULL;
+    ULONG64 QpcTimeStamp;
+    if (!DeviceExtension->TxTimeoutTimer)
+        return;
+    if (!IsListEmpty(&DeviceExtension->TxQueue))
+        Irp = CONTAINING_RECORD(DeviceExtension->TxQueue.Flink, IRP, Tail.Overlay.ListEntry);
+    if (Irp == DeviceExtension->TxTimeoutIrp)
+        return;
+    DeviceExtension->TxTimeoutIrp = Irp;
+    if (!Irp || !CH341IrpWriteTimeout(Irp)) {
+        if (DeviceExtension->TxTimeoutDeadline) {
+            DeviceExtension->TxTimeoutDeadline = 0;
+            (VOID)ExCancelTimer(DeviceExtension->TxTimeoutTimer, NULL);
+        }
+        return;
+    }
+    DeviceExtension->TxTimeoutDeadline = KeQueryInterruptTimePrecise(&QpcTimeStamp) +
+                                         CH341IrpWriteTimeout(Irp);
+    (VOID)ExSetTimer(DeviceExtension->TxTimeoutTimer,
+                     -(LONGLONG)CH341IrpWriteTimeout(Irp),
+                     0,
+                     NULL);
+}
+
+/*
+ * Makes a partially sent head complete on its own: the transfers still
+ * carrying its first part forget about it.
+ */
+_Requires_lock_held_(DeviceExtension->TxLock)
+static
+VOID
+CH341TxDetachHead(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ PIRP Irp) {
+    PLIST_ENTRY Entry;
+    PWRITE_CONTEXT Context;
+    for (Entry = DeviceExtension->TxInFlightList.Flink;
+            Entry != &DeviceExtension->TxInFlightList;
+            Entry = Entry->Flink) {
+        Context = CONTAINING_RECORD(Entry, WRITE_CONTEXT, ListEntry);
+        if (Context->PartialIrp == Irp)
+            Context->PartialIrp = NULL;
+    }
+    DeviceExtension->TxHeadOffset = 0;
+}
+
+static
+VOID
+NTAPI
+CH341TxTimeout(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context) {
+    PDEVICE_OBJECT DeviceObject = Context;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    PIO_STACK_LOCATION IoStack;
+    ULONG64 QpcTimeStamp;
+    ULONG Sent;
+    KIRQL OldIrql;
+    PIRP Irp;
+    UNREFERENCED_PARAMETER(Timer);
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    Irp = DeviceExtension->TxTimeoutIrp;
+    /* The head may have moved on or been given a new deadline meanwhile */
+    if (!Irp ||
+            !DeviceExtension->TxTimeoutDeadline ||
+            KeQueryInterruptTimePrecise(&QpcTimeStamp) < DeviceExtension->TxTimeoutDeadline) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return;
+    }
+    NT_ASSERT(Irp == CONTAINING_RECORD(DeviceExtension->TxQueue.Flink, IRP, Tail.Overlay.ListEntry));
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    Sent = DeviceExtension->TxHeadOffset;
+    if (Sent) {
+        /* A partially sent head has no cancel routine */
+        CH341TxDetachHead(DeviceExtension, Irp);
+    } else if (!IoSetCancelRoutine(Irp, NULL)) {
+        /* CH341WriteCancel owns this one and will complete it */
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return;
+    }
+    CH341Debug(         "%s. Irp=%p timed out after %lu of %lu bytes\n",
+                        __FUNCTION__, Irp,             Sent, IoStack->Parameters.Write.Length);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    DeviceExtension->TxQueuedBytes -= IoStack->Parameters.Write.Length - Sent;
+    /* A failure of the part already sent takes precedence */
+    if (!Sent || NT_SUCCESS(Irp->IoStatus.Status))
+        Irp->IoStatus.Status = STATUS_TIMEOUT;
+    Irp->IoStatus.Information = Sent;
+    InsertTailList(&CompleteList, &Irp->Tail.Overlay.ListEntry);
+    if (IsListEmpty(&DeviceExtension->TxQueue) &&
+            IsListEmpty(&DeviceExtension->TxInFlightList))
+        CH341TxRetireFlushes(DeviceExtension, STATUS_SUCCESS, &CompleteList);
+    /* Starts the next head's timeout */
+    CH341TxKick(DeviceExtension, OldIrql);
+    CH341WriteCompleteList(DeviceExtension, &CompleteList);
+}
+
+NTSTATUS
+CH341StartWriteEngine(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PWRITE_CONTEXT Contexts;
+    KIRQL OldIrql;
+    ULONG i;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, WriteUrbCount=%lu, WriteCoalescing=%u, Deadline=%lu us\n",
+                        __FUNCTION__, DeviceObject,    DeviceExtension->WriteUrbCount,
+                        DeviceExtension->WriteCoalescing, DeviceExtension->WriteCoalesceDeadline);
+    NT_ASSERT(!DeviceExtension->WriteContexts);
+    NT_ASSERT(DeviceExtension->WriteUrbCount != 0);
+    Contexts = ExAllocatePoolWithTag(NonPagedPool,
+                                     DeviceExtension->WriteUrbCount * sizeof(*Contexts),
+                                     CH341_URB_TAG);
+    if (!Contexts) {
+        CH341Error(         "%s. Allocating write contexts failed\n",
+                            __FUNCTION__);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Contexts, DeviceExtension->WriteUrbCount * sizeof(*Contexts));
+    DeviceExtension->WriteContexts = Contexts;
+    InitializeListHead(&DeviceExtension->TxFreeList);
+    InitializeListHead(&DeviceExtension->TxInFlightList);
+    for (i = 0; i < DeviceExtension->WriteUrbCount; i++) {
+        Contexts[i].DeviceObject = DeviceObject;
+        InitializeListHead(&Contexts[i].CompleteList);
+        InsertTailList(&DeviceExtension->TxFreeList, &Contexts[i].ListEntry);
+        Contexts[i].Irp = IoAllocateIrp(DeviceExtension->LowerDevice->StackSize, FALSE);
+        Contexts[i].Urb = CH341UrbAllocate(DeviceObject, UrbPoolBulk);
+        if (!Contexts[i].Irp || !Contexts[i].Urb) {
+            CH341Error(         "%s. Allocating write IRP/URB %lu failed\n",
+                                __FUNCTION__, i);
+            CH341WriteFreeContexts(DeviceObject);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    DeviceExtension->TxTimer = ExAllocateTimer(CH341TxDeadline,
+                               DeviceObject,
+                               EX_TIMER_HIGH_RESOLUTION);
+    if (!DeviceExtension->TxTimer) {
+        CH341Error(         "%s. Allocating coalescing timer failed\n",
+                            __FUNCTION__);
+        CH341WriteFreeContexts(DeviceObject);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    DeviceExtension->TxTimeoutTimer = ExAllocateTimer(CH341TxTimeout,
+                                      DeviceObject,
+                                      EX_TIMER_HIGH_RESOLUTION);
+    if (!DeviceExtension->TxTimeoutTimer) {
+        CH341Error(         "%s. Allocating write timeout timer failed\n",
+                            __FUNCTION__);
+        (VOID)ExDeleteTimer(DeviceExtension->TxTimer, TRUE, TRUE, NULL);
+        DeviceExtension->TxTimer = NULL;
+        CH341WriteFreeContexts(DeviceObject);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    DeviceExtension->TxUrbs = 0;
+    DeviceExtension->TxBytes = 0;
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    NT_ASSERT(IsListEmpty(&DeviceExtension->TxQueue));
+    DeviceExtension->TxQueuedBytes = 0;
+    DeviceExtension->TxInFlightBytes = 0;
+    DeviceExtension->TxHeadOffset = 0;
+    DeviceExtension->TxSubmitting = FALSE;
+    DeviceExtension->TxFlushPending = FALSE;
+    DeviceExtension->TxTimerArmed = FALSE;
+    DeviceExtension->TxTimeoutIrp = NULL;
+    DeviceExtension->TxTimeoutDeadline = 0;
+    DeviceExtension->TxFlowCharPending = FALSE;
+    DeviceExtension->TxImmediateCharPending = FALSE;
+    DeviceExtension->HoldReasons = 0;
+    DeviceExtension->TxRunning = TRUE;
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    /*
+     * The handshake holds left from before the stop may not match the
+     * HandFlow reset in StartDevice, so they are derived again from it and
+     * the modem status the interrupt pipe, already running, has just read.
+     */
+    CH341FlowUpdateHolds(DeviceExtension);
+    return STATUS_SUCCESS;
+}
+
+/* Fails all transfers on the pipe; they retire through CH341TxCompletion */
+static
+VOID
+CH341WriteAbort(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PLIST_ENTRY ListEntry;
+    KIRQL OldIrql;
+    Status = CH341UsbAbortPipe(DeviceObject, DeviceExtension->BulkOutPipe);
+    if (!NT_SUCCESS(Status)) {
+        CH341Warn(         "%s. CH341UsbAbortPipe failed with %08lx\n",
+                           __FUNCTION__, Status);
+        KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+        for (ListEntry = DeviceExtension->TxInFlightList.Flink;
+                ListEntry != &DeviceExtension->TxInFlightList;
+                ListEntry = ListEntry->Flink)
+            (VOID)IoCancelIrp(CONTAINING_RECORD(ListEntry, WRITE_CONTEXT, ListEntry)->Irp);
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    }
+}
+
+VOID
+CH341StopWriteEngine(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ NTSTATUS Status) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    KIRQL OldIrql;
+    BOOLEAN Busy;
+    PAGED_CODE();
+    CH341Debug(         "%s. DeviceObject=%p, Status=%08lx\n",
+                        __FUNCTION__, DeviceObject,    Status);
+    if (!DeviceExtension->WriteContexts)
+        return;
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    DeviceExtension->TxRunning = FALSE;
+    while (!IsListEmpty(&DeviceExtension->TxQueue)) {
+        ListEntry = RemoveHeadList(&DeviceExtension->TxQueue);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (!IoSetCancelRoutine(Irp, NULL) && !DeviceExtension->TxHeadOffset) {
+            /* Being canceled. A partially sent head has no cancel routine */
+            InitializeListHead(ListEntry);
+            continue;
+        }
+        DeviceExtension->TxHeadOffset = 0;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        InsertTailList(&CompleteList, ListEntry);
+    }
+    CH341TxRetireFlushes(DeviceExtension, Status, &CompleteList);
+    CH341TxArmTimeout(DeviceExtension);
+    DeviceExtension->TxQueuedBytes = 0;
+    DeviceExtension->TxHeadOffset = 0;
+    DeviceExtension->TxFlushPending = FALSE;
+    Busy = !IsListEmpty(&DeviceExtension->TxInFlightList);
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    if (Busy)
+        CH341WriteAbort(DeviceObject);
+    (VOID)KeWaitForSingleObject(&DeviceExtension->TxIdleEvent,
+                                Executive,
+                                KernelMode,
+                                FALSE,
+                                NULL);
+    (VOID)ExDeleteTimer(DeviceExtension->TxTimer, TRUE, TRUE, NULL);
+    DeviceExtension->TxTimer = NULL;
+    DeviceExtension->TxTimerArmed = FALSE;
+    (VOID)ExDeleteTimer(DeviceExtension->TxTimeoutTimer, TRUE, TRUE, NULL);
+    DeviceExtension->TxTimeoutTimer = NULL;
+    DeviceExtension->TxTimeoutIrp = NULL;
+    DeviceExtension->TxTimeoutDeadline = 0;
+    CH341Debug(         "%s. %lu bulk OUT transfers, %I64u bytes\n",
+                        __FUNCTION__, DeviceExtension->TxUrbs, DeviceExtension->TxBytes);
+    CH341WriteFreeContexts(DeviceObject);
+    /* A partially sent IRP may only be completed once its transfers are retired */
+    CH341WriteCompleteList(DeviceExtension, &CompleteList);
+}
+
+/*
+ * Cancels every queued write and aborts the transfers in flight, but leaves
+ * the engine running. The transfers still carrying the first part of a
+ * partially sent head forget about it, so it can be completed right away.
+ */
+VOID
+CH341WritePurge(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    LIST_ENTRY CompleteList;
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    KIRQL OldIrql;
+    BOOLEAN Busy;
+    CH341Debug(         "%s. DeviceObject=%p\n",
+                        __FUNCTION__, DeviceObject);
+    InitializeListHead(&CompleteList);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    if (!DeviceExtension->TxRunning) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return;
+    }
+    while (!IsListEmpty(&DeviceExtension->TxQueue)) {
+        ListEntry = RemoveHeadList(&DeviceExtension->TxQueue);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        if (DeviceExtension->TxHeadOffset) {
+            CH341TxDetachHead(DeviceExtension, Irp);
+        } else if (!IoSetCancelRoutine(Irp, NULL)) {
+            /* Being canceled */
+            InitializeListHead(ListEntry);
+            continue;
+        }
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        InsertTailList(&CompleteList, ListEntry);
+    }
+    DeviceExtension->TxQueuedBytes = 0;
+    DeviceExtension->TxFlushPending = FALSE;
+    if (DeviceExtension->TxTimerArmed) {
+        DeviceExtension->TxTimerArmed = FALSE;
+        (VOID)ExCancelTimer(DeviceExtension->TxTimer, NULL);
+    }
+    /* The data the flushes were waiting for is gone with the queue */
+    CH341TxRetireFlushes(DeviceExtension, STATUS_CANCELLED, &CompleteList);
+    CH341TxArmTimeout(DeviceExtension);
+    Busy = !IsListEmpty(&DeviceExtension->TxInFlightList);
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    if (Busy)
+        CH341WriteAbort(DeviceObject);
+    CH341WriteCompleteList(DeviceExtension, &CompleteList);
+}
+
+static
+VOID
+CH341WriteFreeContexts(
+    _In_ PDEVICE_OBJECT DeviceObject) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PWRITE_CONTEXT Contexts = DeviceExtension->WriteContexts;
+    ULONG i;
+    PAGED_CODE();
+    for (i = 0; i < DeviceExtension->WriteUrbCount; i++) {
+        if (Contexts[i].Urb)
+            CH341UrbFree(DeviceObject, Contexts[i].Urb);
+        if (Contexts[i].Irp)
+            IoFreeIrp(Contexts[i].Irp);
+    }
+    ExFreePoolWithTag(Contexts, CH341_URB_TAG);
+    DeviceExtension->WriteContexts = NULL;
+    InitializeListHead(&DeviceExtension->TxFreeList);
+}
+
+static
+VOID
+CH341WriteCompleteList(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _Inout_ PLIST_ENTRY CompleteList) {
+    PLIST_ENTRY ListEntry;
+    PIRP Irp;
+    while (!IsListEmpty(CompleteList)) {
+        ListEntry = RemoveHeadList(CompleteList);
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+    }
+}
+
+static
+VOID
+NTAPI
+CH341WriteCancel(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+    KIRQL OldIrql;
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    /* The entry is self-linked if the engine already took it off TxQueue */
+    if (!IsListEmpty(&Irp->Tail.Overlay.ListEntry)) {
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        DeviceExtension->TxQueuedBytes -= IoStack->Parameters.Write.Length;
+        CH341TxArmTimeout(DeviceExtension);
+    }
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    CH341TraceCompleteIrp(DeviceExtension, Irp);
+}
+
+static
+VOID
+NTAPI
+CH341FlushCancel(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    /* The entry is self-linked if the flush was already taken off TxFlushList */
+    if (!IsListEmpty(&Irp->Tail.Overlay.ListEntry))
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    CH341TraceCompleteIrp(DeviceExtension, Irp);
+}
+
+NTSTATUS
+CH341Write(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PIO_STACK_LOCATION IoStack;
+    SERIAL_TIMEOUTS Timeouts;
+    KIRQL OldIrql;
+    CH341Verbose(       "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    IoStack = IoGetCurrentIrpStackLocation(Irp);
+    CH341TraceEvent(DeviceExtension,
+                    CH341_TRACE_EVENT_WRITE_IRP,
+                    Irp,
+                    IoStack->Parameters.Write.Length,
+                    STATUS_SUCCESS);
+    CH341IrpArrivalTime(Irp) = KeQueryPerformanceCounter(NULL).QuadPart;
+    CH341ReadGetTimeouts(DeviceObject, &Timeouts);
+    CH341IrpWriteTimeout(Irp) = CH341_MS_TO_100NS((ULONGLONG)Timeouts.WriteTotalTimeoutMultiplier *
+                                IoStack->Parameters.Write.Length +
+                                Timeouts.WriteTotalTimeoutConstant);
+    /* Direct transfers are sent from the MDL and never need mapping */
+    if (!CH341TxIsDirect(DeviceExtension, Irp) && !CH341IrpBuffer(Irp)) {
+        CH341Error(         "%s. Mapping the write buffer failed\n",
+                            __FUNCTION__);
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return Status;
+    }
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    if (!DeviceExtension->TxRunning) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        Status = STATUS_DEVICE_NOT_READY;
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = 0;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return Status;
+    }
+    IoMarkIrpPending(Irp);
+    InsertTailList(&DeviceExtension->TxQueue,
+                   &Irp->Tail.Overlay.ListEntry);
+    DeviceExtension->TxQueuedBytes += IoStack->Parameters.Write.Length;
+    (VOID)IoSetCancelRoutine(Irp, CH341WriteCancel);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL)) {
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        DeviceExtension->TxQueuedBytes -= IoStack->Parameters.Write.Length;
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        Irp->IoStatus.Information = 0;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return STATUS_PENDING;
+    }
+    CH341TxKick(DeviceExtension, OldIrql);
+    return STATUS_PENDING;
+}
+
+NTSTATUS
+CH341Flush(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PIRP Irp) {
+    NTSTATUS Status;
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, Irp=%p\n",
+                        __FUNCTION__, DeviceObject,    Irp);
+    Irp->IoStatus.Information = 0;
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    if (!DeviceExtension->TxRunning ||
+            (IsListEmpty(&DeviceExtension->TxInFlightList) &&
+             IsListEmpty(&DeviceExtension->TxQueue))) {
+        /* Nothing is held back, so there is nothing to wait for */
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        Status = STATUS_SUCCESS;
+        Irp->IoStatus.Status = Status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+        return Status;
+    }
+    IoMarkIrpPending(Irp);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    InsertTailList(&DeviceExtension->TxFlushList,
+                   &Irp->Tail.Overlay.ListEntry);
+    (VOID)IoSetCancelRoutine(Irp, CH341FlushCancel);
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL)) {
+        RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        CH341TraceCompleteIrp(DeviceExtension, Irp);
+        return STATUS_PENDING;
+    }
+    DeviceExtension->TxFlushPending = TRUE;
+    CH341TxKick(DeviceExtension, OldIrql);
+    return STATUS_PENDING;
+}
+
+/*
+ * Puts an XON or XOFF ahead of all queued data and adjusts the hold reasons
+ * in one step, so the two cannot be reordered against another flow change.
+ * Callers may hold RxLock, so the character only goes out with the next
+ * CH341WriteKick.
+ */
+VOID
+CH341WriteQueueFlowChar(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ UCHAR Char,
+    _In_ ULONG HoldSet,
+    _In_ ULONG HoldClear) {
+    KIRQL OldIrql;
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    /* A flow character not sent yet is superseded */
+    DeviceExtension->TxFlowChar = Char;
+    DeviceExtension->TxFlowCharPending = TRUE;
+    DeviceExtension->HoldReasons = (DeviceExtension->HoldReasons & ~HoldClear) | HoldSet;
+    KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+}
+
+NTSTATUS
+CH341WriteImmediateChar(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ UCHAR Char) {
+    PDEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL OldIrql;
+    CH341Debug(         "%s. DeviceObject=%p, Char=%02x\n",
+                        __FUNCTION__, DeviceObject,    Char);
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    if (!DeviceExtension->TxRunning) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return STATUS_DEVICE_NOT_READY;
+    }
+    if (DeviceExtension->TxImmediateCharPending) {
+        KeReleaseSpinLock(&DeviceExtension->TxLock, OldIrql);
+        return STATUS_INVALID_PARAMETER;
+    }
+    DeviceExtension->TxImmediateChar = Char;
+    DeviceExtension->TxImmediateCharPending = TRUE;
+    CH341TxKick(DeviceExtension, OldIrql);
+    return STATUS_SUCCESS;
+}
+
+VOID
+CH341WriteSetHold(
+    _In_ PDEVICE_EXTENSION DeviceExtension,
+    _In_ ULONG HoldSet,
+    _In_ ULONG HoldClear) {
+    KIRQL OldIrql;
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    DeviceExtension->HoldReasons = (DeviceExtension->HoldReasons & ~HoldClear) | HoldSet;
+    CH341TxKick(DeviceExtension, OldIrql);
+}
+
+VOID
+CH341WriteKick(
+    _In_ PDEVICE_EXTENSION DeviceExtension) {
+    KIRQL OldIrql;
+    KeAcquireSpinLock(&DeviceExtension->TxLock, &OldIrql);
+    CH341TxKick(DeviceExtension, OldIrql);
+}